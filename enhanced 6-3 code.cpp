@@ -1,25 +1,74 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <cstring>          // strcmp
+#include <cmath>            // cbrt, ceil
+#include <cfloat>           // FLT_MAX
+#include <chrono>           // steady_clock
+#include <random>           // mt19937
+#include <algorithm>        // find, max
+#include <cstdint>          // uint32_t, uint64_t
+#include <cstddef>          // offsetof
+#include <cctype>           // isspace, tolower
+#include <charconv>         // from_chars
+#include <thread>           // thread, hardware_concurrency
+#include <functional>       // function
+#include <atomic>           // atomic
+#include <mutex>            // mutex, lock_guard
+#include <condition_variable> // condition_variable
+#include <deque>            // deque
+#include <memory>           // unique_ptr
+#include <vector>           // vector
+#include <string>           // string
+#include <unordered_map>    // unordered_map
+#include <filesystem>       // filesystem::exists, create_directories
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>      // SSE/AVX intrinsics for frustum culling
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>      // Image loading Utility functions
 #include <stdio.h>
 
+// Memory-mapped file access for the mesh loaders
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// EGL is only used for the headless (offscreen) mode on Linux render nodes
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 // GLM Math Header inclusions
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include <learnOpengl/camera.h> // Camera class
 
 using namespace std; // Standard namespace
+namespace fs = std::filesystem;
 
 /*Shader program Macro*/
 #ifndef GLSL
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+/*Shader include Macro: shared source inserted after the #version line of every shader*/
+#ifndef GLSL_INCLUDE
+#define GLSL_INCLUDE(Source) #Source "\n"
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -29,38 +78,825 @@ const char* const WINDOW_TITLE = "Tutorial 6.3"; // Macro for window title
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
 
+// Depth range of the camera projection
+const float CAMERA_NEAR_PLANE = 0.1f;
+const float CAMERA_FAR_PLANE = 100.0f;
+
 // Stores the GL data relative to a given mesh
 struct GLMesh
 {
     GLuint vao;         // Handle for the vertex array object
     GLuint vbo;         // Handle for the vertex buffer object
-    GLuint nVertices;    // Number of indices of the mesh
+    GLuint ebo;         // Handle for the element (index) buffer object
+    GLuint nVertices;    // Number of unique vertices of the mesh
+    GLuint nIndices;     // Number of indices of the mesh
+    GLenum indexType;    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLint layout;        // VERTEX_LAYOUT_FLOAT or VERTEX_LAYOUT_COMPACT
+    glm::vec3 positionScale;    // Dequantization scale applied to positions in the vertex shader
+    glm::vec3 positionOffset;   // Dequantization offset applied to positions in the vertex shader
+    glm::vec3 boundsCenter;     // Bounding sphere of the positions, in mesh units
+    float boundsRadius;
+};
+
+// GPU vertex layouts a mesh can be uploaded with
+const GLint VERTEX_LAYOUT_FLOAT = 0;    // 32 bytes: float position, normal and uv
+const GLint VERTEX_LAYOUT_COMPACT = 1;  // 16 bytes: snorm16 position, 2_10_10_10 normal, unorm16 uv
+
+// Compact vertex: position quantized to the mesh bounds, packed normal and normalized UVs
+struct CompactVertex
+{
+    GLshort position[4];    // snorm16 position relative to the mesh bounds (w is padding)
+    GLuint normal;          // GL_INT_2_10_10_10_REV normalized normal
+    GLushort uv[2];         // unorm16 texture coordinates, only used when every uv is within [0, 1]
+};
+static_assert(sizeof(CompactVertex) == 16, "CompactVertex must stay tightly packed");
+
+// Interleaved vertex layout shared by every mesh: position(3) + normal(3) + uv(2) floats
+const GLuint FLOATS_PER_POSITION = 3;
+const GLuint FLOATS_PER_NORMAL = 3;
+const GLuint FLOATS_PER_UV = 2;
+const GLuint FLOATS_PER_VERTEX = FLOATS_PER_POSITION + FLOATS_PER_NORMAL + FLOATS_PER_UV;
+
+// Size of the FIFO post-transform cache simulated when reporting ACMR
+const int VERTEX_CACHE_SIZE = 16;
+
+// CPU-side indexed mesh in the interleaved layout, ready to upload
+struct MeshData
+{
+    std::vector<GLfloat> vertices;  // FLOATS_PER_VERTEX floats per unique vertex
+    std::vector<GLuint> indices;    // Three indices per triangle
+};
+
+// Read-only memory mapping of a whole file
+struct MappedFile
+{
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+// Per-chunk element counts gathered by the first pass over an OBJ file
+struct ObjChunkCounts
+{
+    int64_t positions = 0;
+    int64_t uvs = 0;
+    int64_t normals = 0;
+    int64_t triangles = 0;
+};
+
+// Parsed JSON value, enough to walk a glTF document
+struct JsonValue
+{
+    enum Type { Null, Bool, Number, String, Array, Object };
+    Type type = Null;
+    bool boolean = false;
+    double number = 0.0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;   // Members in file order
+};
+
+// Bytes of one glTF buffer: a mapped .bin file, the GLB binary chunk or a decoded data URI
+struct GltfBuffer
+{
+    const unsigned char* data;
+    size_t size;
+};
+
+// Strided view of a glTF accessor inside its buffer
+struct GltfAccessorView
+{
+    const unsigned char* data = nullptr;
+    size_t count = 0;
+    size_t stride = 0;
+    int componentType = 0;  // GL enum value: 5120 byte ... 5126 float
+    int components = 0;
+    bool normalized = false;
+};
+
+// Vertex data converted to its GPU layout, plus what the shader needs to decode it
+struct PackedVertices
+{
+    GLint layout;
+    std::vector<unsigned char> bytes;
+    glm::vec3 positionScale;
+    glm::vec3 positionOffset;
+};
+
+// GPU-ready mesh bytes, either built at startup or pointing into a mapped asset pack
+struct MeshBlob
+{
+    GLint layout;
+    glm::vec3 positionScale;
+    glm::vec3 positionOffset;
+    GLuint nVertices;
+    GLuint nIndices;
+    GLenum indexType;           // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    const void* vertices;
+    size_t vertexBytes;
+    const void* indices;
+    size_t indexBytes;
+};
+
+// Cooked asset pack: a header, a table of contents, then every blob at a PACK_ALIGNMENT-aligned
+// offset in exactly the byte layout glBufferData/glTexImage2D consume. Little-endian only
+const uint32_t PACK_MAGIC = 0x4B50564E; // "NVPK"
+const uint32_t PACK_VERSION = 1;
+const uint64_t PACK_ALIGNMENT = 256;
+const uint32_t PACK_SECTION_MESH = 1;
+const uint32_t PACK_SECTION_TEXTURE = 2;
+
+// Section names used by the cook step and at startup
+const char* const PACK_CUBE_MESH = "cube";
+const char* const PACK_MODEL_MESH = "model";
+const char* const PACK_DIFFUSE_TEXTURE = "diffuse";
+
+struct PackHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sectionCount;
+    uint32_t reserved;
+};
+
+// One table of contents entry; mesh sections use the vertex/index fields, textures the image fields
+struct PackSection
+{
+    char name[32];
+    uint32_t type;
+    uint32_t vertexLayout;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexType;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    float positionScale[3];
+    float positionOffset[3];
+    uint64_t dataOffset;    // Vertex bytes or pixels
+    uint64_t dataSize;
+    uint64_t indexOffset;
+    uint64_t indexSize;
+    uint32_t reserved[2];
+};
+static_assert(sizeof(PackSection) == 128, "PackSection is written to disk and must keep its size");
+
+// An asset pack mapped into memory for the lifetime of the uploads
+struct AssetPack
+{
+    MappedFile file;
+    const PackHeader* header = nullptr;
+    const PackSection* sections = nullptr;
+};
+
+// One precomputed mip level of a block-compressed texture, inside its mapped container
+struct CompressedLevel
+{
+    size_t offset;
+    size_t size;
+    int width;
+    int height;
+};
+
+// One texture streamed in by the loader; lives in TextureLoader::pending until it is resident
+struct AsyncTexture
+{
+    std::string path;
+    GLuint texture = 0;             // Name handed out by URequestTexture
+    unsigned char* pixels = nullptr; // Decoded by a worker, freed once staged
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    std::string error;              // Set by the worker when decoding fails
+    GLenum compressedFormat = 0;    // Block-compressed internal format; 0 for decoded images
+    MappedFile file;                // KTX2/DDS container the compressed levels point into
+    std::vector<CompressedLevel> levels; // Precomputed mip chain, largest first
+    GLuint pbo = 0;                 // Pixel-unpack buffer of the upload in flight
+    GLsync fence = 0;               // Signals when the upload and mipmap generation are done
+};
+
+// Decode threads plus the queues connecting them to the GL thread
+struct TextureLoader
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;                       // Guards decodeQueue, decoded and stopping
+    std::condition_variable wake;
+    std::deque<AsyncTexture*> decodeQueue;  // Waiting for a worker
+    std::deque<AsyncTexture*> decoded;      // Waiting for the GL thread to upload
+    bool stopping = false;
+
+    // GL thread only
+    std::unordered_map<GLuint, std::unique_ptr<AsyncTexture>> pending; // Not yet resident, by texture name
+    std::vector<AsyncTexture*> uploading;   // Staged, waiting for their fence
+    size_t failedCount = 0;                 // Pending entries that will never become resident
+    GLuint placeholder = 0;                 // Bound in place of pending textures
+};
+
+// Stores a linked shader program and everything reflected from it at link time
+struct ShaderProgram
+{
+    GLuint id = 0;                                      // Handle for the linked program
+    std::unordered_map<std::string, GLint> uniforms;    // Active uniform name -> location
+    std::unordered_map<std::string, GLint> attributes;  // Active attribute name -> location
+    std::unordered_map<std::string, GLint> uniformBlocks; // Active uniform block name -> binding point
+};
+
+// Shader feature flags. Every combination in use is compiled as its own program variant, so a
+// material only pays for the features it has. Lights are counted above the flags
+const uint32_t SHADER_TEXTURED = 1u << 0;      // Samples the material texture
+const uint32_t SHADER_SPECULAR = 1u << 1;      // Adds the Phong specular term
+const uint32_t SHADER_INSTANCED = 1u << 2;     // Model and normal matrices and tint come from the instance buffer
+const uint32_t SHADER_CLUSTERED = 1u << 3;     // Adds the point lights of the fragment's light cluster
+const uint32_t SHADER_GBUFFER = 1u << 4;       // Writes the surface to the G-buffer instead of shading it
+const uint32_t SHADER_LIGHT_SHIFT = 8;
+const int MAX_SHADER_LIGHTS = 1;               // FrameData carries a single light
+
+// Surface description used to pick a shader variant and fill in its uniforms
+struct Material
+{
+    uint32_t features = 0;                  // SHADER_TEXTURED and/or SHADER_SPECULAR
+    int lightCount = 1;                     // 0 draws the color unlit
+    GLuint textureId = 0;
+    glm::vec2 uvScale = glm::vec2(1.0f);
+    glm::vec3 color = glm::vec3(1.0f);      // Multiplied into the texture and instance tint
+    float ambientStrength = 0.1f;
+    float specularIntensity = 0.8f;
+    float highlightSize = 16.0f;
+};
+
+// Cached uniform locations of a material variant, resolved once after linking. Variants
+// without a feature lack its uniforms, and their handles stay -1
+struct MaterialUniforms
+{
+    GLint uTexture;
+    GLint uvScale;
+    GLint positionScale;
+    GLint positionOffset;
+    GLint model;
+    GLint normalMatrix;
+    GLint instanceBase;
+    GLint materialColor;
+    GLint ambientStrength;
+    GLint specularIntensity;
+    GLint highlightSize;
+};
+
+// One compiled permutation of the material shaders
+struct ShaderVariant
+{
+    ShaderProgram program;
+    MaterialUniforms uniforms;
+    bool resolved = false;      // Uniform handles looked up
+};
+
+// On-disk program binary cache counters, reported once the programs are linked
+struct ShaderCacheStats
+{
+    int hits = 0;
+    int misses = 0;
+    double savedMs = 0.0;   // Recorded compile+link time of every hit, minus the time spent loading it
+};
+
+// One program of a shader batch, between submission and completion
+struct PendingProgram
+{
+    const char* vertexSource;
+    const char* fragmentSource;
+    std::string defines;        // Inserted after the #version line of both stages
+    ShaderProgram* program;
+    GLuint vertexShader = 0;
+    GLuint fragmentShader = 0;
+    std::string cachePath;
+    bool fromCache = false;     // Loaded with glProgramBinary; nothing left to wait for
+    std::chrono::steady_clock::time_point start;
+};
+
+// Programs compiled together: by the driver's own threads with KHR_parallel_shader_compile,
+// otherwise on a worker thread with a context sharing objects with the main one
+struct ShaderBatch
+{
+    std::vector<PendingProgram> programs;
+    bool parallelExtension = false;
+    std::thread worker;
+    std::atomic<bool> workerDone{ false };
+    bool workerOk = true;       // Written by the worker, read after joining it
+};
+
+// Header in front of every cached program binary
+struct ShaderCacheHeader
+{
+    uint32_t magic;
+    GLenum format;          // Driver-specific binary format from glGetProgramBinary
+    uint32_t length;
+    float compileMs;        // What building the program from source cost when the entry was written
+};
+const uint32_t SHADER_CACHE_MAGIC = 0x48435053; // "SPCH"
+
+// Binding point of the per-frame uniform block read by every program
+const GLuint FRAME_DATA_BINDING = 0;
+
+// CPU mirror of the std140 FrameData block in frameDataBlockSource.
+// vec3 values are stored as vec4 because std140 pads them to 16 bytes anyway
+struct FrameData
+{
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 viewProjection;   // projection * view, multiplied once on the CPU
+    glm::vec4 viewPosition;     // xyz = camera position
+    glm::vec4 lightPosition;    // xyz = light position
+    glm::vec4 lightColor;       // rgb = light color
+};
+static_assert(sizeof(FrameData) == 240, "FrameData must match the std140 layout of the shader block");
+
+// Binding point of the per-instance storage buffer read by the cube vertex shader
+const GLuint INSTANCE_DATA_BINDING = 1;
+
+// CPU mirror of one std430 Instance record, fetched in the shader with gl_InstanceID.
+// The matrices are written by UUpdateTransforms
+struct InstanceData
+{
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3];  // Columns of the inverse transpose of the model's 3x3 (a std430 mat3)
+    glm::vec4 color;            // rgb tint multiplied into the lit texture color
+};
+static_assert(sizeof(InstanceData) == 128, "InstanceData must match the std430 layout of the shader struct");
+
+// Position, rotation and scale of a set of objects, one array per component, so the matrix
+// update loads 4 consecutive objects per register. Only entries flagged dirty are rebuilt
+struct TransformTable
+{
+    std::vector<float> positionX;
+    std::vector<float> positionY;
+    std::vector<float> positionZ;
+    std::vector<float> rotationX;   // Unit quaternion
+    std::vector<float> rotationY;
+    std::vector<float> rotationZ;
+    std::vector<float> rotationW;
+    std::vector<float> scaleX;
+    std::vector<float> scaleY;
+    std::vector<float> scaleZ;
+    std::vector<uint8_t> dirty;
+    size_t dirtyCount = 0;
+};
+
+// Half-open run of transforms rebuilt by one UUpdateTransforms call
+struct TransformRange
+{
+    size_t begin;
+    size_t end;
+};
+
+// Flattened scene hierarchy. Nodes are stored depth first, so a parent always precedes its children
+// and every subtree is the contiguous range [node, subtreeEnd[node]). World matrices are propagated
+// in one forward pass over the subtrees of the nodes that moved
+struct SceneGraph
+{
+    TransformTable local;                       // Relative to the parent
+    std::vector<InstanceData> localMatrices;    // Matrices of local (the color field is unused)
+    std::vector<InstanceData> world;            // localMatrices combined with every ancestor
+    std::vector<int32_t> parent;                // -1 for roots
+    std::vector<uint32_t> subtreeEnd;
+    std::vector<int32_t> instance;              // Cube instance drawn at the node, -1 for none
+};
+
+// Binding point of the compacted list of visible instance indices the cube vertex shader draws
+const GLuint VISIBLE_INSTANCE_BINDING = 2;
+
+// World-space bounding spheres of the instances, one array per component, so the culling loop
+// loads 8 consecutive objects per register
+struct InstanceBounds
+{
+    std::vector<float> centerX;
+    std::vector<float> centerY;
+    std::vector<float> centerZ;
+    std::vector<float> radius;
+};
+
+// View frustum as 6 planes (left, right, bottom, top, near, far), normalized so that
+// dot(normal, p) + d is the signed distance of p; positive inside
+struct FrustumPlanes
+{
+    glm::vec4 planes[6];
+};
+
+// Below this many instances the cull runs on the calling thread; above, it is split across workers
+const size_t CULL_PARALLEL_THRESHOLD = 1 << 14;
+
+// Same for the transform update and propagation, counted in dirty entries and nodes to visit
+const size_t TRANSFORM_PARALLEL_THRESHOLD = 1 << 14;
+
+// Where a recorded draw takes its objects from
+const uint32_t DRAW_FROM_VISIBLE_LIST = 0;  // instanceCount instances whose indices start at firstVisible
+const uint32_t DRAW_FROM_INDIRECT = 1;      // The record written by the culling compute shader
+const uint32_t DRAW_SINGLE = 2;             // One object, not instanced, with the matrices in transform
+
+// One draw recorded for the render queue, by a culling job or by URender
+struct DrawCommand
+{
+    const GLMesh* mesh;
+    const Material* material;
+    uint32_t source;
+    GLuint firstVisible;
+    GLsizei instanceCount;
+    const InstanceData* transform;
+    float depth;                    // Distance of the nearest drawn point past the near plane
+};
+
+// Binding points of the clustered lighting buffers read by the material fragment shader
+const GLuint POINT_LIGHT_BINDING = 4;
+const GLuint LIGHT_CLUSTER_BINDING = 5;
+const GLuint LIGHT_INDEX_BINDING = 6;
+
+// View-space light clusters: screen tiles times depth slices spaced exponentially from the near
+// to the far plane, so slices stay roughly cube shaped
+const int CLUSTER_GRID_X = 16;
+const int CLUSTER_GRID_Y = 9;
+const int CLUSTER_GRID_Z = 24;
+const int CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+const int MAX_POINT_LIGHTS = 1 << 16;
+
+// Below this many point lights they are animated and bounded on the calling thread
+const size_t LIGHT_PARALLEL_THRESHOLD = 1 << 10;
+
+// Point light as the fragment shader reads it (std430)
+struct PointLight
+{
+    glm::vec4 positionRadius;   // xyz = world position, w = distance at which its light reaches zero
+    glm::vec4 color;
+};
+
+// Fixed circular path of one animated point light
+struct PointLightOrbit
+{
+    glm::vec3 center;
+    float orbitRadius;
+    float angularVelocity;
+    float phase;
+    float radius;
+    glm::vec3 color;
+};
+
+// Inclusive cluster ranges a light touches this frame; z0 > z1 when it is outside the frustum
+struct LightClusterBounds
+{
+    int x0, x1;
+    int y0, y1;
+    int z0, z1;
+};
+
+// Clustered forward lighting. Every frame the point lights are moved, bounded in view space and
+// binned into the clusters they touch, one depth slice per job; lit fragments then only visit the
+// lights of their own cluster
+struct LightClusters
+{
+    std::vector<PointLightOrbit> orbits;
+    std::vector<PointLight> lights;                 // This frame's lights, as uploaded
+    std::vector<LightClusterBounds> bounds;
+    std::vector<GLuint> grid;                       // Offset into the index list and light count, per cluster
+    std::vector<std::vector<GLuint>> sliceIndices;  // Light index lists of each depth slice
+    GLuint lightSsbo = 0;
+    GLuint gridSsbo = 0;
+    GLuint indexSsbo = 0;
+    size_t indexCount = 0;                          // Entries binned this frame
+};
+
+// Render queue sort keys, most significant field first: pass, program variant, texture, mesh and
+// a depth bucket. Draws that share state end up adjacent, and opaque ones run front to back
+// within each group. The low 12 bits are unused
+const int RENDER_KEY_PASS_SHIFT = 60;       // 4 bits
+const int RENDER_KEY_PROGRAM_SHIFT = 48;    // 12 bits of the shader variant key
+const int RENDER_KEY_TEXTURE_SHIFT = 36;    // 12 bits of the texture name
+const int RENDER_KEY_MESH_SHIFT = 28;       // 8 bits of the vertex array name
+const int RENDER_KEY_DEPTH_SHIFT = 12;      // 16 bits
+const uint32_t RENDER_PASS_GBUFFER = 0;     // Lit opaque draws of deferred frames
+const uint32_t RENDER_PASS_OPAQUE = 1;      // Forward draws
+
+struct RenderQueueEntry
+{
+    uint64_t key;
+    uint32_t command;   // Index into RenderQueue::commands
+};
+
+// Every draw of a frame, recorded in any order and drawn in key order
+struct RenderQueue
+{
+    std::vector<DrawCommand> commands;
+    std::vector<RenderQueueEntry> entries;
+    std::vector<RenderQueueEntry> scratch;  // Radix sort ping-pong buffer
+    int unsortedStateChanges = 0;           // Program, texture and mesh changes in recording order
+    int sortedStateChanges = 0;             // The same, in the order drawn
+};
+
+// Binding point of the indirect draw record written by the culling compute shader
+const GLuint DRAW_COMMAND_BINDING = 3;
+
+// Invocations per culling workgroup, and how many frames the visible count read back trails by
+const GLuint GPU_CULL_GROUP_SIZE = 64;
+const int GPU_CULL_READBACK_FRAMES = 3;
+
+// DrawElementsIndirectCommand, followed by the draw count glMultiDrawElementsIndirectCount reads
+struct GpuDrawCommands
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+    GLuint drawCount;
+};
+
+// GPU-driven culling: a compute shader tests every instance, appends the survivors to the visible
+// list and counts them into an indirect draw, so the CPU work of a frame no longer grows with the
+// population. The visible count is copied out and read a few frames later, only for the stats
+struct GpuCuller
+{
+    ShaderProgram program;
+    GLint frustumPlanes = -1;
+    GLint meshBounds = -1;
+    GLint populationSize = -1;
+    GLuint commandBuffer = 0;
+    GLuint readbackBuffers[GPU_CULL_READBACK_FRAMES] = {};
+    GLsync readbackFences[GPU_CULL_READBACK_FRAMES] = {};
+    unsigned frame = 0;
+    int visibleCount = 0;   // Last count read back
+};
+
+// Texture units the G-buffer is read from while the deferred lighting programs run
+const GLuint GBUFFER_ALBEDO_UNIT = 1;
+const GLuint GBUFFER_NORMAL_UNIT = 2;
+const GLuint GBUFFER_HIGHLIGHT_UNIT = 3;
+const GLuint GBUFFER_DEPTH_UNIT = 4;
+
+// One deferred lighting program and the uniforms the lighting pass sets
+struct DeferredLightProgram
+{
+    ShaderProgram program;
+    GLint inverseViewProjection = -1;
+    GLint viewportSize = -1;
+    GLint positionScale = -1;
+    GLint positionOffset = -1;
+};
+
+// Deferred shading: lit opaque draws write their surface attributes here instead of shading, then
+// every pixel is lit once per light that reaches it. Built on the first deferred frame
+struct GBuffer
+{
+    GLuint fbo = 0;
+    GLuint albedo = 0;      // RGBA8: base color, ambient strength
+    GLuint normal = 0;      // RGBA16F: world normal, specular intensity
+    GLuint highlight = 0;   // R16F: specular highlight size
+    GLuint depth = 0;
+    int width = 0;
+    int height = 0;
+    DeferredLightProgram screen;    // Ambient and the lamp, over the whole screen
+    DeferredLightProgram volumes;   // Point lights, inside their volumes
+    bool failed = false;            // Could not be built; frames stay forward
+};
+
+// Buffer targets and capabilities whose state the GL state cache tracks. GL_ELEMENT_ARRAY_BUFFER is
+// part of the bound VAO, so it is always bound directly
+const GLenum CACHED_BUFFER_TARGETS[] = { GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER, GL_COPY_READ_BUFFER,
+                                         GL_COPY_WRITE_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_PARAMETER_BUFFER_ARB,
+                                         GL_PIXEL_PACK_BUFFER, GL_PIXEL_UNPACK_BUFFER };
+const GLenum CACHED_CAPABILITIES[] = { GL_DEPTH_TEST, GL_BLEND, GL_CULL_FACE };
+const int CACHED_BUFFER_TARGET_COUNT = sizeof(CACHED_BUFFER_TARGETS) / sizeof(CACHED_BUFFER_TARGETS[0]);
+const int CACHED_CAPABILITY_COUNT = sizeof(CACHED_CAPABILITIES) / sizeof(CACHED_CAPABILITIES[0]);
+const GLuint CACHED_TEXTURE_UNITS = 16;
+
+// Shadow copy of the main context's bindings and fixed-function state. The U* wrappers skip a
+// call whose value is already current, and count both outcomes per frame. It starts out as a new
+// context's defaults, so every change on that context must go through the wrappers, deletes
+// included: GL unbinds a deleted object, and its recycled name must not look bound
+struct GLStateCache
+{
+    GLuint program = 0;
+    GLuint vertexArray = 0;
+    GLuint activeTextureUnit = 0;
+    GLuint textures[CACHED_TEXTURE_UNITS] = {};     // GL_TEXTURE_2D binding of each unit
+    GLuint buffers[CACHED_BUFFER_TARGET_COUNT] = {};
+    bool capabilities[CACHED_CAPABILITY_COUNT] = {};
+    glm::vec4 clearColor = glm::vec4(0.0f);
+    int issued = 0;     // State calls passed to GL since the frame started
+    int elided = 0;     // State calls skipped as redundant
+};
+
+// A job, and the counter of its batch that drops by one when it returns
+struct Job
+{
+    std::function<void()> run;
+    std::atomic<int>* pending;
+};
+
+// Jobs queued by one thread. The owner pushes and pops at the back; idle threads steal from the front
+struct JobQueue
+{
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+// Work-stealing job system: one queue per thread, queue 0 belonging to the main thread. Waiting
+// threads run queued jobs instead of blocking, so jobs may submit and wait for jobs of their own
+struct JobSystem
+{
+    std::vector<std::unique_ptr<JobQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<int> queued{ 0 };       // Jobs in all queues; idle workers sleep while it is 0
+    std::atomic<bool> stopping{ false };
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+};
+
+// One timed scope. Times are nanoseconds since the profiler started, GPU times included
+struct ProfileEvent
+{
+    const char* name;       // Static string, so events can be copied around freely
+    uint64_t start;
+    uint64_t duration;
+    uint32_t frame;
+    uint32_t thread;        // PROFILE_GPU_THREAD for GPU ranges
+};
+const uint32_t PROFILE_GPU_THREAD = 1000;
+
+// Bounded multi-producer, multi-consumer ring (Vyukov's queue): every slot carries a sequence number
+// that says whether it is free for the producer at that position or holds an event for the consumer.
+// Pushing into a full ring fails instead of waiting, so timed threads never block on the profiler
+struct ProfileSlot
+{
+    std::atomic<size_t> sequence;
+    ProfileEvent event;
+};
+struct ProfileRing
+{
+    std::unique_ptr<ProfileSlot[]> slots;
+    size_t mask = 0;
+    std::atomic<size_t> head{ 0 };  // Next position to pop
+    std::atomic<size_t> tail{ 0 };  // Next position to push
+};
+
+// A pair of GL_TIMESTAMP queries around one GPU range, read back frames later once available
+struct GpuQueryPair
+{
+    GLuint begin = 0;
+    GLuint end = 0;
+    const char* name = nullptr;
+    uint32_t frame = 0;
+    bool inFlight = false;
+};
+
+// Returned by UProfileBegin and handed back to UProfileEnd
+struct ProfileMark
+{
+    const char* name;
+    uint64_t start;
+    int gpuQuery;           // Index into Profiler::gpuQueries, -1 for CPU-only scopes
+};
+
+// CPU scopes from any thread and GPU ranges from the GL thread, collected for a Chrome trace
+struct Profiler
+{
+    std::atomic<bool> enabled{ false };
+    std::chrono::steady_clock::time_point origin;
+    int64_t gpuOffset = 0;                  // CPU time minus GL_TIMESTAMP, in nanoseconds
+    ProfileRing ring;
+    std::vector<GpuQueryPair> gpuQueries;   // Used round robin
+    size_t nextGpuQuery = 0;
+    std::vector<ProfileEvent> history;      // Everything drained from the ring so far
+    std::atomic<uint64_t> dropped{ 0 };     // Events lost to a full ring or a busy query pair
+    std::atomic<uint32_t> renderThread{ UINT32_MAX }; // Trace id of the render thread of windowed runs
+};
+const size_t PROFILE_RING_SIZE = 1 << 16;   // Power of two
+const size_t PROFILE_GPU_QUERIES = 256;     // Enough for several frames of passes in flight
+const size_t PROFILE_HISTORY_LIMIT = 1 << 22;
+
+// Simulation results the renderer needs, as of one fixed step. The pose of the step before is
+// kept alongside, so the renderer can interpolate between the two
+struct SimState
+{
+    uint64_t step = 0;
+    std::chrono::steady_clock::time_point time;     // When the step was due
+    Camera camera;
+    Camera previousCamera;
+    glm::vec3 lightPosition;
+    glm::vec3 previousLightPosition;
+    glm::vec2 uvScale;
+    GLint texWrapMode;          // Applied by the renderer, which owns the GL context
+    float elapsed = 0.0f;       // Simulated seconds, which drive the point light orbits
+    bool deferred = false;      // Deferred instead of forward shading; applied by the renderer
+};
+
+// Lock-free triple buffer of simulation states. The simulation fills its back slot and swaps it
+// with the middle one; the renderer swaps the middle slot with its front one when a newer state
+// is waiting. Neither side ever waits for the other
+struct SimStateBuffer
+{
+    SimState slots[3];
+    std::atomic<uint32_t> middle{ 1 };  // Slot index, plus SIM_STATE_FRESH until the renderer takes it
+    uint32_t back = 0;                  // Simulation thread only
+    uint32_t front = 2;                 // Render thread only
+};
+const uint32_t SIM_STATE_FRESH = 4;
+const float SIM_TIMESTEP = 1.0f / 120.0f;
+const int SIM_MAX_CATCHUP_STEPS = 8;    // After a longer stall the simulation skips ahead instead
+
+// One point of the benchmark matrix
+struct BenchmarkScene
+{
+    int instances;
+    int textureSize;
+    int lightCount;
+    bool deferred;
+};
+
+// Measurements of one benchmark scene, milliseconds unless noted
+struct BenchmarkResult
+{
+    BenchmarkScene scene;
+    int frames;
+    double fps;
+    double cpu[3];          // p50, p95, p99 of the CPU time spent issuing a frame
+    double gpu[3];          // p50, p95, p99 of GL_TIME_ELAPSED over a frame
+    double drawCalls;       // Per frame
+    double stateIssued;     // GL state calls passed on by the state cache, per frame
+    double stateElided;     // GL state calls it skipped as redundant, per frame
+    double visible;         // Instances left after frustum culling, per frame
 };
 
 // Main GLFW window
 GLFWwindow* gWindow = nullptr;
 // Triangle mesh data
 GLMesh gMesh;
+// Optional model loaded with --mesh; drawn instead of the cube, while the lamp keeps using gMesh
+const char* gModelPath = nullptr;
+GLMesh gModelMesh;
+GLMesh* gObjectMesh = &gMesh;
 // Texture
+const char* gTextureFilename = "../../resources/textures/smiley.png"; // PNG/JPG, or KTX2/DDS with a precomputed mip chain
 GLuint gTextureId;
-glm::vec2 gUVScale(5.0f, 5.0f);
+// Background texture streaming, and the bytes it may upload per frame
+TextureLoader gTextureLoader;
+size_t gTextureUploadBudget = 8 << 20;
 GLint gTexWrapMode = GL_REPEAT;
 
-// Shader programs
-GLuint gCubeProgramId;
-GLuint gLampProgramId;
+// Shader variants by key (feature flags and light count), compiled on first use
+std::unordered_map<uint32_t, ShaderVariant> gShaderVariants;
+
+// Textured, specular cubes and an unlit white lamp
+Material gCubeMaterial;
+Material gLampMaterial;
+
+// Frame jobs (culling, transforms) and parallel loaders, from the render loop on
+JobSystem gJobs;
+thread_local unsigned gJobQueueIndex = 0;   // Queue owned by the calling thread
 
-// camera
+// Frame profiler; --profile FILE.json turns it on and writes a Chrome trace on exit
+Profiler gProfiler;
+const char* gProfilePath = nullptr;
+
+// Per-frame camera and light data, uploaded once and shared by all programs
+GLuint gFrameUbo = 0;
+
+// Cooked asset pack: --cook writes one and exits, --pack loads every asset from one
+const char* gCookPath = nullptr;
+const char* gPackPath = nullptr;
+
+// Linked program binaries are cached here, keyed by source and driver; nullptr disables the cache
+const char* gShaderCacheDir = "shader_cache";
+ShaderCacheStats gShaderCacheStats;
+
+// Largest position error (in mesh units) accepted from the compact vertex layout; 0 always uses floats
+float gVertexPrecision = 0.001f;
+
+// Cube population drawn with a single instanced call
+int gInstanceCount = 1;         // Population size; 1 draws the original single cube
+GLuint gInstanceSsbo = 0;       // Storage buffer holding one InstanceData per cube
+std::vector<InstanceData> gInstanceData;    // CPU copy of gInstanceSsbo; moved ranges are re-uploaded
+
+// Every cube and the lamp are nodes of one scene; cube instances are numbered in node order
+SceneGraph gScene;
+int gLampNode = -1;
+
+// Frustum culling of the population; --no-cull draws every instance
+bool gCullInstances = true;
+InstanceBounds gInstanceBounds;
+std::vector<GLuint> gVisibleInstances;  // Indices of the instances that passed, compacted per slice every frame
+std::vector<std::vector<DrawCommand>> gDrawLists;  // One command list per culling slice, queued in slice order
+GLuint gVisibleSsbo = 0;
+int gFrameVisibleInstances = 0;         // Instances drawn by the last URender
+bool gGpuCulling = false;               // --gpu-cull: cull in a compute shader and draw indirectly
+GpuCuller gGpuCuller;
+
+// camera (as drawn; the simulation moves its own copy in gSim)
 Camera gCamera(glm::vec3(0.0f, 0.0f, 7.0f));
 float gLastX = WINDOW_WIDTH / 2.0f;
 float gLastY = WINDOW_HEIGHT / 2.0f;
 bool gFirstMouse = true;
 
-// timing
-float gDeltaTime = 0.0f; // time between current frame and last frame
-float gLastFrame = 0.0f;
-
-// Subject position and scale
+// Subject position and scale (of the single-cube scene)
 glm::vec3 gCubePosition(0.0f, 0.0f, 0.0f);
 glm::vec3 gCubeScale(2.0f);
 
@@ -75,6 +911,68 @@ glm::vec3 gLightScale(0.3f);
 
 // Lamp animation
 bool gIsLampOrbiting = true;
+
+// Animated point lights around the cubes, lit through the light clusters; --lights sets the count
+int gPointLightCount = 0;
+LightClusters gLightClusters;
+float gSceneTime = 0.0f;                // Simulated seconds of the drawn state
+
+// Deferred shading; --deferred starts with it, G and F switch between deferred and forward
+bool gDeferredShading = false;
+GBuffer gGBuffer;
+
+// Simulation: input, camera and lamp at a fixed step. Windowed, it runs on the main thread (which
+// GLFW needs for events) while a render thread draws; headless, it is stepped once per frame
+SimState gSim;                          // Working state, simulation side only
+SimStateBuffer gSimStates;
+std::thread gRenderThread;
+std::atomic<bool> gRenderStop{ false };
+std::atomic<uint32_t> gViewportSize{ 0 };  // Latest window size (width << 16 | height), 0 once applied
+int gViewportWidth = WINDOW_WIDTH;      // Framebuffer size of the render thread, which the G-buffer follows
+int gViewportHeight = WINDOW_HEIGHT;
+
+// Headless (offscreen) rendering
+bool gHeadless = false;                 // Render into an FBO without creating a window
+int gHeadlessFrames = 300;              // Number of frames to render before exiting
+const char* gFrameDumpDir = nullptr;    // When set, every frame is written there as a PPM image
+const float HEADLESS_TIMESTEP = 1.0f / 60.0f; // Fixed timestep so headless runs are reproducible
+int gFrameIndex = 0;
+int gFrameDrawCalls = 0;                // Draw calls issued by the last URender
+bool gFrameDeferred = false;            // Whether the last URender lit its draws through the G-buffer
+GLStateCache gGLState;                  // Main context only; its counters cover the last URender
+RenderQueue gRenderQueue;               // Draws of the last URender
+
+// Benchmark mode: --benchmark PREFIX renders every combination of these lists headless, --frames
+// frames each along a scripted camera path, and writes PREFIX.csv and PREFIX.json
+const char* gBenchmarkPrefix = nullptr;
+std::vector<int> gBenchmarkInstances = { 1, 1000, 10000 };
+std::vector<int> gBenchmarkTextureSizes = { 256, 2048 };
+std::vector<int> gBenchmarkLights = { 0, 1 };
+std::vector<int> gBenchmarkDeferred = { 0 };   // 0 forward, 1 deferred
+const int BENCHMARK_WARMUP_FRAMES = 10;    // Not measured: lazy variant compiles and first-use costs land here
+
+// Offscreen render target used in headless mode
+GLuint gOffscreenFbo = 0;
+GLuint gOffscreenColorRbo = 0;
+GLuint gOffscreenDepthRbo = 0;
+
+#ifdef __linux__
+EGLDisplay gEglDisplay = EGL_NO_DISPLAY;
+EGLConfig gEglConfig = nullptr;
+EGLContext gEglContext = EGL_NO_CONTEXT;
+
+// Same 4.4 core profile the windowed path requests from GLFW
+const EGLint EGL_CONTEXT_ATTRIBS[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 4,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+};
+EGLContext gEglWorkerContext = EGL_NO_CONTEXT;
+#endif
+
+// Hidden window whose context shares objects with gWindow, for compiling off the main thread
+GLFWwindow* gWorkerWindow = nullptr;
 }
 
 /* User-defined Function prototypes to:
@@ -83,22 +981,204 @@ bool gIsLampOrbiting = true;
  * and render graphics on the screen
  */
 bool UInitialize(int, char*[], GLFWwindow** window);
+bool UParseCommandLine(int argc, char* argv[]);
+bool UInitializeHeadless();
+void UDestroyHeadless();
+bool UCreateOffscreenTarget(int width, int height);
+void UPresentFrame();
+bool UWriteFrame(const std::string& path);
+void UCreateInstances(int count);
+void UDestroyInstances();
+void UBuildScene(int count);
+int UAddSceneNode(SceneGraph& scene, int parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale, int instance);
+void UPropagateTransforms(SceneGraph& scene, std::vector<TransformRange>& updated);
+void UPropagateNode(SceneGraph& scene, size_t node);
+void UUpdateScene();
+void UUpdateInstanceBounds(size_t begin, size_t end);
+size_t UAddTransform(TransformTable& table, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void USetTransform(TransformTable& table, size_t index, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+size_t UUpdateTransforms(TransformTable& table, InstanceData* out, std::vector<TransformRange>& ranges);
+size_t UUpdateTransformRange(TransformTable& table, InstanceData* out, size_t begin, size_t count, std::vector<TransformRange>& ranges);
+void UComposeTransform(const TransformTable& table, size_t index, InstanceData& out);
+void UComputeMeshBounds(const MeshBlob& blob, glm::vec3& center, float& radius);
+FrustumPlanes UExtractFrustumPlanes(const glm::mat4& viewProjection);
+size_t UCullSpheres(const FrustumPlanes& frustum, const InstanceBounds& bounds, size_t begin, size_t end, GLuint* visible);
+size_t UBuildDrawLists(const FrustumPlanes& frustum);
+float UNearestDepth(const glm::vec4& nearPlane, const glm::vec3& center, float radius);
+void UQueueDraw(RenderQueue& queue, uint32_t pass, const DrawCommand& command, float depthRange);
+void USortRenderQueue(RenderQueue& queue);
+void URadixSortRenderQueue(std::vector<RenderQueueEntry>& entries, std::vector<RenderQueueEntry>& scratch);
+int UCountStateChanges(const std::vector<RenderQueueEntry>& entries);
+void USubmitRenderQueue(const RenderQueue& queue, size_t begin, size_t end);
+size_t URenderPassStart(const RenderQueue& queue, uint32_t pass);
+void UCreatePointLights(int count);
+void UDestroyPointLights();
+void UUpdateLightClusters(const glm::mat4& view, const glm::mat4& projection);
+void UBoundPointLights(const glm::mat4& view, const glm::mat4& projection, size_t begin, size_t end);
+void UBinLightSlice(int slice);
+bool UPrepareGBuffer(int width, int height);
+bool UCreateDeferredLightProgram(DeferredLightProgram& light, bool volumes);
+void UDestroyGBufferTargets();
+void UDestroyGBuffer();
+void ULightGBuffer(const glm::mat4& viewProjection);
+bool UCreateGpuCuller();
+void UDestroyGpuCuller();
+int UDispatchGpuCull(const FrustumPlanes& frustum);
+void UDrawGpuCulled(const GLMesh& mesh, const ShaderVariant& variant);
+void UUseProgram(GLuint program);
+void UBindVertexArray(GLuint vertexArray);
+void UBindTexture(GLuint unit, GLuint texture);
+void UBindBuffer(GLenum target, GLuint buffer);
+void UBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+void USetCapability(GLenum capability, bool enabled);
+void USetClearColor(const glm::vec4& color);
+void UDeleteProgram(GLuint program);
+void UDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
+void UDeleteTextures(GLsizei count, const GLuint* textures);
+void UDeleteBuffers(GLsizei count, const GLuint* buffers);
+void UReportThroughput();
+void UCreateProfiler();
+uint32_t UProfileThreadId();
+uint64_t UProfileNow();
+ProfileMark UProfileBegin(const char* name, bool gpu);
+void UProfileEnd(const ProfileMark& mark);
+bool UProfilePush(const ProfileEvent& event);
+bool UProfilePop(ProfileEvent& event);
+void UCollectGpuQueries(bool wait);
+void UDrainProfiler();
+bool UWriteChromeTrace(const char* path);
+void UReportProfile();
+void UDestroyProfiler();
+double UPercentile(const std::vector<double>& sorted, double p);
+bool UParseInt(const char* text, int& value);
+bool UParseIntList(const char* text, std::vector<int>& values);
+void UApplyCameraPath(float seconds, float radius);
+bool UCreateCheckerTexture(int size, GLuint& textureId);
+bool URunBenchmarkScene(const BenchmarkScene& scene, BenchmarkResult& result);
+bool URunBenchmark();
+bool UWriteBenchmarkResults(const std::vector<BenchmarkResult>& results);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
+void UCreateSimulation();
+void UStepSimulation(float timestep);
+void URunSimulation();
+void UPublishSimState(const SimState& state);
+const SimState& UAcquireSimState();
+void UApplySimState(const SimState& state, float alpha);
+void URenderThread();
+void URenderFrame();
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UCreateMesh(GLMesh &mesh);
+bool UBuildCubeMesh(MeshData& meshData);
+bool UBuildIndexedMesh(const std::vector<GLfloat>& expandedVerts, MeshData& meshData, const char* meshName);
+void UWeldVertices(const std::vector<GLfloat>& expandedVerts, MeshData& meshData);
+void UOptimizeMesh(MeshData& meshData, size_t expandedCount, const char* meshName);
+void UOptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount);
+void UOptimizeVertexFetch(MeshData& meshData);
+float UComputeACMR(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize);
+void UUploadMesh(GLMesh &mesh, const MeshData& meshData);
+void UMakeMeshBlob(const MeshData& meshData, PackedVertices& packed, std::vector<GLushort>& shortIndices, MeshBlob& blob);
+void UUploadMeshBlob(GLMesh &mesh, const MeshBlob& blob);
+void UPackVertices(const MeshData& meshData, float precision, PackedVertices& packed);
+bool UPackCompactVertices(const MeshData& meshData, float precision, PackedVertices& packed, float& maxError);
+void USetVertexLayout(GLint layout);
 void UDestroyMesh(GLMesh &mesh);
-bool UCreateTexture(const char* filename, GLuint &textureId);
+unsigned UWorkerCount();
+void UParallelFor(size_t count, const std::function<void(size_t begin, size_t end, unsigned worker)>& body);
+void UCreateJobSystem();
+void UDestroyJobSystem();
+void USubmitJob(std::function<void()> run, std::atomic<int>& pending);
+bool URunJob();
+void UWaitJobs(std::atomic<int>& pending);
+void UJobWorker(unsigned queueIndex);
+bool UMapFile(const char* path, MappedFile& file);
+void UUnmapFile(MappedFile& file);
+bool ULoadMesh(const char* path, MeshData& meshData);
+bool ULoadObj(const char* path, MeshData& meshData);
+bool ULoadGltf(const char* path, MeshData& meshData);
+bool UParseJson(const char*& p, const char* end, JsonValue& value);
+const JsonValue* UJsonFind(const JsonValue& object, const char* key);
+void UCreateTextureLoader();
+void UDecodeTextures();
+GLuint URequestTexture(const char* filename);
+GLuint UResidentTexture(GLuint textureId);
+void UPumpTextureUploads(size_t budgetBytes);
+void UFinishTextureLoads();
+size_t UStageCompressedTexture(AsyncTexture& texture);
+void UDestroyTextureLoader();
+void UApplyTextureParameters();
+bool UParseCompressedTexture(AsyncTexture& texture);
+bool UParseKtx2(AsyncTexture& texture);
+bool UParseDds(AsyncTexture& texture);
+bool UValidateCompressedLevels(AsyncTexture& texture);
+bool UCheckCompressedLevelCount(AsyncTexture& texture, uint32_t levelCount);
+GLsizei UCompressedBlockBytes(GLenum format);
+GLenum UGlFormatFromVulkan(uint32_t vkFormat);
+GLenum UGlFormatFromDxgi(uint32_t dxgiFormat);
+bool UCompressedFormatSupported(GLenum format);
+bool UCreateTextureFromPixels(const unsigned char* pixels, int width, int height, int channels, const char* name, GLuint &textureId);
+bool UOpenPack(const char* path, AssetPack& pack);
+const char* UValidatePackSection(const AssetPack& pack, const PackSection& section);
+void UClosePack(AssetPack& pack);
+const PackSection* UFindPackSection(const AssetPack& pack, const char* name, uint32_t type);
+bool UUploadPackMesh(const AssetPack& pack, const char* name, GLMesh& mesh);
+bool UCreatePackTexture(const AssetPack& pack, const char* name, GLuint& textureId);
+bool UCookPack(const char* path);
 void UDestroyTexture(GLuint textureId);
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint &programId);
-void UDestroyShaderProgram(GLuint programId);
+GLuint CompileShader(GLenum shaderType, const char* shaderSource, const std::string& defines);
+bool UCheckShaderCompile(GLuint shaderId, const char* shaderName);
+void UBeginShaderProgram(PendingProgram& pending);
+bool UIsShaderProgramReady(const PendingProgram& pending);
+bool UEndShaderProgram(PendingProgram& pending);
+void USubmitShaderBatch(ShaderBatch& batch);
+bool UIsShaderBatchReady(ShaderBatch& batch);
+bool UFinishShaderBatch(ShaderBatch& batch);
+bool UCreateWorkerContext();
+void UMakeWorkerContextCurrent(bool current);
+void UDestroyWorkerContext();
+void UReflectShaderProgram(ShaderProgram &program);
+std::string UShaderCachePath(const std::string& vertexSource, const std::string& fragmentSource);
+bool ULoadProgramBinary(GLuint programId, const std::string& path);
+void USaveProgramBinary(GLuint programId, const std::string& path, float compileMs);
+void UReportShaderCache();
+GLint UGetUniformHandle(const ShaderProgram &program, const char* name);
+void UResolveUniformHandles();
+void UInitializeMaterials();
+uint32_t UMaterialVariantKey(const Material& material, bool instanced);
+std::string UShaderVariantDefines(uint32_t key);
+std::string UShaderVariantName(uint32_t key);
+void UQueueShaderVariant(ShaderBatch& batch, uint32_t key);
+const ShaderVariant* UGetShaderVariant(uint32_t key);
+const ShaderVariant* UUseMaterial(const Material& material, bool instanced, const GLMesh& mesh);
+void UDestroyShaderVariants();
+void UDestroyShaderProgram(ShaderProgram &program);
+void UCreateFrameUniformBuffer();
+void UUpdateFrameUniformBuffer(const glm::mat4& view, const glm::mat4& projection);
+void UDestroyFrameUniformBuffer();
+
+
+/* Per-frame uniform block, included in every shader by CompileShader*/
+const GLchar * frameDataBlockSource = GLSL_INCLUDE(
+    // Camera and light data written once per frame (std140 layout, mirrored by the FrameData struct)
+    layout(std140, binding = FRAME_DATA_BINDING) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        mat4 viewProjection;
+        vec4 viewPosition;
+        vec4 lightPosition;
+        vec4 lightColor;
+    };
+);
 
 
-/* Cube Vertex Shader Source Code*/
-const GLchar * cubeVertexShaderSource = GLSL(440,
+/* Material Vertex Shader Source Code. Feature switches are 0/1 defines injected per variant
+   (UShaderVariantDefines); the GLSL() macro cannot hold #if lines, so they are tested with constant
+   ifs that the compiler folds away */
+const GLchar * materialVertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
     layout(location = 1) in vec3 normal; // VAP position 1 for normals
     layout(location = 2) in vec2 textureCoordinate;
@@ -106,170 +1186,510 @@ const GLchar * cubeVertexShaderSource = GLSL(440,
     out vec3 vertexNormal; // For outgoing normals to fragment shader
     out vec3 vertexFragmentPos; // For outgoing color or pixels to fragment shader
     out vec2 vertexTextureCoordinate;
+    out vec3 vertexColor; // For the outgoing per-instance tint
 
-    //Uniform or Global variables for the  transform matrices
+    // Per-instance matrices and tint, one record per cube (view and projection come from FrameData)
+    struct Instance
+    {
+        mat4 model;
+        mat3 normalMatrix;
+        vec4 color;
+    };
+    layout(std430, binding = INSTANCE_DATA_BINDING) readonly buffer InstanceData
+    {
+        Instance instances[];
+    };
+
+    // Indices of the instances that survived frustum culling; each draw walks its part of the list
+    layout(std430, binding = VISIBLE_INSTANCE_BINDING) readonly buffer VisibleInstances
+    {
+        uint visibleInstances[];
+    };
+    uniform uint instanceBase; // First list entry of the current draw
+
+    // Model and normal matrices of non-instanced variants
     uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    uniform mat3 normalMatrix;
+
+    // Per-mesh dequantization of compact positions (scale 1, offset 0 for float meshes)
+    uniform vec3 positionScale;
+    uniform vec3 positionOffset;
 
     void main()
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+        mat4 objectModel = model;
+        mat3 objectNormalMatrix = normalMatrix;
+        vertexColor = vec3(1.0f);
+        if (SHADER_INSTANCED != 0)
+        {
+            uint instance = visibleInstances[instanceBase + uint(gl_InstanceID)];
+            objectModel = instances[instance].model;
+            objectNormalMatrix = instances[instance].normalMatrix;
+            vertexColor = instances[instance].color.rgb;
+        }
+        vec3 meshPosition = position * positionScale + positionOffset;
+        vec4 worldPosition = objectModel * vec4(meshPosition, 1.0f);
+
+        gl_Position = viewProjection * worldPosition; // Transforms vertices into clip coordinates
 
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment or pixel position in world space only (excludes view and projection)
+        vertexFragmentPos = vec3(worldPosition); // Gets fragment or pixel position in world space only (excludes view and projection)
 
-        vertexNormal = mat3(transpose(inverse(model))) * normal; // Gets normal vectors in world space only and excludes normal translation properties
+        vertexNormal = objectNormalMatrix * normal; // Normal matrix is precomputed per object, so no inverse per vertex
         vertexTextureCoordinate = textureCoordinate;
     }
 );
 
 
-/* Cube Fragment Shader Source Code*/
-const GLchar * cubeFragmentShaderSource = GLSL(440,
+/* Material Fragment Shader Source Code*/
+const GLchar * materialFragmentShaderSource = GLSL(440,
 
     in vec3 vertexNormal; // For incoming normals
     in vec3 vertexFragmentPos; // For incoming fragment position
     in vec2 vertexTextureCoordinate;
+    in vec3 vertexColor; // For the incoming per-instance tint
 
-    out vec4 fragmentColor; // For outgoing cube color to the GPU
+    layout(location = 0) out vec4 fragmentColor; // For outgoing color to the GPU; G-buffer variants write the albedo here
+    layout(location = 1) out vec4 gbufferNormal; // G-buffer variants only
+    layout(location = 2) out float gbufferHighlight; // G-buffer variants only
 
-    // Uniform / Global variables for object color, light color, light position, and camera/view position
-    uniform vec3 objectColor;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPosition;
+    // Material parameters (light and camera/view position come from FrameData)
+    uniform vec3 materialColor;
     uniform sampler2D uTexture; // Useful when working with multiple textures
     uniform vec2 uvScale;
+    uniform float ambientStrength;
+    uniform float specularIntensity;
+    uniform float highlightSize;
+
+    // Clustered point lights: every light, each cluster's range in the index list, and the list
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+    layout(std430, binding = POINT_LIGHT_BINDING) readonly buffer PointLights
+    {
+        PointLight pointLights[];
+    };
+    layout(std430, binding = LIGHT_CLUSTER_BINDING) readonly buffer LightClusters
+    {
+        uvec2 clusters[]; // Offset, count
+    };
+    layout(std430, binding = LIGHT_INDEX_BINDING) readonly buffer LightIndices
+    {
+        uint lightIndices[];
+    };
 
     void main()
     {
+        // Texture holds the color to be used for all three components
+        vec3 baseColor = materialColor * vertexColor;
+        if (SHADER_TEXTURED != 0)
+            baseColor = texture(uTexture, vertexTextureCoordinate * uvScale).xyz * baseColor;
+
+        // Unlit variants show the base color as is
+        if (SHADER_LIGHT_COUNT == 0)
+        {
+            fragmentColor = vec4(baseColor, 1.0);
+            return;
+        }
+
+        // Deferred frames store what lighting needs and shade it later, once per visible pixel
+        if (SHADER_GBUFFER != 0)
+        {
+            fragmentColor = vec4(baseColor, ambientStrength);
+            gbufferNormal = vec4(normalize(vertexNormal), 0.0);
+            gbufferHighlight = 1.0;
+            if (SHADER_SPECULAR != 0)
+            {
+                gbufferNormal.w = specularIntensity;
+                gbufferHighlight = highlightSize;
+            }
+            return;
+        }
+
         /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
         //Calculate Ambient lighting*/
-        float ambientStrength = 0.1f; // Set ambient or global lighting strength
-        vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+        vec3 ambient = ambientStrength * lightColor.rgb; // Generate ambient light color
 
         //Calculate Diffuse lighting*/
         vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-        vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+        vec3 lightDirection = normalize(lightPosition.xyz - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
         float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-        vec3 diffuse = impact * lightColor; // Generate diffuse light color
+        vec3 diffuse = impact * lightColor.rgb; // Generate diffuse light color
 
         //Calculate Specular lighting*/
-        float specularIntensity = 0.8f; // Set specular light strength
-        float highlightSize = 16.0f; // Set specular highlight size
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-        //Calculate specular component
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;
+        vec3 specular = vec3(0.0f);
+        if (SHADER_SPECULAR != 0)
+        {
+            vec3 viewDir = normalize(viewPosition.xyz - vertexFragmentPos); // Calculate view direction
+            vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+            //Calculate specular component
+            float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+            specular = specularIntensity * specularComponent * lightColor.rgb;
+        }
 
-        // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+        // Point lights of this fragment's cluster, fading out to zero at their radius
+        if (SHADER_CLUSTERED != 0)
+        {
+            vec4 clip = viewProjection * vec4(vertexFragmentPos, 1.0);
+            ivec2 tile = clamp(ivec2((clip.xy / clip.w * 0.5 + 0.5) * vec2(CLUSTER_GRID_X, CLUSTER_GRID_Y)), ivec2(0), ivec2(CLUSTER_GRID_X - 1, CLUSTER_GRID_Y - 1));
+            int slice = clamp(int(log(clip.w / CAMERA_NEAR_PLANE) / log(CAMERA_FAR_PLANE / CAMERA_NEAR_PLANE) * float(CLUSTER_GRID_Z)), 0, CLUSTER_GRID_Z - 1);
+            uvec2 range = clusters[(slice * CLUSTER_GRID_Y + tile.y) * CLUSTER_GRID_X + tile.x];
+
+            vec3 viewDir = normalize(viewPosition.xyz - vertexFragmentPos);
+            for (uint i = 0u; i < range.y; ++i)
+            {
+                PointLight light = pointLights[lightIndices[range.x + i]];
+                vec3 toLight = light.positionRadius.xyz - vertexFragmentPos;
+                float distance = length(toLight);
+                float falloff = clamp(1.0 - distance / light.positionRadius.w, 0.0, 1.0);
+                falloff *= falloff;
+                vec3 direction = toLight / max(distance, 0.0001);
+                diffuse += max(dot(norm, direction), 0.0) * falloff * light.color.rgb;
+                if (SHADER_SPECULAR != 0)
+                    specular += specularIntensity * pow(max(dot(viewDir, reflect(-direction, norm)), 0.0), highlightSize) * falloff * light.color.rgb;
+            }
+        }
 
         // Calculate phong result
-        vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+        vec3 phong = (ambient + diffuse + specular) * baseColor;
 
         fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
     }
 );
 
 
-/* Lamp Shader Source Code*/
-const GLchar * lampVertexShaderSource = GLSL(440,
+/* Culling Compute Shader Source Code. One invocation per instance: the mesh bounding sphere is
+   moved by the instance's model matrix and tested against the frustum planes. Survivors are
+   appended to the visible list, and their number becomes the instance count of the indirect draw */
+const GLchar * cullComputeShaderSource = GLSL(440,
+    layout(local_size_x = GPU_CULL_GROUP_SIZE) in;
 
-    layout (location = 0) in vec3 position; // VAP position 0 for vertex position data
+    // Same records the material vertex shader reads
+    struct Instance
+    {
+        mat4 model;
+        mat3 normalMatrix;
+        vec4 color;
+    };
+    layout(std430, binding = INSTANCE_DATA_BINDING) readonly buffer InstanceData
+    {
+        Instance instances[];
+    };
 
-        //Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    layout(std430, binding = VISIBLE_INSTANCE_BINDING) writeonly buffer VisibleInstances
+    {
+        uint visibleInstances[];
+    };
+
+    // Reset to { index count, 0, 0, 0, 0, 0 } before every dispatch
+    layout(std430, binding = DRAW_COMMAND_BINDING) buffer DrawCommands
+    {
+        uint count;
+        uint instanceCount;
+        uint firstIndex;
+        int baseVertex;
+        uint baseInstance;
+        uint drawCount;
+    };
+
+    uniform vec4 frustumPlanes[6]; // Normalized, positive inside
+    uniform vec4 meshBounds; // Mesh bounding sphere: center, radius
+    uniform uint populationSize;
 
     void main()
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+        uint instance = gl_GlobalInvocationID.x;
+        if (instance >= populationSize)
+            return;
+
+        // The radius grows with the largest axis scale, as in UUpdateInstanceBounds
+        mat4 model = instances[instance].model;
+        vec3 center = (model * vec4(meshBounds.xyz, 1.0f)).xyz;
+        float radius = meshBounds.w * max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));
+        for (int p = 0; p < 6; ++p)
+        {
+            if (dot(frustumPlanes[p].xyz, center) + frustumPlanes[p].w < -radius)
+                return;
+        }
+
+        uint slot = atomicAdd(instanceCount, 1u);
+        visibleInstances[slot] = instance;
+        if (slot == 0u)
+            drawCount = 1u;
     }
 );
 
 
-/* Fragment Shader Source Code*/
-const GLchar * lampFragmentShaderSource = GLSL(440,
+/* Deferred Lighting Vertex Shader Source Code. DEFERRED_LIGHT_VOLUMES 0 draws one full-screen
+   triangle; 1 draws the lamp cube around every point light, scaled to enclose its radius */
+const GLchar * deferredLightVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position;
+    layout(location = 1) in vec3 normal;
+
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+    layout(std430, binding = POINT_LIGHT_BINDING) readonly buffer PointLights
+    {
+        PointLight pointLights[];
+    };
+
+    // Dequantization of the lamp cube's positions
+    uniform vec3 positionScale;
+    uniform vec3 positionOffset;
+
+    flat out uint lightIndex;
+
+    void main()
+    {
+        lightIndex = uint(gl_InstanceID);
+        if (DEFERRED_LIGHT_VOLUMES == 0)
+        {
+            vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+            gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+            return;
+        }
+
+        // The cube spans -0.5 to 0.5, so scaling it by the diameter encloses the light's sphere
+        vec4 light = pointLights[gl_InstanceID].positionRadius;
+        vec3 worldPosition = light.xyz + (position * positionScale + positionOffset) * (2.0 * light.w);
+        gl_Position = viewProjection * vec4(worldPosition, 1.0);
+
+        // Only faces turned away from the camera are drawn, which also works from inside the volume.
+        // The others are moved out of the clip volume; decided by the normal, as the cube's winding is mixed
+        if (dot(normal, worldPosition - viewPosition.xyz) < 0.0)
+            gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+    }
+);
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+
+/* Deferred Lighting Fragment Shader Source Code. Rebuilds the surface from the G-buffer and adds
+   one light: the lamp with the ambient term (full-screen pass, which also copies the G-buffer depth
+   into the frame), or one point light fading out to zero at its radius (volume pass) */
+const GLchar * deferredLightFragmentShaderSource = GLSL(440,
+    flat in uint lightIndex;
+
+    out vec4 fragmentColor;
+
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+    layout(std430, binding = POINT_LIGHT_BINDING) readonly buffer PointLights
+    {
+        PointLight pointLights[];
+    };
+
+    layout(binding = GBUFFER_ALBEDO_UNIT) uniform sampler2D gbufferAlbedo;
+    layout(binding = GBUFFER_NORMAL_UNIT) uniform sampler2D gbufferNormal;
+    layout(binding = GBUFFER_HIGHLIGHT_UNIT) uniform sampler2D gbufferHighlight;
+    layout(binding = GBUFFER_DEPTH_UNIT) uniform sampler2D gbufferDepth;
+
+    uniform mat4 inverseViewProjection;
+    uniform vec2 viewportSize;
 
     void main()
     {
-        fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        float depth = texelFetch(gbufferDepth, pixel, 0).r;
+        gl_FragDepth = (DEFERRED_LIGHT_VOLUMES != 0) ? gl_FragCoord.z : depth;
+        if (depth == 1.0)
+            discard; // Nothing was drawn here
+
+        // World position from the window coordinates and the stored depth
+        vec4 world = inverseViewProjection * vec4(gl_FragCoord.xy / viewportSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+        vec3 fragmentPos = world.xyz / world.w;
+
+        vec4 albedo = texelFetch(gbufferAlbedo, pixel, 0);
+        vec4 normalSpecular = texelFetch(gbufferNormal, pixel, 0);
+        float highlightSize = texelFetch(gbufferHighlight, pixel, 0).r;
+        vec3 norm = normalize(normalSpecular.xyz);
+        vec3 viewDir = normalize(viewPosition.xyz - fragmentPos);
+
+        vec3 color = lightColor.rgb;
+        vec3 toLight = lightPosition.xyz - fragmentPos;
+        vec3 ambient = albedo.a * lightColor.rgb;
+        float falloff = 1.0;
+        if (DEFERRED_LIGHT_VOLUMES != 0)
+        {
+            PointLight light = pointLights[lightIndex];
+            color = light.color.rgb;
+            toLight = light.positionRadius.xyz - fragmentPos;
+            ambient = vec3(0.0);
+            falloff = clamp(1.0 - length(toLight) / light.positionRadius.w, 0.0, 1.0);
+            falloff *= falloff;
+        }
+
+        // Same Phong terms as the material fragment shader
+        vec3 direction = normalize(toLight);
+        vec3 diffuse = max(dot(norm, direction), 0.0) * falloff * color;
+        vec3 specular = normalSpecular.w * pow(max(dot(viewDir, reflect(-direction, norm)), 0.0), highlightSize) * falloff * color;
+        fragmentColor = vec4((ambient + diffuse + specular) * albedo.rgb, 1.0);
     }
 );
 
 int main(int argc, char* argv[])
 {
-    if (!UInitialize(argc, argv, &gWindow))
+    if (!UParseCommandLine(argc, argv))
         return EXIT_FAILURE;
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+    // Cooking only converts files, so it runs before any window or context exists
+    if (gCookPath)
+        return UCookPack(gCookPath) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(cubeVertexShaderSource, cubeFragmentShaderSource, gCubeProgramId))
+    if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
+    // Before the texture workers start, so their decodes are timed as well
+    if (gProfilePath)
+        UCreateProfiler();
+
+    // Start compiling the variants the scene draws with now; meshes and textures load while the
+    // compiler works. Any other variant is compiled the first time a draw asks for it
+    UInitializeMaterials();
+    ShaderBatch shaderBatch;
+    UQueueShaderVariant(shaderBatch, UMaterialVariantKey(gCubeMaterial, true));
+    UQueueShaderVariant(shaderBatch, UMaterialVariantKey(gLampMaterial, false));
+    USubmitShaderBatch(shaderBatch);
+
+    // A cooked pack replaces the mesh building, model parsing and PNG decoding below
+    AssetPack pack;
+    if (gPackPath && !UOpenPack(gPackPath, pack))
         return EXIT_FAILURE;
 
+    // Create the mesh
+    if (gPackPath)
+    {
+        if (!UUploadPackMesh(pack, PACK_CUBE_MESH, gMesh))
+        {
+            std::cerr << "Pack " << gPackPath << " has no '" << PACK_CUBE_MESH << "' mesh" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (UUploadPackMesh(pack, PACK_MODEL_MESH, gModelMesh))
+            gObjectMesh = &gModelMesh;
+    }
+    else
+        UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+
+    // Load the production model, if one was given
+    if (gModelPath && !gPackPath)
+    {
+        MeshData modelData;
+        if (!ULoadMesh(gModelPath, modelData))
+            return EXIT_FAILURE;
+        UUploadMesh(gModelMesh, modelData);
+        gObjectMesh = &gModelMesh;
+    }
+
     // Load texture
-    const char * texFilename = "../../resources/textures/smiley.png";
-    if (!UCreateTexture(texFilename, gTextureId))
+    UCreateTextureLoader();
+    if (gPackPath)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        if (!UCreatePackTexture(pack, PACK_DIFFUSE_TEXTURE, gTextureId))
+        {
+            cout << "Failed to load texture '" << PACK_DIFFUSE_TEXTURE << "' from " << gPackPath << endl;
+            return EXIT_FAILURE;
+        }
+
+        // Everything has been handed to the GL, so the mapping is no longer needed
+        UClosePack(pack);
     }
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gCubeProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTexture"), 0);
+    else
+        gTextureId = URequestTexture(gTextureFilename); // Drawn with a placeholder until it is decoded and uploaded
+    gCubeMaterial.textureId = gTextureId;
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    // Frame dumps must not depend on how fast the workers decode
+    if (gHeadless)
+        UFinishTextureLoads();
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    // Keep streaming textures in while the compiler works, then collect the shader programs
+    while (!UIsShaderBatchReady(shaderBatch))
     {
-        // per-frame timing
-        // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        UPumpTextureUploads(gTextureUploadBudget);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!UFinishShaderBatch(shaderBatch))
+        return EXIT_FAILURE;
 
-        // input
-        // -----
-        UProcessInput(gWindow);
+    // Look up every uniform the draw code uses once, instead of by name every frame
+    UResolveUniformHandles();
+    UReportShaderCache();
 
-        // Render this frame
-        URender();
+    // Camera and light data shared by every shader variant
+    UCreateFrameUniformBuffer();
+
+    // Worker threads for the per-frame jobs, up before the first scene update
+    UCreateJobSystem();
+
+    // Per-instance transforms and colors for the cube population
+    UCreateInstances(gInstanceCount);
+    UCreatePointLights(gPointLightCount);
+    UCreateSimulation();
+
+    // Compute culling program and indirect draw buffers
+    if (gGpuCulling && !UCreateGpuCuller())
+        return EXIT_FAILURE;
 
-        glfwPollEvents();
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    USetClearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    // The benchmark drives its own frames instead of the render loop
+    bool benchmarkOk = !gBenchmarkPrefix || URunBenchmark();
+
+    // render loop
+    // -----------
+    // Windowed, this thread runs input and the simulation while a render thread draws. Headless
+    // runs have no input and step the simulation once per frame, so frame dumps are reproducible
+    if (!gBenchmarkPrefix && !gHeadless)
+        URunSimulation();
+
+    while (!gBenchmarkPrefix && gHeadless && gFrameIndex < gHeadlessFrames)
+    {
+        UStepSimulation(HEADLESS_TIMESTEP);
+        UApplySimState(gSim, 1.0f);
+        URenderFrame();
     }
 
+    // Needs the GL context for the last query results
+    UDestroyProfiler();
+
     // Release mesh data
     UDestroyMesh(gMesh);
+    if (gObjectMesh == &gModelMesh)
+        UDestroyMesh(gModelMesh);
 
     // Release texture
+    UDestroyTextureLoader();
     UDestroyTexture(gTextureId);
 
     // Release shader programs
-    UDestroyShaderProgram(gCubeProgramId);
-    UDestroyShaderProgram(gLampProgramId);
-
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    UDestroyShaderVariants();
+    UDestroyGBuffer();
+    UDestroyFrameUniformBuffer();
+    UDestroyGpuCuller();
+    UDestroyPointLights();
+    UDestroyInstances();
+    UDestroyJobSystem();
+
+    if (gHeadless)
+        UDestroyHeadless();
+
+    exit(benchmarkOk ? EXIT_SUCCESS : EXIT_FAILURE); // Terminates the program successfully
 }
 
 
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
+    // Render nodes have no display, so skip GLFW entirely
+    if (gHeadless)
+        return UInitializeHeadless();
+
     // GLFW: initialize and configure
     // ------------------------------
     glfwInit();
@@ -317,17 +1737,306 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     return true;
 }
 
+
+// Reads the optional command line switches
+bool UParseCommandLine(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            gHeadless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            if (!UParseInt(argv[++i], gHeadlessFrames))
+                return false;
+        }
+        else if (strcmp(argv[i], "--dump-frames") == 0 && i + 1 < argc)
+            gFrameDumpDir = argv[++i];
+        else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+        {
+            if (!UParseInt(argv[++i], gInstanceCount))
+                return false;
+        }
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+        {
+            if (!UParseInt(argv[++i], gPointLightCount))
+                return false;
+        }
+        else if (strcmp(argv[i], "--deferred") == 0)
+            gDeferredShading = true;
+        else if (strcmp(argv[i], "--vertex-precision") == 0 && i + 1 < argc)
+        {
+            // 0 turns the compact layout off; anything that is not a number must not do so silently
+            const char* text = argv[++i];
+            const char* end = text + strlen(text);
+            float precision = 0.0f;
+            std::from_chars_result result = std::from_chars(text, end, precision);
+            if (result.ec != std::errc() || result.ptr != end || !std::isfinite(precision) || precision < 0.0f)
+            {
+                std::cerr << "--vertex-precision must be 0 (always floats) or a positive error bound, got '" << text << "'" << std::endl;
+                return false;
+            }
+            gVertexPrecision = precision;
+        }
+        else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc)
+            gModelPath = argv[++i];
+        else if (strcmp(argv[i], "--cook") == 0 && i + 1 < argc)
+            gCookPath = argv[++i];
+        else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc)
+            gPackPath = argv[++i];
+        else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc)
+            gTextureFilename = argv[++i];
+        else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc)
+            gShaderCacheDir = argv[++i];
+        else if (strcmp(argv[i], "--no-shader-cache") == 0)
+            gShaderCacheDir = nullptr;
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+        {
+            // Unsigned parsing rejects a sign, so "-1" cannot wrap around to an unlimited budget
+            const char* text = argv[++i];
+            const char* end = text + strlen(text);
+            uint64_t budget = 0;
+            std::from_chars_result result = std::from_chars(text, end, budget);
+            if (result.ec != std::errc() || result.ptr != end || budget == 0 || budget > SIZE_MAX)
+            {
+                std::cerr << "--texture-budget must be a positive number of bytes, got '" << text << "'" << std::endl;
+                return false;
+            }
+            gTextureUploadBudget = (size_t)budget;
+        }
+        else if (strcmp(argv[i], "--no-cull") == 0)
+            gCullInstances = false;
+        else if (strcmp(argv[i], "--gpu-cull") == 0)
+            gGpuCulling = true;
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            gProfilePath = argv[++i];
+        else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+            gBenchmarkPrefix = argv[++i];
+        else if (strcmp(argv[i], "--bench-instances") == 0 && i + 1 < argc)
+        {
+            if (!UParseIntList(argv[++i], gBenchmarkInstances))
+                return false;
+        }
+        else if (strcmp(argv[i], "--bench-texture-sizes") == 0 && i + 1 < argc)
+        {
+            if (!UParseIntList(argv[++i], gBenchmarkTextureSizes))
+                return false;
+        }
+        else if (strcmp(argv[i], "--bench-lights") == 0 && i + 1 < argc)
+        {
+            if (!UParseIntList(argv[++i], gBenchmarkLights))
+                return false;
+        }
+        else if (strcmp(argv[i], "--bench-deferred") == 0 && i + 1 < argc)
+        {
+            if (!UParseIntList(argv[++i], gBenchmarkDeferred))
+                return false;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--headless] [--frames N] [--dump-frames DIR] [--instances N] [--lights N] [--deferred]"
+                      << " [--vertex-precision E] [--mesh FILE.obj|.gltf|.glb] [--cook OUT.pack] [--pack FILE.pack]"
+                      << " [--texture FILE.png|.ktx2|.dds] [--texture-budget BYTES]"
+                      << " [--shader-cache DIR | --no-shader-cache] [--no-cull | --gpu-cull] [--profile TRACE.json]"
+                      << " [--benchmark PREFIX [--bench-instances N,N..] [--bench-texture-sizes N,N..] [--bench-lights N,N..] [--bench-deferred 0,1]]"
+                      << std::endl;
+            return false;
+        }
+    }
+
+    if (gInstanceCount < 1)
+    {
+        std::cerr << "--instances must be at least 1" << std::endl;
+        return false;
+    }
+
+    if (gHeadlessFrames < 1)
+    {
+        std::cerr << "--frames must be at least 1" << std::endl;
+        return false;
+    }
+
+    if (gPointLightCount < 0 || gPointLightCount > MAX_POINT_LIGHTS)
+    {
+        std::cerr << "--lights must be between 0 and " << MAX_POINT_LIGHTS << std::endl;
+        return false;
+    }
+
+    // Without culling there is nothing for the compute shader to do
+    if (!gCullInstances)
+        gGpuCulling = false;
+
+    if (gBenchmarkPrefix)
+    {
+        for (int count : gBenchmarkInstances)
+            if (count < 1)
+            {
+                std::cerr << "--bench-instances must be at least 1" << std::endl;
+                return false;
+            }
+        for (int size : gBenchmarkTextureSizes)
+            if (size < 1 || size > 16384)
+            {
+                std::cerr << "--bench-texture-sizes must be between 1 and 16384" << std::endl;
+                return false;
+            }
+        for (int lights : gBenchmarkLights)
+            if (lights < 0 || lights > MAX_SHADER_LIGHTS + MAX_POINT_LIGHTS)
+            {
+                std::cerr << "--bench-lights must be between 0 and " << MAX_SHADER_LIGHTS + MAX_POINT_LIGHTS << std::endl;
+                return false;
+            }
+        for (int deferred : gBenchmarkDeferred)
+            if (deferred != 0 && deferred != 1)
+            {
+                std::cerr << "--bench-deferred takes 0 (forward) and/or 1 (deferred)" << std::endl;
+                return false;
+            }
+
+        // Benchmarks never depend on a window, vsync or input
+        gHeadless = true;
+        gFrameDumpDir = nullptr;
+    }
+
+    if (gPackPath && gModelPath)
+        std::cout << "WARNING: --mesh is ignored with --pack; cook the model into the pack instead" << std::endl;
+
+    if (gFrameDumpDir && !gHeadless)
+        std::cout << "WARNING: --dump-frames is only used together with --headless" << std::endl;
+
+    return true;
+}
+
+
+// Creates a surfaceless EGL context (e.g. Mesa llvmpipe) and an offscreen target to render into
+bool UInitializeHeadless()
+{
+#ifdef __linux__
+    // Prefer the surfaceless platform so no X server or GPU device node is needed
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        gEglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gEglDisplay == EGL_NO_DISPLAY)
+        gEglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (gEglDisplay == EGL_NO_DISPLAY || !eglInitialize(gEglDisplay, &major, &minor))
+    {
+        std::cerr << "Failed to initialize EGL display" << std::endl;
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cerr << "EGL implementation does not support desktop OpenGL" << std::endl;
+        return false;
+    }
+
+    // The default surface type is EGL_WINDOW_BIT, which surfaceless displays never offer
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(gEglDisplay, configAttribs, &gEglConfig, 1, &numConfigs) || numConfigs == 0)
+    {
+        std::cerr << "No suitable EGL config found" << std::endl;
+        return false;
+    }
+
+    gEglContext = eglCreateContext(gEglDisplay, gEglConfig, EGL_NO_CONTEXT, EGL_CONTEXT_ATTRIBS);
+    if (gEglContext == EGL_NO_CONTEXT)
+    {
+        std::cerr << "Failed to create EGL OpenGL 4.4 context" << std::endl;
+        return false;
+    }
+
+    // Requires EGL_KHR_surfaceless_context; all drawing goes to our own FBO
+    if (!eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, gEglContext))
+    {
+        std::cerr << "Failed to make EGL context current" << std::endl;
+        return false;
+    }
+
+    // glewInit() also loads GLX entry points, which fail without an X display
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewContextInit();
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    cout << "INFO: Headless EGL " << major << "." << minor << ", OpenGL Version: " << glGetString(GL_VERSION)
+         << " (" << glGetString(GL_RENDERER) << ")" << endl;
+
+    if (gFrameDumpDir)
+        fs::create_directories(gFrameDumpDir);
+
+    return UCreateOffscreenTarget(WINDOW_WIDTH, WINDOW_HEIGHT);
+#else
+    std::cerr << "Headless mode is only supported on Linux (EGL)" << std::endl;
+    return false;
+#endif
+}
+
+
+// Creates the framebuffer that replaces the window's back buffer in headless mode
+bool UCreateOffscreenTarget(int width, int height)
+{
+    glGenRenderbuffers(1, &gOffscreenColorRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenColorRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &gOffscreenDepthRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenDepthRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &gOffscreenFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gOffscreenColorRbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, gOffscreenDepthRbo);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cerr << "Offscreen framebuffer is incomplete: 0x" << std::hex << status << std::dec << std::endl;
+        return false;
+    }
+
+    // There is no window to resize, so the viewport is fixed to the target size
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+
+void UDestroyHeadless()
+{
+    glDeleteFramebuffers(1, &gOffscreenFbo);
+    glDeleteRenderbuffers(1, &gOffscreenColorRbo);
+    glDeleteRenderbuffers(1, &gOffscreenDepthRbo);
+
+#ifdef __linux__
+    eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gEglDisplay, gEglContext);
+    eglTerminate(gEglDisplay);
+#endif
+}
+
 void SetTextureWrapMode(GLint wrapMode, const char* modeName, const float* borderColor = nullptr)
 {
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+    // Left bound: the cube draw binds the same texture to the same unit
+    UBindTexture(0, gTextureId);
 
     if (wrapMode == GL_CLAMP_TO_BORDER && borderColor)
         glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapMode);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapMode);
-
-    glBindTexture(GL_TEXTURE_2D, 0);
     gTexWrapMode = wrapMode;
 
     std::cout << "Current Texture Wrapping Mode: " << modeName << std::endl;
@@ -341,56 +2050,248 @@ void UProcessInput(GLFWwindow* window)
         glfwSetWindowShouldClose(window, true);
 
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
+        gSim.camera.ProcessKeyboard(FORWARD, SIM_TIMESTEP);
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
+        gSim.camera.ProcessKeyboard(BACKWARD, SIM_TIMESTEP);
     if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
+        gSim.camera.ProcessKeyboard(LEFT, SIM_TIMESTEP);
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+        gSim.camera.ProcessKeyboard(RIGHT, SIM_TIMESTEP);
+
+    // Refactored Texture Wrap Mode Handling; the renderer applies the change
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
+        gSim.texWrapMode = GL_REPEAT;
+    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
+        gSim.texWrapMode = GL_MIRRORED_REPEAT;
+    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
+        gSim.texWrapMode = GL_CLAMP_TO_EDGE;
+    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS)
+        gSim.texWrapMode = GL_CLAMP_TO_BORDER;
+
+    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    {
+        gSim.uvScale += 0.1f;
+        std::cout << "Current scale (" << gSim.uvScale[0] << ", " << gSim.uvScale[1] << ")" << std::endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+    {
+        gSim.uvScale -= 0.1f;
+        std::cout << "Current scale (" << gSim.uvScale[0] << ", " << gSim.uvScale[1] << ")" << std::endl;
+    }
+
+    // Pause and resume lamp orbiting
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS)
+        gIsLampOrbiting = true;
+    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS)
+        gIsLampOrbiting = false;
+
+    // Deferred (G-buffer) or forward shading, to compare the two on the same scene
+    if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS)
+        gSim.deferred = true;
+    else if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS)
+        gSim.deferred = false;
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes.
+// Events arrive on the simulation thread; the render thread sets the viewport
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    gViewportSize = (uint32_t)width << 16 | (uint32_t)height;
+}
+
+
+// Starts the simulation from the scene as set up, and publishes that as the first state
+void UCreateSimulation()
+{
+    gSim.camera = gCamera;
+    gSim.previousCamera = gCamera;
+    gSim.lightPosition = gLightPosition;
+    gSim.previousLightPosition = gLightPosition;
+    gSim.uvScale = gCubeMaterial.uvScale;
+    gSim.texWrapMode = gTexWrapMode;
+    gSim.deferred = gDeferredShading;
+    gSim.time = std::chrono::steady_clock::now();
+
+    for (SimState& slot : gSimStates.slots)
+        slot = gSim;
+}
+
+
+// Advances gSim by one step: window input, then the lamp orbit
+void UStepSimulation(float timestep)
+{
+    ProfileMark simulateMark = UProfileBegin("simulate", false);
+    gSim.previousCamera = gSim.camera;
+    gSim.previousLightPosition = gSim.lightPosition;
+
+    if (!gHeadless)
+        UProcessInput(gWindow);
 
-    // Refactored Texture Wrap Mode Handling
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+    // Lamp orbiting
+    const float angularVelocity = glm::radians(45.0f);
+    if (gIsLampOrbiting)
     {
-        SetTextureWrapMode(GL_REPEAT, "REPEAT");
+        glm::vec4 newPosition = glm::rotate(angularVelocity * timestep, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gSim.lightPosition, 1.0f);
+        gSim.lightPosition = glm::vec3(newPosition);
     }
-    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+
+    gSim.elapsed += timestep;
+    ++gSim.step;
+    UProfileEnd(simulateMark);
+}
+
+
+// Windowed main loop: hands the GL context to a render thread, then handles events and steps the
+// simulation at SIM_TIMESTEP, independent of how long frames take or of vsync. Returns once the
+// window is closed, with the context back on this thread
+void URunSimulation()
+{
+    const auto timestep = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(SIM_TIMESTEP));
+    auto nextStep = std::chrono::steady_clock::now();
+
+    // The framebuffer can be larger than the window (HiDPI), and the G-buffer must match the framebuffer
+    glfwGetFramebufferSize(gWindow, &gViewportWidth, &gViewportHeight);
+
+    glfwMakeContextCurrent(NULL);
+    gRenderStop = false;
+    gRenderThread = std::thread(URenderThread);
+
+    while (!glfwWindowShouldClose(gWindow))
     {
-        SetTextureWrapMode(GL_MIRRORED_REPEAT, "MIRRORED REPEAT");
+        // Input events wake the thread right away; otherwise sleep until the next step is due
+        double wait = std::chrono::duration<double>(nextStep - std::chrono::steady_clock::now()).count();
+        if (wait > 0.0)
+            glfwWaitEventsTimeout(wait);
+        else
+            glfwPollEvents();
+
+        auto now = std::chrono::steady_clock::now();
+        for (int steps = 0; nextStep <= now && steps < SIM_MAX_CATCHUP_STEPS; ++steps)
+        {
+            UStepSimulation(SIM_TIMESTEP);
+            gSim.time = nextStep;
+            UPublishSimState(gSim);
+            nextStep += timestep;
+        }
+        if (nextStep <= now)
+            nextStep = now + timestep;
     }
-    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+
+    gRenderStop = true;
+    gRenderThread.join();
+    glfwMakeContextCurrent(gWindow);
+}
+
+
+// Copies the working state into the back slot and swaps it into the middle
+void UPublishSimState(const SimState& state)
+{
+    gSimStates.slots[gSimStates.back] = state;
+    uint32_t previous = gSimStates.middle.exchange(gSimStates.back | SIM_STATE_FRESH, std::memory_order_acq_rel);
+    gSimStates.back = previous & ~SIM_STATE_FRESH;
+}
+
+
+// The newest published state. It stays untouched by the simulation until the next call
+const SimState& UAcquireSimState()
+{
+    if (gSimStates.middle.load(std::memory_order_acquire) & SIM_STATE_FRESH)
     {
-        SetTextureWrapMode(GL_CLAMP_TO_EDGE, "CLAMP TO EDGE");
+        uint32_t previous = gSimStates.middle.exchange(gSimStates.front, std::memory_order_acq_rel);
+        gSimStates.front = previous & ~SIM_STATE_FRESH;
     }
-    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
+    return gSimStates.slots[gSimStates.front];
+}
+
+
+// Sets what the renderer draws from a simulation state: alpha 0 is the step before it, 1 the state
+// itself. Mouse look lands in both poses, so only movement and the lamp are interpolated
+void UApplySimState(const SimState& state, float alpha)
+{
+    gCamera = state.camera;
+    gLightPosition = state.lightPosition;
+    gSceneTime = state.elapsed;
+    if (alpha < 1.0f)
     {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f }; // Magenta border
-        SetTextureWrapMode(GL_CLAMP_TO_BORDER, "CLAMP TO BORDER", color);
+        const Camera& previous = state.previousCamera;
+        gCamera.Position = glm::mix(previous.Position, state.camera.Position, alpha);
+        gCamera.Front = glm::normalize(glm::mix(previous.Front, state.camera.Front, alpha));
+        gCamera.Right = glm::normalize(glm::cross(gCamera.Front, gCamera.WorldUp));
+        gCamera.Up = glm::normalize(glm::cross(gCamera.Right, gCamera.Front));
+        gCamera.Zoom = glm::mix(previous.Zoom, state.camera.Zoom, alpha);
+        gLightPosition = glm::mix(state.previousLightPosition, state.lightPosition, alpha);
+        gSceneTime = state.elapsed - (1.0f - alpha) * SIM_TIMESTEP;
     }
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    gCubeMaterial.uvScale = state.uvScale;
+    if (state.texWrapMode != gTexWrapMode)
     {
-        gUVScale += 0.1f;
-        std::cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << std::endl;
+        static const float magenta[] = { 1.0f, 0.0f, 1.0f, 1.0f }; // Magenta border
+        switch (state.texWrapMode)
+        {
+            case GL_REPEAT: SetTextureWrapMode(GL_REPEAT, "REPEAT"); break;
+            case GL_MIRRORED_REPEAT: SetTextureWrapMode(GL_MIRRORED_REPEAT, "MIRRORED REPEAT"); break;
+            case GL_CLAMP_TO_EDGE: SetTextureWrapMode(GL_CLAMP_TO_EDGE, "CLAMP TO EDGE"); break;
+            case GL_CLAMP_TO_BORDER: SetTextureWrapMode(GL_CLAMP_TO_BORDER, "CLAMP TO BORDER", magenta); break;
+        }
     }
-    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+
+    // A G-buffer that failed to build keeps every frame forward
+    bool deferred = state.deferred && !gGBuffer.failed;
+    if (deferred != gDeferredShading)
     {
-        gUVScale -= 0.1f;
-        std::cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << std::endl;
+        gDeferredShading = deferred;
+        std::cout << "Current Shading: " << (deferred ? "DEFERRED" : "FORWARD") << std::endl;
     }
+}
 
-    // Pause and resume lamp orbiting
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS)
-        gIsLampOrbiting = false;
+
+// Render thread of windowed runs: draws the newest simulation state, one step behind so that it
+// can interpolate, until the simulation thread asks it to stop
+void URenderThread()
+{
+    glfwMakeContextCurrent(gWindow);
+    gProfiler.renderThread = UProfileThreadId();
+    while (!gRenderStop)
+    {
+        uint32_t viewport = gViewportSize.exchange(0);
+        if (viewport)
+        {
+            gViewportWidth = (int)(viewport >> 16);
+            gViewportHeight = (int)(viewport & 0xFFFF);
+            glViewport(0, 0, gViewportWidth, gViewportHeight);
+        }
+
+        const SimState& state = UAcquireSimState();
+        float alpha = std::chrono::duration<float>(std::chrono::steady_clock::now() - state.time).count() / SIM_TIMESTEP;
+        UApplySimState(state, std::min(alpha, 1.0f));
+        URenderFrame();
+    }
+    glfwMakeContextCurrent(NULL);
 }
 
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
+// One frame of the render loop: texture streaming, the frame itself and the profiler bookkeeping
+void URenderFrame()
 {
-    glViewport(0, 0, width, height);
+    ProfileMark frameMark = UProfileBegin("frame", false);
+
+    // Stream in decoded textures, a bounded amount per frame
+    ProfileMark uploadMark = UProfileBegin("texture uploads", true);
+    UPumpTextureUploads(gTextureUploadBudget);
+    UProfileEnd(uploadMark);
+
+    // Render this frame
+    URender();
+    UProfileEnd(frameMark);
+
+    // Pick up GPU ranges of earlier frames that have completed by now
+    UCollectGpuQueries(false);
+    UDrainProfiler();
+
+    gFrameIndex++;
+    UReportThroughput();
 }
 
 
@@ -411,7 +2312,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
     gLastX = xpos;
     gLastY = ypos;
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
+    gSim.camera.ProcessMouseMovement(xoffset, yoffset);
 }
 
 
@@ -419,7 +2320,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 // ----------------------------------------------------------------------
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    gSim.camera.ProcessMouseScroll(yoffset);
 }
 
 // glfw: handle mouse button events
@@ -461,281 +2362,5497 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     }
 }
 
-void SetTransformMatrices(GLuint programId, const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection)
+// Creates the FrameData uniform buffer and attaches it to its fixed binding point
+void UCreateFrameUniformBuffer()
 {
-    GLint modelLoc = glGetUniformLocation(programId, "model");
-    GLint viewLoc = glGetUniformLocation(programId, "view");
-    GLint projLoc = glGetUniformLocation(programId, "projection");
+    glGenBuffers(1, &gFrameUbo);
+    UBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+    UBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    // Every program declares the block with the same binding, so this is the only bind needed
+    UBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, gFrameUbo);
 }
 
-// Functioned called to render a frame
-void URender()
+
+// Uploads the camera and light data for this frame in a single call, whatever the number of programs
+void UUpdateFrameUniformBuffer(const glm::mat4& view, const glm::mat4& projection)
 {
-    // Lamp orbiting
-    const float angularVelocity = glm::radians(45.0f);
-    if (gIsLampOrbiting)
-    {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 1.0f);
-        gLightPosition = glm::vec3(newPosition);
-    }
+    FrameData frame;
+    frame.view = view;
+    frame.projection = projection;
+    frame.viewProjection = projection * view;
+    frame.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+    frame.lightPosition = glm::vec4(gLightPosition, 1.0f);
+    frame.lightColor = glm::vec4(gLightColor, 1.0f);
+
+    UBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glBindVertexArray(gMesh.vao);
 
-    // Common matrices
-    glm::mat4 view = gCamera.GetViewMatrix();
-    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+void UDestroyFrameUniformBuffer()
+{
+    UDeleteBuffers(1, &gFrameUbo);
+}
+
+
+// Builds the scene for a cube population and uploads the instance transforms and colors to the
+// instance storage buffer
+void UCreateInstances(int count)
+{
+    gInstanceData.assign(count, InstanceData());
+    gInstanceBounds.centerX.resize(count);
+    gInstanceBounds.centerY.resize(count);
+    gInstanceBounds.centerZ.resize(count);
+    gInstanceBounds.radius.resize(count);
+
+    // Every node starts dirty; build all the matrices and bounds before the first upload
+    UBuildScene(count);
+    std::vector<TransformRange> updated;
+    UPropagateTransforms(gScene, updated);
+    for (size_t node = 0; node < gScene.instance.size(); ++node)
+    {
+        int instance = gScene.instance[node];
+        if (instance < 0)
+            continue;
+        gInstanceData[instance].model = gScene.world[node].model;
+        std::copy(gScene.world[node].normalMatrix, gScene.world[node].normalMatrix + 3, gInstanceData[instance].normalMatrix);
+    }
+    UUpdateInstanceBounds(0, count);
+
+    glGenBuffers(1, &gInstanceSsbo);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, gInstanceSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gInstanceData.size() * sizeof(InstanceData), gInstanceData.data(), GL_DYNAMIC_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_DATA_BINDING, gInstanceSsbo);
+
+    // Without culling the list is every instance, written once
+    gVisibleInstances.resize(count);
+    for (int i = 0; i < count; ++i)
+        gVisibleInstances[i] = (GLuint)i;
+
+    glGenBuffers(1, &gVisibleSsbo);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, gVisibleSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gVisibleInstances.size() * sizeof(GLuint), gVisibleInstances.data(), GL_STREAM_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_INSTANCE_BINDING, gVisibleSsbo);
+
+    cout << "INFO: Drawing " << count << " cube instance(s)" << endl;
+}
+
+
+void UDestroyInstances()
+{
+    UDeleteBuffers(1, &gInstanceSsbo);
+    UDeleteBuffers(1, &gVisibleSsbo);
+}
+
+
+// Scene of the cube population plus the lamp. A single instance reproduces the original cube;
+// larger populations fill a grid around the origin, one group node per grid layer
+void UBuildScene(int count)
+{
+    const glm::quat noRotation(1.0f, 0.0f, 0.0f, 0.0f);
+    gScene = SceneGraph();
+
+    if (count == 1)
+    {
+        UAddSceneNode(gScene, -1, gCubePosition, noRotation, gCubeScale, 0);
+        gInstanceData[0].color = glm::vec4(1.0f);
+    }
+    else
+    {
+        const int side = (int)std::ceil(std::cbrt((double)count));
+        const float spacing = 1.5f;
+        const float offset = (side - 1) * spacing * 0.5f;
+
+        // Fixed seed so every run with the same population looks the same
+        std::mt19937 random(1234u);
+        std::uniform_real_distribution<float> channel(0.3f, 1.0f);
+
+        int grid = UAddSceneNode(gScene, -1, glm::vec3(-offset), noRotation, glm::vec3(1.0f), -1);
+        int layer = -1;
+        for (int i = 0; i < count; ++i)
+        {
+            if (i % (side * side) == 0)
+                layer = UAddSceneNode(gScene, grid, glm::vec3(0.0f, 0.0f, (float)(i / (side * side)) * spacing), noRotation, glm::vec3(1.0f), -1);
+
+            glm::vec3 cell((float)(i % side), (float)((i / side) % side), 0.0f);
+            UAddSceneNode(gScene, layer, cell * spacing, noRotation, glm::vec3(1.0f), i);
+            gInstanceData[i].color = glm::vec4(channel(random), channel(random), channel(random), 1.0f);
+        }
+    }
+
+    gLampNode = UAddSceneNode(gScene, -1, gLightPosition, noRotation, gLightScale, -1);
+}
+
+
+// Appends a node under parent (-1 for a root) and returns its index. Nodes are added depth first:
+// parent must be the last node added or one of its ancestors. Returns -1 otherwise
+int UAddSceneNode(SceneGraph& scene, int parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale, int instance)
+{
+    const uint32_t node = (uint32_t)scene.parent.size();
+    if (parent >= (int)node || (parent >= 0 && scene.subtreeEnd[parent] != node))
+    {
+        std::cerr << "Scene node " << node << " cannot be added under node " << parent << " out of depth-first order" << std::endl;
+        return -1;
+    }
+
+    UAddTransform(scene.local, position, rotation, scale);
+    scene.localMatrices.emplace_back();
+    scene.world.emplace_back();
+    scene.parent.push_back(parent);
+    scene.subtreeEnd.push_back(node + 1);
+    scene.instance.push_back(instance);
+
+    // The new node extends the subtree of every ancestor
+    for (int ancestor = parent; ancestor >= 0; ancestor = scene.parent[ancestor])
+        scene.subtreeEnd[ancestor] = node + 1;
+    return (int)node;
+}
+
+
+// Rebuilds the local matrices of the nodes moved since the last call, then the world matrices of
+// their whole subtrees, and appends the node ranges whose world matrices changed to updated.
+// Subtrees are contiguous and follow their parent, so one forward pass per range is enough
+void UPropagateTransforms(SceneGraph& scene, std::vector<TransformRange>& updated)
+{
+    std::vector<TransformRange> moved;
+    UUpdateTransforms(scene.local, scene.localMatrices.data(), moved);
+
+    // Extend every moved range to the end of its subtrees; nested or touching ranges merge
+    for (const TransformRange& range : moved)
+    {
+        size_t end = range.end;
+        for (size_t node = range.begin; node < range.end; ++node)
+            end = std::max(end, (size_t)scene.subtreeEnd[node]);
+
+        if (!updated.empty() && range.begin <= updated.back().end)
+            updated.back().end = std::max(updated.back().end, end);
+        else
+            updated.push_back({ range.begin, end });
+    }
+
+    size_t total = 0;
+    for (const TransformRange& range : updated)
+        total += range.end - range.begin;
+
+    if (total < TRANSFORM_PARALLEL_THRESHOLD)
+    {
+        for (const TransformRange& range : updated)
+            for (size_t node = range.begin; node < range.end; ++node)
+                UPropagateNode(scene, node);
+        return;
+    }
+
+    // Sibling subtrees are independent once their parent is done. Start from the top-level subtrees
+    // of every range; one larger than a job should be has its root computed here and is replaced by
+    // the subtrees of its children
+    const size_t grain = std::max<size_t>(total / (UWorkerCount() * 4), 1);
+    std::vector<TransformRange> subtrees;
+    for (const TransformRange& range : updated)
+        for (size_t node = range.begin; node < range.end; node = scene.subtreeEnd[node])
+            subtrees.push_back({ node, scene.subtreeEnd[node] });
+
+    for (size_t s = 0; s < subtrees.size(); ++s)
+    {
+        TransformRange subtree = subtrees[s];
+        if (subtree.end - subtree.begin <= grain)
+            continue;
+
+        UPropagateNode(scene, subtree.begin);
+        subtrees[s].end = subtree.begin;
+        for (size_t child = subtree.begin + 1; child < subtree.end; child = scene.subtreeEnd[child])
+            subtrees.push_back({ child, scene.subtreeEnd[child] });
+    }
+
+    UParallelFor(subtrees.size(), [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t s = begin; s < end; ++s)
+            for (size_t node = subtrees[s].begin; node < subtrees[s].end; ++node)
+                UPropagateNode(scene, node);
+    });
+}
+
+
+// World matrices of one node from its local matrices and its parent's world matrices
+void UPropagateNode(SceneGraph& scene, size_t node)
+{
+    const InstanceData& local = scene.localMatrices[node];
+    InstanceData& world = scene.world[node];
+    int parent = scene.parent[node];
+    if (parent < 0)
+    {
+        world.model = local.model;
+        std::copy(local.normalMatrix, local.normalMatrix + 3, world.normalMatrix);
+        return;
+    }
+
+    // The normal matrix of a product is the product of the normal matrices
+    const InstanceData& parentWorld = scene.world[parent];
+    world.model = parentWorld.model * local.model;
+    for (int c = 0; c < 3; ++c)
+        world.normalMatrix[c] = parentWorld.normalMatrix[0] * local.normalMatrix[c].x + parentWorld.normalMatrix[1] * local.normalMatrix[c].y +
+                                parentWorld.normalMatrix[2] * local.normalMatrix[c].z;
+}
+
+
+// Propagates the nodes moved since the last frame, then copies the changed cube transforms into
+// their instance records, refreshes their bounds and uploads only those records
+void UUpdateScene()
+{
+    if (!gScene.local.dirtyCount)
+        return;
+
+    std::vector<TransformRange> updated;
+    UPropagateTransforms(gScene, updated);
+
+    // Instances are numbered in node order, so each node range covers one run of instances
+    std::vector<TransformRange> instanceRanges;
+    for (const TransformRange& range : updated)
+    {
+        for (size_t node = range.begin; node < range.end; ++node)
+        {
+            int instance = gScene.instance[node];
+            if (instance < 0)
+                continue;
+
+            gInstanceData[instance].model = gScene.world[node].model;
+            std::copy(gScene.world[node].normalMatrix, gScene.world[node].normalMatrix + 3, gInstanceData[instance].normalMatrix);
+            if (!instanceRanges.empty() && instanceRanges.back().end == (size_t)instance)
+                ++instanceRanges.back().end;
+            else
+                instanceRanges.push_back({ (size_t)instance, (size_t)instance + 1 });
+        }
+    }
+
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, gInstanceSsbo);
+    for (const TransformRange& range : instanceRanges)
+    {
+        UUpdateInstanceBounds(range.begin, range.end);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, range.begin * sizeof(InstanceData),
+                        (range.end - range.begin) * sizeof(InstanceData), &gInstanceData[range.begin]);
+    }
+}
+
+
+// World-space bounding spheres of instances [begin, end) of the drawn mesh; the radius grows with
+// the largest axis scale of the model matrix
+void UUpdateInstanceBounds(size_t begin, size_t end)
+{
+    const GLMesh& mesh = *gObjectMesh;
+    for (size_t i = begin; i < end; ++i)
+    {
+        const glm::mat4& model = gInstanceData[i].model;
+        glm::vec3 center = glm::vec3(model * glm::vec4(mesh.boundsCenter, 1.0f));
+        float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        gInstanceBounds.centerX[i] = center.x;
+        gInstanceBounds.centerY[i] = center.y;
+        gInstanceBounds.centerZ[i] = center.z;
+        gInstanceBounds.radius[i] = mesh.boundsRadius * scale;
+    }
+}
+
+
+// Appends a dirty entry and returns its index
+size_t UAddTransform(TransformTable& table, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    size_t index = table.dirty.size();
+    table.positionX.push_back(position.x);
+    table.positionY.push_back(position.y);
+    table.positionZ.push_back(position.z);
+    table.rotationX.push_back(rotation.x);
+    table.rotationY.push_back(rotation.y);
+    table.rotationZ.push_back(rotation.z);
+    table.rotationW.push_back(rotation.w);
+    table.scaleX.push_back(scale.x);
+    table.scaleY.push_back(scale.y);
+    table.scaleZ.push_back(scale.z);
+    table.dirty.push_back(1);
+    ++table.dirtyCount;
+    return index;
+}
+
+
+void USetTransform(TransformTable& table, size_t index, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    table.positionX[index] = position.x;
+    table.positionY[index] = position.y;
+    table.positionZ[index] = position.z;
+    table.rotationX[index] = rotation.x;
+    table.rotationY[index] = rotation.y;
+    table.rotationZ[index] = rotation.z;
+    table.rotationW[index] = rotation.w;
+    table.scaleX[index] = scale.x;
+    table.scaleY[index] = scale.y;
+    table.scaleZ[index] = scale.z;
+
+    table.dirtyCount += table.dirty[index] ? 0 : 1;
+    table.dirty[index] = 1;
+}
+
+
+// Writes model = T * R * S and its normal matrix R * S^-1 (the inverse transpose, exact for this
+// form) for every dirty entry to out, and appends the runs of entries that were dirty to ranges.
+// Large updates are split across the job system. Returns the entries written
+size_t UUpdateTransforms(TransformTable& table, InstanceData* out, std::vector<TransformRange>& ranges)
+{
+    const size_t count = table.dirty.size();
+    size_t written = 0;
+    if (!table.dirtyCount)
+        return 0;
+
+    if (table.dirtyCount < TRANSFORM_PARALLEL_THRESHOLD)
+        written = UUpdateTransformRange(table, out, 0, count, ranges);
+    else
+    {
+        // Slices start on a group of 4; their runs are joined in order afterwards
+        const size_t groups = (count + 3) / 4;
+        std::vector<std::vector<TransformRange>> sliceRanges(UWorkerCount());
+        std::vector<size_t> sliceWritten(UWorkerCount(), 0);
+        UParallelFor(groups, [&](size_t begin, size_t end, unsigned worker)
+        {
+            sliceWritten[worker] = UUpdateTransformRange(table, out, begin * 4, std::min(end * 4, count), sliceRanges[worker]);
+        });
+
+        for (size_t w = 0; w < sliceRanges.size(); ++w)
+        {
+            written += sliceWritten[w];
+            for (const TransformRange& range : sliceRanges[w])
+            {
+                if (!ranges.empty() && ranges.back().end == range.begin)
+                    ranges.back().end = range.end;
+                else
+                    ranges.push_back(range);
+            }
+        }
+    }
+
+    table.dirtyCount = 0;
+    return written;
+}
+
+
+// UUpdateTransforms over entries [begin, end), begin a multiple of 4. Entries are processed 4 at a
+// time: a group with any dirty member is rebuilt whole, but only its dirty members are reported, so
+// callers never treat an unchanged neighbour as moved
+size_t UUpdateTransformRange(TransformTable& table, InstanceData* out, size_t begin, size_t count, std::vector<TransformRange>& ranges)
+{
+    size_t written = 0;
+    for (size_t i = begin; i < count; i += 4)
+    {
+        const size_t end = std::min(i + 4, count);
+        bool dirty = false;
+        for (size_t k = i; k < end; ++k)
+            dirty = dirty || table.dirty[k];
+        if (!dirty)
+            continue;
+
+#if defined(__SSE2__) || defined(_M_X64)
+        if (end - i == 4)
+        {
+            __m128 qx = _mm_loadu_ps(&table.rotationX[i]);
+            __m128 qy = _mm_loadu_ps(&table.rotationY[i]);
+            __m128 qz = _mm_loadu_ps(&table.rotationZ[i]);
+            __m128 qw = _mm_loadu_ps(&table.rotationW[i]);
+            __m128 sx = _mm_loadu_ps(&table.scaleX[i]);
+            __m128 sy = _mm_loadu_ps(&table.scaleY[i]);
+            __m128 sz = _mm_loadu_ps(&table.scaleZ[i]);
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 zero = _mm_setzero_ps();
+
+            // Rotation matrix of each quaternion (as glm::mat3_cast), element by element
+            __m128 x2 = _mm_add_ps(qx, qx), y2 = _mm_add_ps(qy, qy), z2 = _mm_add_ps(qz, qz);
+            __m128 xx = _mm_mul_ps(qx, x2), yy = _mm_mul_ps(qy, y2), zz = _mm_mul_ps(qz, z2);
+            __m128 xy = _mm_mul_ps(qx, y2), xz = _mm_mul_ps(qx, z2), yz = _mm_mul_ps(qy, z2);
+            __m128 wx = _mm_mul_ps(qw, x2), wy = _mm_mul_ps(qw, y2), wz = _mm_mul_ps(qw, z2);
+            __m128 r[3][3] = {
+                { _mm_sub_ps(one, _mm_add_ps(yy, zz)), _mm_add_ps(xy, wz), _mm_sub_ps(xz, wy) },
+                { _mm_sub_ps(xy, wz), _mm_sub_ps(one, _mm_add_ps(xx, zz)), _mm_add_ps(yz, wx) },
+                { _mm_add_ps(xz, wy), _mm_sub_ps(yz, wx), _mm_sub_ps(one, _mm_add_ps(xx, yy)) }
+            };
+            __m128 scale[3] = { sx, sy, sz };
+            __m128 position[3] = { _mm_loadu_ps(&table.positionX[i]), _mm_loadu_ps(&table.positionY[i]), _mm_loadu_ps(&table.positionZ[i]) };
+
+            // One column for 4 objects is 4 registers of x, y, z, w; transposed, it is one register per object
+            auto storeColumn = [&](__m128 x, __m128 y, __m128 z, __m128 w, size_t floatOffset)
+            {
+                _MM_TRANSPOSE4_PS(x, y, z, w);
+                _mm_storeu_ps((float*)&out[i] + floatOffset, x);
+                _mm_storeu_ps((float*)&out[i + 1] + floatOffset, y);
+                _mm_storeu_ps((float*)&out[i + 2] + floatOffset, z);
+                _mm_storeu_ps((float*)&out[i + 3] + floatOffset, w);
+            };
+
+            const size_t modelOffset = offsetof(InstanceData, model) / sizeof(float);
+            const size_t normalOffset = offsetof(InstanceData, normalMatrix) / sizeof(float);
+            for (int c = 0; c < 3; ++c)
+            {
+                __m128 inverseScale = _mm_div_ps(one, scale[c]);
+                storeColumn(_mm_mul_ps(r[c][0], scale[c]), _mm_mul_ps(r[c][1], scale[c]), _mm_mul_ps(r[c][2], scale[c]), zero,
+                            modelOffset + c * 4);
+                storeColumn(_mm_mul_ps(r[c][0], inverseScale), _mm_mul_ps(r[c][1], inverseScale), _mm_mul_ps(r[c][2], inverseScale), zero,
+                            normalOffset + c * 4);
+            }
+            storeColumn(position[0], position[1], position[2], one, modelOffset + 12);
+        }
+        else
+#endif
+        {
+            // Last partial group, and every group on targets without SSE
+            for (size_t k = i; k < end; ++k)
+                UComposeTransform(table, k, out[k]);
+        }
+
+        for (size_t k = i; k < end; ++k)
+        {
+            if (!table.dirty[k])
+                continue;
+            table.dirty[k] = 0;
+            if (!ranges.empty() && ranges.back().end == k)
+                ranges.back().end = k + 1;
+            else
+                ranges.push_back({ k, k + 1 });
+        }
+        written += end - i;
+    }
+    return written;
+}
+
+
+// Scalar form of one UUpdateTransforms entry, with the same arithmetic as the SIMD path
+void UComposeTransform(const TransformTable& table, size_t index, InstanceData& out)
+{
+    glm::quat rotation(table.rotationW[index], table.rotationX[index], table.rotationY[index], table.rotationZ[index]);
+    glm::mat3 r = glm::mat3_cast(rotation);
+    glm::vec3 scale(table.scaleX[index], table.scaleY[index], table.scaleZ[index]);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        out.model[c] = glm::vec4(r[c] * scale[c], 0.0f);
+        out.normalMatrix[c] = glm::vec4(r[c] * (1.0f / scale[c]), 0.0f);
+    }
+    out.model[3] = glm::vec4(table.positionX[index], table.positionY[index], table.positionZ[index], 1.0f);
+}
+
+// Bounding sphere of a mesh: compact meshes are bounded by their quantization box, float meshes
+// are scanned (the box center is used, which is close enough for culling)
+void UComputeMeshBounds(const MeshBlob& blob, glm::vec3& center, float& radius)
+{
+    if (blob.layout == VERTEX_LAYOUT_COMPACT)
+    {
+        center = blob.positionOffset;
+        radius = glm::length(blob.positionScale);
+        return;
+    }
+
+    const GLfloat* vertices = (const GLfloat*)blob.vertices;
+    glm::vec3 minimum(0.0f), maximum(0.0f);
+    for (GLuint v = 0; v < blob.nVertices; ++v)
+    {
+        glm::vec3 position = glm::make_vec3(vertices + v * FLOATS_PER_VERTEX);
+        minimum = v ? glm::min(minimum, position) : position;
+        maximum = v ? glm::max(maximum, position) : position;
+    }
+
+    center = (minimum + maximum) * 0.5f;
+    radius = 0.0f;
+    for (GLuint v = 0; v < blob.nVertices; ++v)
+        radius = std::max(radius, glm::length(glm::make_vec3(vertices + v * FLOATS_PER_VERTEX) - center));
+}
+
+
+// Gribb-Hartmann: each frustum plane is a sum or difference of rows of the view-projection matrix
+FrustumPlanes UExtractFrustumPlanes(const glm::mat4& viewProjection)
+{
+    glm::mat4 rows = glm::transpose(viewProjection); // glm is column-major; rows[i] is row i
+    FrustumPlanes frustum;
+    frustum.planes[0] = rows[3] + rows[0];  // Left
+    frustum.planes[1] = rows[3] - rows[0];  // Right
+    frustum.planes[2] = rows[3] + rows[1];  // Bottom
+    frustum.planes[3] = rows[3] - rows[1];  // Top
+    frustum.planes[4] = rows[3] + rows[2];  // Near
+    frustum.planes[5] = rows[3] - rows[2];  // Far
+
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+
+// Writes the indices in [begin, end) whose sphere touches the frustum to visible, in order, and
+// returns how many there are. Spheres are tested 8 at a time; lanes are compacted without branches
+size_t UCullSpheres(const FrustumPlanes& frustum, const InstanceBounds& bounds, size_t begin, size_t end, GLuint* visible)
+{
+    size_t count = 0;
+    size_t i = begin;
+
+#if defined(__AVX__)
+    __m256 planeX[6], planeY[6], planeZ[6], planeD[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm256_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm256_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm256_set1_ps(frustum.planes[p].z);
+        planeD[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(&bounds.centerX[i]);
+        __m256 y = _mm256_loadu_ps(&bounds.centerY[i]);
+        __m256 z = _mm256_loadu_ps(&bounds.centerZ[i]);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&bounds.radius[i]));
+
+        // Inside unless the sphere lies completely behind some plane
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, planeX[p]), _mm256_mul_ps(y, planeY[p])),
+                                            _mm256_add_ps(_mm256_mul_ps(z, planeZ[p]), planeD[p]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+        }
+
+        unsigned mask = (unsigned)_mm256_movemask_ps(inside);
+        for (unsigned lane = 0; lane < 8; ++lane)
+        {
+            visible[count] = (GLuint)(i + lane);
+            count += (mask >> lane) & 1u;
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128 planeX[6], planeY[6], planeZ[6], planeD[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeD[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+
+    // Two 4-wide halves per iteration, so both paths consume 8 objects at a time
+    for (; i + 8 <= end; i += 8)
+    {
+        unsigned mask = 0;
+        for (size_t half = 0; half < 8; half += 4)
+        {
+            __m128 x = _mm_loadu_ps(&bounds.centerX[i + half]);
+            __m128 y = _mm_loadu_ps(&bounds.centerY[i + half]);
+            __m128 z = _mm_loadu_ps(&bounds.centerZ[i + half]);
+            __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&bounds.radius[i + half]));
+
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int p = 0; p < 6; ++p)
+            {
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, planeX[p]), _mm_mul_ps(y, planeY[p])),
+                                             _mm_add_ps(_mm_mul_ps(z, planeZ[p]), planeD[p]));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+            }
+            mask |= (unsigned)_mm_movemask_ps(inside) << half;
+        }
+
+        for (unsigned lane = 0; lane < 8; ++lane)
+        {
+            visible[count] = (GLuint)(i + lane);
+            count += (mask >> lane) & 1u;
+        }
+    }
+#endif
+
+    // Remainder, and the whole range on targets without SSE
+    for (; i < end; ++i)
+    {
+        glm::vec3 center(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i]);
+        bool inside = true;
+        for (const glm::vec4& plane : frustum.planes)
+            inside = inside && glm::dot(glm::vec3(plane), center) + plane.w >= -bounds.radius[i];
+
+        visible[count] = (GLuint)i;
+        count += inside ? 1 : 0;
+    }
+
+    return count;
+}
+
+
+// Culls the population against the view frustum and records a draw of the survivors of each
+// slice into that slice's command list. Slices compact their survivors in place, so only the used
+// part of each is uploaded. Returns the instances to draw
+size_t UBuildDrawLists(const FrustumPlanes& frustum)
+{
+    const size_t count = gInstanceBounds.radius.size();
+    GLuint* visible = gVisibleInstances.data();
+    gDrawLists.resize(UWorkerCount());
+    for (std::vector<DrawCommand>& list : gDrawLists)
+        list.clear();
+
+    // Without culling the identity list written by UCreateInstances is drawn whole
+    if (!gCullInstances)
+    {
+        gDrawLists[0].push_back({ gObjectMesh, &gCubeMaterial, DRAW_FROM_VISIBLE_LIST, 0, (GLsizei)count, nullptr, 0.0f });
+        return count;
+    }
+
+    auto cullSlice = [&](size_t begin, size_t end, unsigned slice)
+    {
+        size_t sliceVisible = UCullSpheres(frustum, gInstanceBounds, begin, end, visible + begin);
+        if (!sliceVisible)
+            return;
+
+        // The render queue orders the slice by its nearest survivor
+        float depth = FLT_MAX;
+        for (size_t v = begin; v < begin + sliceVisible; ++v)
+        {
+            GLuint i = visible[v];
+            glm::vec3 center(gInstanceBounds.centerX[i], gInstanceBounds.centerY[i], gInstanceBounds.centerZ[i]);
+            depth = std::min(depth, UNearestDepth(frustum.planes[4], center, gInstanceBounds.radius[i]));
+        }
+        gDrawLists[slice].push_back({ gObjectMesh, &gCubeMaterial, DRAW_FROM_VISIBLE_LIST, (GLuint)begin, (GLsizei)sliceVisible,
+                                      nullptr, depth });
+    };
+    if (count < CULL_PARALLEL_THRESHOLD)
+        cullSlice(0, count, 0);
+    else
+        UParallelFor(count, cullSlice);
+
+    // Orphan the old list instead of waiting for the draws that still read it
+    size_t visibleCount = 0;
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, gVisibleSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    for (const std::vector<DrawCommand>& list : gDrawLists)
+    {
+        for (const DrawCommand& command : list)
+        {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, command.firstVisible * sizeof(GLuint), command.instanceCount * sizeof(GLuint),
+                            visible + command.firstVisible);
+            visibleCount += command.instanceCount;
+        }
+    }
+    return visibleCount;
+}
+
+
+// Distance of the nearest point of a sphere past the near plane (negative when it straddles it)
+float UNearestDepth(const glm::vec4& nearPlane, const glm::vec3& center, float radius)
+{
+    return glm::dot(glm::vec3(nearPlane), center) + nearPlane.w - radius;
+}
+
+
+// Records a draw and its sort key; depthRange is the depth that maps to the last bucket
+void UQueueDraw(RenderQueue& queue, uint32_t pass, const DrawCommand& command, float depthRange)
+{
+    const Material& material = *command.material;
+    uint32_t variantKey = UMaterialVariantKey(material, command.source != DRAW_SINGLE);
+    uint64_t texture = (variantKey & SHADER_TEXTURED) ? UResidentTexture(material.textureId) & 0xFFFu : 0;
+    uint64_t depth = (uint64_t)(std::min(std::max(command.depth / depthRange, 0.0f), 1.0f) * 65535.0f);
+
+    // G-buffer variants can only draw in the G-buffer pass, ahead of every forward draw
+    if (variantKey & SHADER_GBUFFER)
+        pass = RENDER_PASS_GBUFFER;
+
+    uint64_t key = (uint64_t)pass << RENDER_KEY_PASS_SHIFT;
+    key |= (uint64_t)(variantKey & 0xFFFu) << RENDER_KEY_PROGRAM_SHIFT;
+    key |= texture << RENDER_KEY_TEXTURE_SHIFT;
+    key |= (uint64_t)(command.mesh->vao & 0xFFu) << RENDER_KEY_MESH_SHIFT;
+    key |= depth << RENDER_KEY_DEPTH_SHIFT;
+
+    queue.entries.push_back({ key, (uint32_t)queue.commands.size() });
+    queue.commands.push_back(command);
+}
+
+
+// Sorts the queue into drawing order, counting the state changes it saves
+void USortRenderQueue(RenderQueue& queue)
+{
+    queue.unsortedStateChanges = UCountStateChanges(queue.entries);
+    URadixSortRenderQueue(queue.entries, queue.scratch);
+    queue.sortedStateChanges = UCountStateChanges(queue.entries);
+}
+
+
+// Stable LSD radix sort on the key, one byte per pass. The eight histograms are built in a single
+// read, and a pass whose byte is the same in every key is skipped, so the unused low bits and the
+// fields every draw shares cost nothing
+void URadixSortRenderQueue(std::vector<RenderQueueEntry>& entries, std::vector<RenderQueueEntry>& scratch)
+{
+    const size_t count = entries.size();
+    if (count < 2)
+        return;
+
+    uint32_t histograms[8][256] = {};
+    for (const RenderQueueEntry& entry : entries)
+        for (int pass = 0; pass < 8; ++pass)
+            ++histograms[pass][(entry.key >> (pass * 8)) & 0xFF];
+
+    scratch.resize(count);
+    for (int pass = 0; pass < 8; ++pass)
+    {
+        uint32_t* histogram = histograms[pass];
+        if (histogram[(entries[0].key >> (pass * 8)) & 0xFF] == count)
+            continue;
+
+        // Turn the counts into the first output slot of each byte value
+        uint32_t offset = 0;
+        for (int value = 0; value < 256; ++value)
+        {
+            uint32_t n = histogram[value];
+            histogram[value] = offset;
+            offset += n;
+        }
+
+        for (const RenderQueueEntry& entry : entries)
+            scratch[histogram[(entry.key >> (pass * 8)) & 0xFF]++] = entry;
+        entries.swap(scratch);
+    }
+}
+
+
+// Program, texture and mesh binds needed to draw the entries in their current order
+int UCountStateChanges(const std::vector<RenderQueueEntry>& entries)
+{
+    const uint64_t fields[] = { 0xFFFull << RENDER_KEY_PROGRAM_SHIFT, 0xFFFull << RENDER_KEY_TEXTURE_SHIFT,
+                                0xFFull << RENDER_KEY_MESH_SHIFT };
+    int changes = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
+        for (uint64_t field : fields)
+            if (i == 0 || (entries[i].key & field) != (entries[i - 1].key & field))
+                ++changes;
+    return changes;
+}
+
+
+// Draws entries [begin, end) of the sorted queue, switching mesh and material only when they change
+void USubmitRenderQueue(const RenderQueue& queue, size_t begin, size_t end)
+{
+    const GLMesh* boundMesh = nullptr;
+    const Material* boundMaterial = nullptr;
+    bool boundInstanced = false;
+    const ShaderVariant* variant = nullptr;
+    for (size_t i = begin; i < end; ++i)
+    {
+        const DrawCommand& command = queue.commands[queue.entries[i].command];
+        const GLMesh& mesh = *command.mesh;
+        bool instanced = command.source != DRAW_SINGLE;
+        if (&mesh != boundMesh)
+        {
+            UBindVertexArray(mesh.vao);
+            boundMesh = &mesh;
+            boundMaterial = nullptr;    // The material uniforms include the mesh dequantization
+        }
+        if (command.material != boundMaterial || instanced != boundInstanced)
+        {
+            variant = UUseMaterial(*command.material, instanced, mesh);
+            boundMaterial = command.material;
+            boundInstanced = instanced;
+        }
+        if (!variant)
+            continue;
+
+        if (command.source == DRAW_FROM_VISIBLE_LIST)
+        {
+            glUniform1ui(variant->uniforms.instanceBase, command.firstVisible);
+            glDrawElementsInstanced(GL_TRIANGLES, mesh.nIndices, mesh.indexType, 0, command.instanceCount);
+        }
+        else if (command.source == DRAW_FROM_INDIRECT)
+            UDrawGpuCulled(mesh, *variant);
+        else
+        {
+            const InstanceData& object = *command.transform;
+            glm::mat3 normalMatrix(glm::vec3(object.normalMatrix[0]), glm::vec3(object.normalMatrix[1]), glm::vec3(object.normalMatrix[2]));
+            glUniformMatrix4fv(variant->uniforms.model, 1, GL_FALSE, glm::value_ptr(object.model));
+            glUniformMatrix3fv(variant->uniforms.normalMatrix, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+            glDrawElements(GL_TRIANGLES, mesh.nIndices, mesh.indexType, 0);
+        }
+        ++gFrameDrawCalls;
+    }
+}
+
+
+// First entry of the sorted queue at or after the given pass
+size_t URenderPassStart(const RenderQueue& queue, uint32_t pass)
+{
+    const uint64_t key = (uint64_t)pass << RENDER_KEY_PASS_SHIFT;
+    auto first = std::lower_bound(queue.entries.begin(), queue.entries.end(), key,
+                                  [](const RenderQueueEntry& entry, uint64_t value) { return entry.key < value; });
+    return (size_t)(first - queue.entries.begin());
+}
+
+
+// Compiles the culling compute shader and creates the indirect draw record and its readback ring.
+// The program is small and built once, so it skips the shader batch and the binary cache
+bool UCreateGpuCuller()
+{
+    GpuCuller& culler = gGpuCuller;
+    std::string defines = "#define DRAW_COMMAND_BINDING " + std::to_string(DRAW_COMMAND_BINDING) + "\n";
+    defines += "#define GPU_CULL_GROUP_SIZE " + std::to_string(GPU_CULL_GROUP_SIZE) + "\n";
+    GLuint computeShader = CompileShader(GL_COMPUTE_SHADER, cullComputeShaderSource, defines);
+    bool compiled = UCheckShaderCompile(computeShader, "COMPUTE");
+
+    culler.program.id = glCreateProgram();
+    glAttachShader(culler.program.id, computeShader);
+    glLinkProgram(culler.program.id);
+    glDeleteShader(computeShader);
+
+    GLint success = GL_FALSE;
+    glGetProgramiv(culler.program.id, GL_LINK_STATUS, &success);
+    if (!compiled || !success)
+    {
+        char infoLog[512];
+        glGetProgramInfoLog(culler.program.id, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        UDestroyGpuCuller();
+        return false;
+    }
+
+    UReflectShaderProgram(culler.program);
+    culler.frustumPlanes = UGetUniformHandle(culler.program, "frustumPlanes");
+    culler.meshBounds = UGetUniformHandle(culler.program, "meshBounds");
+    culler.populationSize = UGetUniformHandle(culler.program, "populationSize");
+
+    glGenBuffers(1, &culler.commandBuffer);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GpuDrawCommands), NULL, GL_DYNAMIC_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_COMMAND_BINDING, culler.commandBuffer);
+
+    glGenBuffers(GPU_CULL_READBACK_FRAMES, culler.readbackBuffers);
+    for (GLuint buffer : culler.readbackBuffers)
+    {
+        UBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+    }
+    UBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    cout << "INFO: Culling on the GPU, " << (GLEW_ARB_indirect_parameters ? "indirect draw count from the buffer" : "one indirect draw")
+         << endl;
+    return true;
+}
+
+
+void UDestroyGpuCuller()
+{
+    GpuCuller& culler = gGpuCuller;
+    for (GLsync& fence : culler.readbackFences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+        fence = 0;
+    }
+    UDeleteBuffers(GPU_CULL_READBACK_FRAMES, culler.readbackBuffers);
+    UDeleteBuffers(1, &culler.commandBuffer);
+    UDeleteProgram(culler.program.id);
+    culler = GpuCuller();
+}
+
+
+// Resets the indirect draw record and dispatches the culling compute shader over the population.
+// Costs the same few calls whatever the population size. Returns the visible count of an earlier
+// frame, since waiting for this one would stall the pipeline
+int UDispatchGpuCull(const FrustumPlanes& frustum)
+{
+    GpuCuller& culler = gGpuCuller;
+    const GLuint count = (GLuint)gInstanceData.size();
+    const GLMesh& mesh = *gObjectMesh;
+
+    GpuDrawCommands reset = { (GLuint)mesh.nIndices, 0, 0, 0, 0, 0 };
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.commandBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(reset), &reset);
+
+    UUseProgram(culler.program.id);
+    glUniform4fv(culler.frustumPlanes, 6, glm::value_ptr(frustum.planes[0]));
+    glUniform4fv(culler.meshBounds, 1, glm::value_ptr(glm::vec4(mesh.boundsCenter, mesh.boundsRadius)));
+    glUniform1ui(culler.populationSize, count);
+    glDispatchCompute((count + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+
+    // The draw reads the record and the visible list; the copy below reads the record too
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // Collect the count copied GPU_CULL_READBACK_FRAMES frames ago if it has landed, then reuse its slot
+    unsigned slot = culler.frame++ % GPU_CULL_READBACK_FRAMES;
+    GLuint readback = culler.readbackBuffers[slot];
+    if (culler.readbackFences[slot])
+    {
+        GLenum status = glClientWaitSync(culler.readbackFences[slot], 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+        {
+            GLuint visible = 0;
+            UBindBuffer(GL_COPY_READ_BUFFER, readback);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(visible), &visible);
+            culler.visibleCount = (int)visible;
+        }
+        glDeleteSync(culler.readbackFences[slot]);
+    }
+
+    UBindBuffer(GL_COPY_READ_BUFFER, culler.commandBuffer);
+    UBindBuffer(GL_COPY_WRITE_BUFFER, readback);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offsetof(GpuDrawCommands, instanceCount), 0, sizeof(GLuint));
+    culler.readbackFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    return culler.visibleCount;
+}
+
+
+// Draws whatever the compute shader let through with one indirect call, with the mesh and the
+// instanced variant bound. With ARB_indirect_parameters the draw count comes from the buffer as
+// well, so a frame with nothing visible draws nothing at all
+void UDrawGpuCulled(const GLMesh& mesh, const ShaderVariant& variant)
+{
+    glUniform1ui(variant.uniforms.instanceBase, 0);
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, gGpuCuller.commandBuffer);
+    if (GLEW_ARB_indirect_parameters)
+    {
+        UBindBuffer(GL_PARAMETER_BUFFER_ARB, gGpuCuller.commandBuffer);
+        glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, mesh.indexType, (const void*)0,
+                                            offsetof(GpuDrawCommands, drawCount), 1, 0);
+    }
+    else
+        glMultiDrawElementsIndirect(GL_TRIANGLES, mesh.indexType, (const void*)0, 1, 0);
+}
+
+
+// Scatters count point lights through the cube population, each circling its own center, and
+// creates the cluster buffers. Replaces any earlier set; 0 turns clustered lighting off
+void UCreatePointLights(int count)
+{
+    UDestroyPointLights();
+    if (count <= 0)
+    {
+        gCubeMaterial.features &= ~SHADER_CLUSTERED;
+        return;
+    }
+
+    // Same extent as the grid UBuildScene lays out, with a margin
+    const float extent = (float)std::ceil(std::cbrt((double)gInstanceCount)) * 1.5f * 0.5f + 1.0f;
+
+    // Fixed seed so every run with the same lights looks the same
+    std::mt19937 random(4321u);
+    std::uniform_real_distribution<float> position(-extent, extent);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    LightClusters& clusters = gLightClusters;
+    clusters.orbits.resize(count);
+    for (PointLightOrbit& orbit : clusters.orbits)
+    {
+        orbit.center = glm::vec3(position(random), position(random), position(random));
+        orbit.orbitRadius = 0.5f + 1.5f * unit(random);
+        orbit.angularVelocity = glm::radians(20.0f + 60.0f * unit(random)) * (unit(random) < 0.5f ? -1.0f : 1.0f);
+        orbit.phase = glm::radians(360.0f * unit(random));
+        orbit.radius = 1.5f + 2.5f * unit(random);
+
+        // Saturated colors: one channel full, the others random
+        glm::vec3 color(unit(random), unit(random), unit(random));
+        color[(int)(unit(random) * 2.999f)] = 1.0f;
+        orbit.color = color * 0.6f;
+    }
+    clusters.lights.resize(count);
+    clusters.bounds.resize(count);
+    clusters.grid.resize(CLUSTER_COUNT * 2);
+    clusters.sliceIndices.resize(CLUSTER_GRID_Z);
+
+    glGenBuffers(1, &clusters.lightSsbo);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.lightSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(PointLight), NULL, GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &clusters.gridSsbo);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.gridSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clusters.grid.size() * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &clusters.indexSsbo);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.indexSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, POINT_LIGHT_BINDING, clusters.lightSsbo);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTER_BINDING, clusters.gridSsbo);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDEX_BINDING, clusters.indexSsbo);
+
+    gCubeMaterial.features |= SHADER_CLUSTERED;
+    cout << "INFO: " << count << " point light(s) in " << CLUSTER_GRID_X << "x" << CLUSTER_GRID_Y << "x" << CLUSTER_GRID_Z
+         << " light clusters" << endl;
+}
+
+
+void UDestroyPointLights()
+{
+    LightClusters& clusters = gLightClusters;
+    UDeleteBuffers(1, &clusters.lightSsbo);
+    UDeleteBuffers(1, &clusters.gridSsbo);
+    UDeleteBuffers(1, &clusters.indexSsbo);
+    clusters = LightClusters();
+}
+
+
+// Moves the point lights to this frame's positions and uploads them. Forward frames also bin them
+// into the clusters and upload the cluster ranges and the index list
+void UUpdateLightClusters(const glm::mat4& view, const glm::mat4& projection)
+{
+    LightClusters& clusters = gLightClusters;
+    const size_t count = clusters.orbits.size();
+    auto boundLights = [&](size_t begin, size_t end, unsigned) { UBoundPointLights(view, projection, begin, end); };
+    if (count < LIGHT_PARALLEL_THRESHOLD)
+        boundLights(0, count, 0);
+    else
+        UParallelFor(count, boundLights);
+
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.lightSsbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(PointLight), clusters.lights.data());
+
+    // Deferred frames draw a volume per light and never read the clusters
+    if (gDeferredShading)
+        return;
+
+    // One job per run of depth slices; each slice owns its clusters, so no job writes where another does
+    UParallelFor(CLUSTER_GRID_Z, [](size_t begin, size_t end, unsigned)
+    {
+        for (size_t slice = begin; slice < end; ++slice)
+            UBinLightSlice((int)slice);
+    });
+
+    // Concatenate the slice lists, moving each cluster's offset by where its slice starts
+    const int sliceClusters = CLUSTER_GRID_X * CLUSTER_GRID_Y;
+    GLuint base = 0;
+    for (int slice = 0; slice < CLUSTER_GRID_Z; ++slice)
+    {
+        for (int cluster = slice * sliceClusters; cluster < (slice + 1) * sliceClusters; ++cluster)
+            clusters.grid[cluster * 2] += base;
+        base += (GLuint)clusters.sliceIndices[slice].size();
+    }
+    clusters.indexCount = base;
+
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.gridSsbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, clusters.grid.size() * sizeof(GLuint), clusters.grid.data());
+
+    // Orphan the old list instead of waiting for the draws that still read it
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.indexSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(clusters.indexCount, 1) * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    GLintptr offset = 0;
+    for (const std::vector<GLuint>& indices : clusters.sliceIndices)
+    {
+        if (indices.empty())
+            continue;
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, indices.size() * sizeof(GLuint), indices.data());
+        offset += indices.size() * sizeof(GLuint);
+    }
+}
+
+
+// Places lights [begin, end) on their orbits and finds the clusters each one reaches. Screen
+// tiles come from a conservative projection of the light's view-space box; slices from its depth
+void UBoundPointLights(const glm::mat4& view, const glm::mat4& projection, size_t begin, size_t end)
+{
+    LightClusters& clusters = gLightClusters;
+    const float sliceScale = CLUSTER_GRID_Z / std::log(CAMERA_FAR_PLANE / CAMERA_NEAR_PLANE);
+    auto slice = [&](float depth) { return (int)(std::log(depth / CAMERA_NEAR_PLANE) * sliceScale); };
+
+    // Smallest and largest projected coordinate over [c - r, c + r] x [depth - r, depth + r]
+    auto tiles = [](float c, float r, float depth, float scale, int tileCount, int& first, int& last)
+    {
+        float high = (c + r) / (c + r >= 0.0f ? depth - r : depth + r) * scale;
+        float low = (c - r) / (c - r <= 0.0f ? depth - r : depth + r) * scale;
+        first = std::max((int)std::floor((low * 0.5f + 0.5f) * tileCount), 0);
+        last = std::min((int)std::floor((high * 0.5f + 0.5f) * tileCount), tileCount - 1);
+    };
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        const PointLightOrbit& orbit = clusters.orbits[i];
+        float angle = orbit.phase + orbit.angularVelocity * gSceneTime;
+        glm::vec3 position = orbit.center + orbit.orbitRadius * glm::vec3(std::cos(angle), 0.0f, std::sin(angle));
+        clusters.lights[i].positionRadius = glm::vec4(position, orbit.radius);
+        clusters.lights[i].color = glm::vec4(orbit.color, 1.0f);
+
+        LightClusterBounds& bounds = clusters.bounds[i];
+        bounds.z0 = 1;
+        bounds.z1 = 0;
+        glm::vec3 center = glm::vec3(view * glm::vec4(position, 1.0f));
+        float depth = -center.z;
+        float r = orbit.radius;
+        if (depth + r < CAMERA_NEAR_PLANE || depth - r > CAMERA_FAR_PLANE)
+            continue;
+
+        // A light reaching in front of the near plane can cover any tile
+        if (depth - r < CAMERA_NEAR_PLANE)
+        {
+            bounds.x0 = bounds.y0 = 0;
+            bounds.x1 = CLUSTER_GRID_X - 1;
+            bounds.y1 = CLUSTER_GRID_Y - 1;
+        }
+        else
+        {
+            tiles(center.x, r, depth, projection[0][0], CLUSTER_GRID_X, bounds.x0, bounds.x1);
+            tiles(center.y, r, depth, projection[1][1], CLUSTER_GRID_Y, bounds.y0, bounds.y1);
+            if (bounds.x0 > bounds.x1 || bounds.y0 > bounds.y1)
+                continue;
+        }
+
+        bounds.z0 = std::max(slice(std::max(depth - r, CAMERA_NEAR_PLANE)), 0);
+        bounds.z1 = std::min(slice(std::min(depth + r, CAMERA_FAR_PLANE)), CLUSTER_GRID_Z - 1);
+    }
+}
+
+
+// Builds the light lists of one depth slice with a counting sort over its tiles. Offsets are
+// relative to the slice until UUpdateLightClusters concatenates the slices
+void UBinLightSlice(int slice)
+{
+    LightClusters& clusters = gLightClusters;
+    const int sliceClusters = CLUSTER_GRID_X * CLUSTER_GRID_Y;
+    GLuint* grid = &clusters.grid[slice * sliceClusters * 2];
+    for (int tile = 0; tile < sliceClusters; ++tile)
+        grid[tile * 2 + 1] = 0;
+
+    // Count the lights per tile, turn the counts into offsets, then fill
+    for (const LightClusterBounds& bounds : clusters.bounds)
+    {
+        if (slice < bounds.z0 || slice > bounds.z1)
+            continue;
+        for (int y = bounds.y0; y <= bounds.y1; ++y)
+            for (int x = bounds.x0; x <= bounds.x1; ++x)
+                ++grid[(y * CLUSTER_GRID_X + x) * 2 + 1];
+    }
+
+    GLuint total = 0;
+    for (int tile = 0; tile < sliceClusters; ++tile)
+    {
+        grid[tile * 2] = total;
+        total += grid[tile * 2 + 1];
+        grid[tile * 2 + 1] = 0;     // Counted again while filling
+    }
+
+    std::vector<GLuint>& indices = clusters.sliceIndices[slice];
+    indices.resize(total);
+    for (size_t light = 0; light < clusters.bounds.size(); ++light)
+    {
+        const LightClusterBounds& bounds = clusters.bounds[light];
+        if (slice < bounds.z0 || slice > bounds.z1)
+            continue;
+        for (int y = bounds.y0; y <= bounds.y1; ++y)
+            for (int x = bounds.x0; x <= bounds.x1; ++x)
+            {
+                GLuint* cluster = &grid[(y * CLUSTER_GRID_X + x) * 2];
+                indices[cluster[0] + cluster[1]++] = (GLuint)light;
+            }
+    }
+}
+
+
+// Builds the lighting programs on the first deferred frame, and the G-buffer whenever the viewport
+// size changes. False when deferred shading cannot run; that is reported once and remembered
+bool UPrepareGBuffer(int width, int height)
+{
+    GBuffer& gbuffer = gGBuffer;
+    if (gbuffer.failed)
+        return false;
+    if (gbuffer.fbo && ((gbuffer.width == width && gbuffer.height == height) || width == 0 || height == 0))
+        return true;    // Current, or a minimized window, which keeps the old targets
+
+    if (!gbuffer.screen.program.id &&
+        (!UCreateDeferredLightProgram(gbuffer.screen, false) || !UCreateDeferredLightProgram(gbuffer.volumes, true)))
+    {
+        std::cerr << "Failed to build the deferred lighting programs; shading stays forward" << std::endl;
+        gbuffer.failed = true;
+        return false;
+    }
+
+    UDestroyGBufferTargets();
+    gbuffer.width = width;
+    gbuffer.height = height;
+    auto createTarget = [&](GLenum format, GLuint& texture)
+    {
+        glGenTextures(1, &texture);
+        UBindTexture(0, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    };
+    createTarget(GL_RGBA8, gbuffer.albedo);
+    createTarget(GL_RGBA16F, gbuffer.normal);
+    createTarget(GL_R16F, gbuffer.highlight);
+    createTarget(GL_DEPTH_COMPONENT24, gbuffer.depth);
+
+    glGenFramebuffers(1, &gbuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gbuffer.albedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gbuffer.normal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, gbuffer.highlight, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gbuffer.depth, 0);
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+    glDrawBuffers(3, drawBuffers);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, gHeadless ? gOffscreenFbo : 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cerr << "G-buffer is incomplete: 0x" << std::hex << status << std::dec << "; shading stays forward" << std::endl;
+        UDestroyGBufferTargets();
+        gbuffer.failed = true;
+        return false;
+    }
+
+    cout << "INFO: Deferred shading into a " << width << "x" << height << " G-buffer" << endl;
+    return true;
+}
+
+
+// Builds one of the two deferred lighting programs through the binary cache, like the material variants
+bool UCreateDeferredLightProgram(DeferredLightProgram& light, bool volumes)
+{
+    PendingProgram pending;
+    pending.vertexSource = deferredLightVertexShaderSource;
+    pending.fragmentSource = deferredLightFragmentShaderSource;
+    pending.defines = "#define DEFERRED_LIGHT_VOLUMES " + std::string(volumes ? "1" : "0") + "\n";
+    pending.defines += "#define GBUFFER_ALBEDO_UNIT " + std::to_string(GBUFFER_ALBEDO_UNIT) + "\n";
+    pending.defines += "#define GBUFFER_NORMAL_UNIT " + std::to_string(GBUFFER_NORMAL_UNIT) + "\n";
+    pending.defines += "#define GBUFFER_HIGHLIGHT_UNIT " + std::to_string(GBUFFER_HIGHLIGHT_UNIT) + "\n";
+    pending.defines += "#define GBUFFER_DEPTH_UNIT " + std::to_string(GBUFFER_DEPTH_UNIT) + "\n";
+    pending.program = &light.program;
+
+    UBeginShaderProgram(pending);
+    if (!UEndShaderProgram(pending))
+        return false;
+
+    light.inverseViewProjection = UGetUniformHandle(light.program, "inverseViewProjection");
+    light.viewportSize = UGetUniformHandle(light.program, "viewportSize");
+    if (volumes)
+    {
+        light.positionScale = UGetUniformHandle(light.program, "positionScale");
+        light.positionOffset = UGetUniformHandle(light.program, "positionOffset");
+    }
+    return true;
+}
+
+
+void UDestroyGBufferTargets()
+{
+    GBuffer& gbuffer = gGBuffer;
+    glDeleteFramebuffers(1, &gbuffer.fbo);
+    UDeleteTextures(1, &gbuffer.albedo);
+    UDeleteTextures(1, &gbuffer.normal);
+    UDeleteTextures(1, &gbuffer.highlight);
+    UDeleteTextures(1, &gbuffer.depth);
+    gbuffer.fbo = gbuffer.albedo = gbuffer.normal = gbuffer.highlight = gbuffer.depth = 0;
+}
+
+
+void UDestroyGBuffer()
+{
+    UDestroyGBufferTargets();
+    UDestroyShaderProgram(gGBuffer.screen.program);
+    UDestroyShaderProgram(gGBuffer.volumes.program);
+    gGBuffer = GBuffer();
+}
+
+
+// Lights the filled G-buffer into the frame: one full-screen triangle for the ambient term and the
+// lamp, which also copies the depth over, then one instanced draw of light volumes that adds every
+// point light to the pixels it can reach. Leaves the frame bound for the forward draws
+void ULightGBuffer(const glm::mat4& viewProjection)
+{
+    GBuffer& gbuffer = gGBuffer;
+    glBindFramebuffer(GL_FRAMEBUFFER, gHeadless ? gOffscreenFbo : 0);
+    UBindTexture(GBUFFER_ALBEDO_UNIT, gbuffer.albedo);
+    UBindTexture(GBUFFER_NORMAL_UNIT, gbuffer.normal);
+    UBindTexture(GBUFFER_HIGHLIGHT_UNIT, gbuffer.highlight);
+    UBindTexture(GBUFFER_DEPTH_UNIT, gbuffer.depth);
+
+    const glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    const glm::vec2 viewportSize((float)gbuffer.width, (float)gbuffer.height);
+
+    // The triangle has no vertex data, but core profiles draw nothing without a vertex array
+    UUseProgram(gbuffer.screen.program.id);
+    glUniformMatrix4fv(gbuffer.screen.inverseViewProjection, 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+    glUniform2fv(gbuffer.screen.viewportSize, 1, glm::value_ptr(viewportSize));
+    UBindVertexArray(gMesh.vao);
+    glDepthFunc(GL_ALWAYS);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    ++gFrameDrawCalls;
+
+    // Back faces behind the stored surface mark the pixels a light may reach, with the camera
+    // inside the volume too. Depth clamping keeps volumes that cross the far plane whole
+    const GLsizei lightCount = (GLsizei)gLightClusters.lights.size();
+    if (lightCount > 0)
+    {
+        UUseProgram(gbuffer.volumes.program.id);
+        glUniformMatrix4fv(gbuffer.volumes.inverseViewProjection, 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+        glUniform2fv(gbuffer.volumes.viewportSize, 1, glm::value_ptr(viewportSize));
+        glUniform3fv(gbuffer.volumes.positionScale, 1, glm::value_ptr(gMesh.positionScale));
+        glUniform3fv(gbuffer.volumes.positionOffset, 1, glm::value_ptr(gMesh.positionOffset));
+
+        USetCapability(GL_BLEND, true);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glDepthFunc(GL_GREATER);
+        glDepthMask(GL_FALSE);
+        glEnable(GL_DEPTH_CLAMP);
+        glDrawElementsInstanced(GL_TRIANGLES, gMesh.nIndices, gMesh.indexType, 0, lightCount);
+        ++gFrameDrawCalls;
+        glDisable(GL_DEPTH_CLAMP);
+        glDepthMask(GL_TRUE);
+        USetCapability(GL_BLEND, false);
+    }
+    glDepthFunc(GL_LESS);
+}
+
+
+// Prints frames and cube instances drawn per second, about once a second
+void UReportThroughput()
+{
+    static auto lastReport = std::chrono::steady_clock::now();
+    static int framesSinceReport = 0;
+    static long long visibleSinceReport = 0;
+    static long long issuedSinceReport = 0, elidedSinceReport = 0;
+    static long long unsortedSinceReport = 0, sortedSinceReport = 0;
+
+    ++framesSinceReport;
+    visibleSinceReport += gFrameVisibleInstances;
+    issuedSinceReport += gGLState.issued;
+    elidedSinceReport += gGLState.elided;
+    unsortedSinceReport += gRenderQueue.unsortedStateChanges;
+    sortedSinceReport += gRenderQueue.sortedStateChanges;
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastReport).count();
+    if (seconds < 1.0)
+        return;
+
+    double fps = framesSinceReport / seconds;
+    double visible = (double)visibleSinceReport / framesSinceReport;
+    cout << "INFO: " << fps << " frames/s, " << fps * gInstanceCount / 1.0e6 << " M instances/s, "
+         << visible << " drawn and " << gInstanceCount - visible << " culled per frame, "
+         << (double)issuedSinceReport / framesSinceReport << " GL state calls issued and "
+         << (double)elidedSinceReport / framesSinceReport << " elided per frame, "
+         << (double)unsortedSinceReport / framesSinceReport << " state changes as recorded and "
+         << (double)sortedSinceReport / framesSinceReport << " sorted" << endl;
+
+    framesSinceReport = 0;
+    visibleSinceReport = 0;
+    issuedSinceReport = 0;
+    elidedSinceReport = 0;
+    unsortedSinceReport = 0;
+    sortedSinceReport = 0;
+    lastReport = now;
+}
+
+// Starts the profiler: allocates the event ring and the GPU query pairs, and lines up the GPU clock
+void UCreateProfiler()
+{
+    gProfiler.ring.slots.reset(new ProfileSlot[PROFILE_RING_SIZE]);
+    gProfiler.ring.mask = PROFILE_RING_SIZE - 1;
+    for (size_t i = 0; i < PROFILE_RING_SIZE; ++i)
+        gProfiler.ring.slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    gProfiler.gpuQueries.resize(PROFILE_GPU_QUERIES);
+    for (GpuQueryPair& pair : gProfiler.gpuQueries)
+    {
+        glGenQueries(1, &pair.begin);
+        glGenQueries(1, &pair.end);
+    }
+
+    // GL_TIMESTAMP counts from an arbitrary point; remember where "now" is on both clocks
+    gProfiler.origin = std::chrono::steady_clock::now();
+    GLint64 gpuNow = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    gProfiler.gpuOffset = -(int64_t)gpuNow;
+
+    UProfileThreadId(); // The main thread is thread 0 in the trace
+    gProfiler.enabled = true;
+}
+
+
+// Small, stable id of the calling thread, in order of first use
+uint32_t UProfileThreadId()
+{
+    static std::atomic<uint32_t> nextId{ 0 };
+    thread_local uint32_t id = nextId++;
+    return id;
+}
+
+
+// Nanoseconds since the profiler started
+uint64_t UProfileNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gProfiler.origin).count();
+}
+
+
+// Opens a named scope on the calling thread. GPU scopes (GL thread only) also time the GL commands
+// issued until UProfileEnd. Does nothing while the profiler is off
+ProfileMark UProfileBegin(const char* name, bool gpu)
+{
+    ProfileMark mark = { name, 0, -1 };
+    if (!gProfiler.enabled)
+        return mark;
+
+    mark.start = UProfileNow();
+    if (gpu)
+    {
+        // Never wait for an old range: if its results are still outstanding, this range is not timed
+        size_t index = gProfiler.nextGpuQuery;
+        GpuQueryPair& pair = gProfiler.gpuQueries[index];
+        if (pair.inFlight)
+            ++gProfiler.dropped;
+        else
+        {
+            gProfiler.nextGpuQuery = (index + 1) % gProfiler.gpuQueries.size();
+            pair.name = name;
+            pair.frame = (uint32_t)gFrameIndex;
+            glQueryCounter(pair.begin, GL_TIMESTAMP);
+            mark.gpuQuery = (int)index;
+        }
+    }
+    return mark;
+}
+
+
+void UProfileEnd(const ProfileMark& mark)
+{
+    if (!gProfiler.enabled)
+        return;
+
+    if (mark.gpuQuery >= 0)
+    {
+        GpuQueryPair& pair = gProfiler.gpuQueries[mark.gpuQuery];
+        glQueryCounter(pair.end, GL_TIMESTAMP);
+        pair.inFlight = true;
+    }
+
+    ProfileEvent event = { mark.name, mark.start, UProfileNow() - mark.start, (uint32_t)gFrameIndex, UProfileThreadId() };
+    if (!UProfilePush(event))
+        ++gProfiler.dropped;
+}
+
+
+// Lock-free push from any thread; false when the ring is full
+bool UProfilePush(const ProfileEvent& event)
+{
+    ProfileRing& ring = gProfiler.ring;
+    size_t position = ring.tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        ProfileSlot& slot = ring.slots[position & ring.mask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            // The slot is free for this position; claim it unless another producer got there first
+            if (ring.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                slot.event = event;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+            return false; // Still holds an event from one lap ago
+        else
+            position = ring.tail.load(std::memory_order_relaxed);
+    }
+}
+
+
+// Lock-free pop from any thread; false when the ring is empty
+bool UProfilePop(ProfileEvent& event)
+{
+    ProfileRing& ring = gProfiler.ring;
+    size_t position = ring.head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        ProfileSlot& slot = ring.slots[position & ring.mask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (ring.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                event = slot.event;
+                slot.sequence.store(position + ring.mask + 1, std::memory_order_release); // Free for the next lap
+                return true;
+            }
+        }
+        else if (difference < 0)
+            return false;
+        else
+            position = ring.head.load(std::memory_order_relaxed);
+    }
+}
+
+
+// Turns GPU ranges whose results have arrived into events. Without wait, only results that are
+// already available are read, so the frame never stalls on the GPU
+void UCollectGpuQueries(bool wait)
+{
+    if (!gProfiler.enabled)
+        return;
+
+    if (wait)
+        glFinish();
+
+    for (GpuQueryPair& pair : gProfiler.gpuQueries)
+    {
+        if (!pair.inFlight)
+            continue;
+
+        GLint available = GL_FALSE;
+        glGetQueryObjectiv(pair.end, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(pair.begin, GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(pair.end, GL_QUERY_RESULT, &end);
+        pair.inFlight = false;
+
+        ProfileEvent event = { pair.name, (uint64_t)((int64_t)begin + gProfiler.gpuOffset), end - begin, pair.frame, PROFILE_GPU_THREAD };
+        if (!UProfilePush(event))
+            ++gProfiler.dropped;
+    }
+}
+
+
+// Moves everything in the ring into the history kept for the trace and the summary
+void UDrainProfiler()
+{
+    if (!gProfiler.ring.slots)
+        return;
+
+    ProfileEvent event;
+    while (UProfilePop(event))
+    {
+        if (gProfiler.history.size() < PROFILE_HISTORY_LIMIT)
+            gProfiler.history.push_back(event);
+        else
+            ++gProfiler.dropped;
+    }
+}
+
+
+// Writes the history in the Chrome trace event format (chrome://tracing, Perfetto)
+bool UWriteChromeTrace(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        std::cerr << "Could not create trace " << path << std::endl;
+        return false;
+    }
+
+    // Name the rows: the main thread, the render thread (windowed runs), the workers and the GPU timeline
+    uint32_t threadCount = 0;
+    for (const ProfileEvent& event : gProfiler.history)
+        if (event.thread != PROFILE_GPU_THREAD)
+            threadCount = std::max(threadCount, event.thread + 1);
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", PROFILE_GPU_THREAD);
+    for (uint32_t thread = 0; thread < threadCount; ++thread)
+    {
+        const char* role = thread == gProfiler.renderThread ? "render" : thread == 0 ? "main" : "worker";
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                thread, role, thread);
+    }
+
+    // Complete ("X") events, timestamps in microseconds
+    for (const ProfileEvent& event : gProfiler.history)
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"frame\":%u}}",
+                event.name, event.thread == PROFILE_GPU_THREAD ? "gpu" : "cpu", event.start / 1000.0, event.duration / 1000.0,
+                event.thread, event.frame);
+
+    fprintf(file, "\n]}\n");
+    bool ok = ferror(file) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "Failed to write trace " << path << std::endl;
+    return ok;
+}
+
+
+// Prints p50/p95/p99 of every scope, CPU and GPU separately
+void UReportProfile()
+{
+    // Keyed by name and timeline; names are static strings, but equal names may live at different addresses
+    std::unordered_map<std::string, std::vector<double>> durations;
+    std::vector<std::string> order;
+    for (const ProfileEvent& event : gProfiler.history)
+    {
+        std::string key = std::string(event.thread == PROFILE_GPU_THREAD ? "gpu " : "cpu ") + event.name;
+        std::vector<double>& samples = durations[key];
+        if (samples.empty())
+            order.push_back(key);
+        samples.push_back(event.duration / 1.0e6);
+    }
+
+    cout << "INFO: Profile of " << gFrameIndex << " frames (" << gProfiler.history.size() << " events, "
+         << gProfiler.dropped << " dropped), milliseconds:" << endl;
+    for (const std::string& key : order)
+    {
+        std::vector<double>& samples = durations[key];
+        std::sort(samples.begin(), samples.end());
+
+        char line[160];
+        snprintf(line, sizeof(line), "  %-22s n=%-7zu p50 %8.3f  p95 %8.3f  p99 %8.3f", key.c_str(), samples.size(),
+                 UPercentile(samples, 0.50), UPercentile(samples, 0.95), UPercentile(samples, 0.99));
+        cout << line << endl;
+    }
+}
+
+
+// Collects the outstanding GPU ranges, writes the trace and summary, and releases the queries
+void UDestroyProfiler()
+{
+    if (!gProfiler.enabled)
+        return;
+
+    UCollectGpuQueries(true);
+    UDrainProfiler();
+    gProfiler.enabled = false;
+
+    if (UWriteChromeTrace(gProfilePath))
+        cout << "INFO: Wrote trace " << gProfilePath << endl;
+    UReportProfile();
+
+    for (GpuQueryPair& pair : gProfiler.gpuQueries)
+    {
+        glDeleteQueries(1, &pair.begin);
+        glDeleteQueries(1, &pair.end);
+    }
+    gProfiler.gpuQueries.clear();
+    gProfiler.history.clear();
+}
+
+
+// Value at fraction p (0..1) of an ascending, non-empty sample list
+double UPercentile(const std::vector<double>& sorted, double p)
+{
+    return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+
+// Parses one whole integer; trailing characters or overflow are an error
+bool UParseInt(const char* text, int& value)
+{
+    const char* end = text + strlen(text);
+    int parsed;
+    std::from_chars_result result = std::from_chars(text, end, parsed);
+    if (result.ec != std::errc() || result.ptr != end)
+    {
+        std::cerr << "Expected an integer, got '" << text << "'" << std::endl;
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+
+// Parses "1,1000,10000" into values; reports and returns false on anything else
+bool UParseIntList(const char* text, std::vector<int>& values)
+{
+    std::vector<int> parsed;
+    const char* p = text;
+    const char* end = text + strlen(text);
+    while (p < end)
+    {
+        int value;
+        std::from_chars_result result = std::from_chars(p, end, value);
+        if (result.ec != std::errc() || (result.ptr < end && *result.ptr != ','))
+        {
+            std::cerr << "Expected a comma separated list of integers, got '" << text << "'" << std::endl;
+            return false;
+        }
+        parsed.push_back(value);
+        p = result.ptr + 1;
+    }
+
+    if (parsed.empty())
+    {
+        std::cerr << "Empty list" << std::endl;
+        return false;
+    }
+    values = parsed;
+    return true;
+}
+
+
+// Scripted camera for benchmarks: circles the origin while bobbing up and down, always looking at
+// the center, so every run sees exactly the same views
+void UApplyCameraPath(float seconds, float radius)
+{
+    float angle = seconds * glm::radians(30.0f);
+    float height = radius * 0.3f * std::sin(seconds * 0.7f);
+
+    gCamera.Position = glm::vec3(radius * std::sin(angle), height, radius * std::cos(angle));
+    gCamera.Front = glm::normalize(-gCamera.Position);
+    gCamera.Right = glm::normalize(glm::cross(gCamera.Front, gCamera.WorldUp));
+    gCamera.Up = glm::normalize(glm::cross(gCamera.Right, gCamera.Front));
+}
+
+
+// Creates a size x size RGBA checkerboard, so benchmarks do not depend on image files
+bool UCreateCheckerTexture(int size, GLuint& textureId)
+{
+    std::vector<unsigned char> pixels((size_t)size * size * 4);
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+        {
+            unsigned char value = ((x / 8 + y / 8) & 1) ? 230 : 60;
+            unsigned char* pixel = &pixels[((size_t)y * size + x) * 4];
+            pixel[0] = value;
+            pixel[1] = value;
+            pixel[2] = (unsigned char)(255 - value);
+            pixel[3] = 255;
+        }
+
+    return UCreateTextureFromPixels(pixels.data(), size, size, 4, "checker", textureId);
+}
+
+
+// Renders one scene: warm-up frames first, then gHeadlessFrames measured frames
+bool URunBenchmarkScene(const BenchmarkScene& scene, BenchmarkResult& result)
+{
+    // Same starting state for every scene
+    const glm::vec3 lightStart = gSim.lightPosition;
+    const float elapsedStart = gSim.elapsed;
+    gSim.deferred = scene.deferred;
+    UDestroyInstances();
+    gInstanceCount = scene.instances;
+    UCreateInstances(gInstanceCount);
+
+    GLuint textureId;
+    if (!UCreateCheckerTexture(scene.textureSize, textureId))
+        return false;
+    gCubeMaterial.textureId = textureId;
+
+    // The first light is the lamp; the rest are clustered point lights
+    gCubeMaterial.lightCount = std::min(scene.lightCount, MAX_SHADER_LIGHTS);
+    UCreatePointLights(std::max(scene.lightCount - MAX_SHADER_LIGHTS, 0));
+
+    // Back off far enough to see the whole grid (UCreateInstances spaces cubes 1.5 apart)
+    float extent = (float)std::ceil(std::cbrt((double)scene.instances)) * 1.5f;
+    float radius = std::max(7.0f, extent * 1.2f);
+
+    int frames = gHeadlessFrames;
+    std::vector<GLuint> queries(frames);
+    glGenQueries(frames, queries.data());
+    std::vector<double> cpuMs, gpuMs;
+    long long drawCalls = 0, visible = 0, stateIssued = 0, stateElided = 0;
+    int deferredFrames = 0;
+    auto measureStart = std::chrono::steady_clock::now();
+
+    for (int frame = -BENCHMARK_WARMUP_FRAMES; frame < frames; ++frame)
+    {
+        bool measured = frame >= 0;
+        if (frame == 0)
+        {
+            // Measure from an idle GPU, so warm-up work does not leak into the first frames
+            glFinish();
+            measureStart = std::chrono::steady_clock::now();
+        }
+
+        UStepSimulation(HEADLESS_TIMESTEP);
+        UApplySimState(gSim, 1.0f);
+        UApplyCameraPath((frame + BENCHMARK_WARMUP_FRAMES) * HEADLESS_TIMESTEP, radius);
+
+        auto cpuStart = std::chrono::steady_clock::now();
+        if (measured)
+            glBeginQuery(GL_TIME_ELAPSED, queries[frame]);
+        URender();
+        if (measured)
+        {
+            glEndQuery(GL_TIME_ELAPSED);
+            cpuMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpuStart).count());
+            drawCalls += gFrameDrawCalls;
+            visible += gFrameVisibleInstances;
+            stateIssued += gGLState.issued;
+            stateElided += gGLState.elided;
+            deferredFrames += gFrameDeferred ? 1 : 0;
+        }
+        gFrameIndex++;
+    }
+
+    glFinish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measureStart).count();
+
+    // Everything has finished, so reading the results cannot stall
+    for (GLuint query : queries)
+    {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+        gpuMs.push_back(elapsed / 1.0e6);
+    }
+    glDeleteQueries(frames, queries.data());
+    UDestroyTexture(textureId);
+    gSim.lightPosition = lightStart;
+    gLightPosition = lightStart;
+    gSim.elapsed = elapsedStart;
+
+    std::sort(cpuMs.begin(), cpuMs.end());
+    std::sort(gpuMs.begin(), gpuMs.end());
+    const double percentiles[3] = { 0.50, 0.95, 0.99 };
+
+    // Record the pipeline that was drawn, not the one requested: without lights, or without a
+    // G-buffer, deferred frames fall back to forward
+    result.scene = scene;
+    result.scene.deferred = deferredFrames == frames;
+    if (scene.deferred && !result.scene.deferred)
+        cout << "WARNING: Benchmark scene drew " << frames - deferredFrames << " of " << frames << " deferred frames forward" << endl;
+    result.frames = frames;
+    result.fps = frames / seconds;
+    for (int i = 0; i < 3; ++i)
+    {
+        result.cpu[i] = UPercentile(cpuMs, percentiles[i]);
+        result.gpu[i] = UPercentile(gpuMs, percentiles[i]);
+    }
+    result.drawCalls = (double)drawCalls / frames;
+    result.stateIssued = (double)stateIssued / frames;
+    result.stateElided = (double)stateElided / frames;
+    result.visible = (double)visible / frames;
+    return true;
+}
+
+
+// Runs every scene of the benchmark matrix and writes the results
+bool URunBenchmark()
+{
+    if (gHeadlessFrames < 1)
+    {
+        std::cerr << "The benchmark needs at least one frame per scene" << std::endl;
+        return false;
+    }
+
+    const int instanceCount = gInstanceCount;
+    const GLuint textureId = gCubeMaterial.textureId;
+    const int lightCount = gCubeMaterial.lightCount;
+    const bool deferred = gSim.deferred;
+
+    std::vector<BenchmarkResult> results;
+    for (int instances : gBenchmarkInstances)
+        for (int textureSize : gBenchmarkTextureSizes)
+            for (int lights : gBenchmarkLights)
+                for (int pipeline : gBenchmarkDeferred)
+                {
+                    BenchmarkScene scene = { instances, textureSize, lights, pipeline != 0 };
+                    BenchmarkResult result;
+                    if (!URunBenchmarkScene(scene, result))
+                        return false;
+
+                    char line[220];
+                    snprintf(line, sizeof(line), "INFO: Benchmark %7d instances, %5d px texture, %d light(s), %s: %8.1f fps, cpu p50 %.3f ms, gpu p50 %.3f ms",
+                             instances, textureSize, lights, result.scene.deferred ? "deferred" : "forward", result.fps, result.cpu[0], result.gpu[0]);
+                    cout << line << endl;
+                    results.push_back(result);
+                }
+
+    // Leave the scene as main set it up
+    UDestroyInstances();
+    gInstanceCount = instanceCount;
+    UCreateInstances(gInstanceCount);
+    gCubeMaterial.textureId = textureId;
+    gCubeMaterial.lightCount = lightCount;
+    UCreatePointLights(gPointLightCount);
+    gSim.deferred = deferred;
+
+    return UWriteBenchmarkResults(results);
+}
+
+
+// Writes PREFIX.csv (one row per scene) and PREFIX.json (the same, plus the GL renderer)
+bool UWriteBenchmarkResults(const std::vector<BenchmarkResult>& results)
+{
+    std::string csvPath = std::string(gBenchmarkPrefix) + ".csv";
+    std::string jsonPath = std::string(gBenchmarkPrefix) + ".json";
+    FILE* csv = fopen(csvPath.c_str(), "w");
+    FILE* json = fopen(jsonPath.c_str(), "w");
+    if (!csv || !json)
+    {
+        std::cerr << "Could not create " << (csv ? jsonPath : csvPath) << std::endl;
+        if (csv)
+            fclose(csv);
+        if (json)
+            fclose(json);
+        return false;
+    }
+
+    fprintf(csv, "instances,texture_size,lights,deferred,frames,fps,cpu_p50_ms,cpu_p95_ms,cpu_p99_ms,gpu_p50_ms,gpu_p95_ms,gpu_p99_ms,draw_calls_per_frame,instances_drawn_per_frame,state_calls_issued_per_frame,state_calls_elided_per_frame\n");
+    fprintf(json, "{\n  \"renderer\": \"%s\",\n  \"version\": \"%s\",\n  \"warmup_frames\": %d,\n  \"scenes\": [",
+            (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION), BENCHMARK_WARMUP_FRAMES);
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchmarkResult& r = results[i];
+        fprintf(csv, "%d,%d,%d,%d,%d,%.2f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.2f,%.1f,%.2f,%.2f\n", r.scene.instances, r.scene.textureSize,
+                r.scene.lightCount, r.scene.deferred ? 1 : 0, r.frames, r.fps, r.cpu[0], r.cpu[1], r.cpu[2], r.gpu[0], r.gpu[1], r.gpu[2], r.drawCalls, r.visible,
+                r.stateIssued, r.stateElided);
+        fprintf(json, "%s\n    { \"instances\": %d, \"texture_size\": %d, \"lights\": %d, \"deferred\": %s, \"frames\": %d, \"fps\": %.2f,"
+                      " \"cpu_ms\": { \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f },"
+                      " \"gpu_ms\": { \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f }, \"draw_calls_per_frame\": %.2f,"
+                      " \"instances_drawn_per_frame\": %.1f, \"state_calls_issued_per_frame\": %.2f,"
+                      " \"state_calls_elided_per_frame\": %.2f }",
+                i ? "," : "", r.scene.instances, r.scene.textureSize, r.scene.lightCount,
+                r.scene.deferred ? "true" : "false", r.frames, r.fps, r.cpu[0], r.cpu[1], r.cpu[2], r.gpu[0], r.gpu[1], r.gpu[2], r.drawCalls, r.visible, r.stateIssued, r.stateElided);
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    bool ok = ferror(csv) == 0 && ferror(json) == 0;
+    ok = fclose(csv) == 0 && ok;
+    ok = fclose(json) == 0 && ok;
+    if (!ok)
+    {
+        std::cerr << "Failed to write benchmark results " << gBenchmarkPrefix << ".csv/.json" << std::endl;
+        return false;
+    }
+
+    cout << "INFO: Wrote " << csvPath << " and " << jsonPath << endl;
+    return true;
+}
+
+
+// Functioned called to render a frame
+void URender()
+{
+    gFrameDrawCalls = 0;
+    gGLState.issued = gGLState.elided = 0;
+
+    // Deferred frames need the G-buffer at the viewport size; if it cannot be built, draw forward
+    if (gDeferredShading && !UPrepareGBuffer(gViewportWidth, gViewportHeight))
+        gDeferredShading = false;
+
+    // Only reach GL on the first frame; the state cache elides them after that
+    ProfileMark clearMark = UProfileBegin("clear", true);
+    USetCapability(GL_DEPTH_TEST, true);
+    USetClearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Common matrices
+    glm::mat4 view = gCamera.GetViewMatrix();
+    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT,
+                                            CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE);
+    UUpdateFrameUniformBuffer(view, projection);
+    UProfileEnd(clearMark);
+
+    if (!gLightClusters.orbits.empty())
+    {
+        ProfileMark lightsMark = UProfileBegin("light clusters", false);
+        UUpdateLightClusters(view, projection);
+        UProfileEnd(lightsMark);
+    }
+
+    // Matrices of moved objects, rebuilt before culling reads their bounds
+    ProfileMark transformMark = UProfileBegin("transforms", false);
+    const TransformTable& nodes = gScene.local;
+    if (glm::vec3(nodes.positionX[gLampNode], nodes.positionY[gLampNode], nodes.positionZ[gLampNode]) != gLightPosition)
+        USetTransform(gScene.local, gLampNode, gLightPosition, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), gLightScale);
+    UUpdateScene();
+    UProfileEnd(transformMark);
+
+    // Only instances inside the view frustum are drawn; each culling slice records its own draw
+    ProfileMark cullMark = UProfileBegin("cull", gGpuCulling);
+    FrustumPlanes frustum = UExtractFrustumPlanes(projection * view);
+    if (gGpuCulling)
+        gFrameVisibleInstances = UDispatchGpuCull(frustum);
+    else
+        gFrameVisibleInstances = (int)UBuildDrawLists(frustum);
+    UProfileEnd(cullMark);
+
+    // Every draw of the frame goes through the render queue: the cubes, then the lamp
+    ProfileMark queueMark = UProfileBegin("sort", false);
+    const float depthRange = CAMERA_FAR_PLANE - CAMERA_NEAR_PLANE;
+    RenderQueue& queue = gRenderQueue;
+    queue.commands.clear();
+    queue.entries.clear();
+    if (gGpuCulling)
+        UQueueDraw(queue, RENDER_PASS_OPAQUE, { gObjectMesh, &gCubeMaterial, DRAW_FROM_INDIRECT, 0, 0, nullptr, 0.0f }, depthRange);
+    for (const std::vector<DrawCommand>& list : gDrawLists)
+        for (const DrawCommand& command : list)
+            UQueueDraw(queue, RENDER_PASS_OPAQUE, command, depthRange);
+
+    const InstanceData& lamp = gScene.world[gLampNode];
+    float lampRadius = gMesh.boundsRadius * std::max(gLightScale.x, std::max(gLightScale.y, gLightScale.z));
+    float lampDepth = UNearestDepth(frustum.planes[4], glm::vec3(lamp.model * glm::vec4(gMesh.boundsCenter, 1.0f)), lampRadius);
+    UQueueDraw(queue, RENDER_PASS_OPAQUE, { &gMesh, &gLampMaterial, DRAW_SINGLE, 0, 1, &lamp, lampDepth }, depthRange);
+    USortRenderQueue(queue);
+    UProfileEnd(queueMark);
+
+    // Lit draws fill the G-buffer, which is then lit once per light; unlit ones (the lamp) follow forward.
+    // Without lit draws (no lights) there is nothing to put in the G-buffer, and the frame is forward
+    ProfileMark drawMark = UProfileBegin("draw", true);
+    size_t forwardStart = URenderPassStart(queue, RENDER_PASS_OPAQUE);
+    gFrameDeferred = gDeferredShading && forwardStart > 0;
+    if (gFrameDeferred)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        USubmitRenderQueue(queue, 0, forwardStart);
+
+        ProfileMark lightingMark = UProfileBegin("deferred lighting", true);
+        ULightGBuffer(projection * view);
+        UProfileEnd(lightingMark);
+        USubmitRenderQueue(queue, forwardStart, queue.entries.size());
+    }
+    else
+        USubmitRenderQueue(queue, 0, queue.entries.size());
+    UProfileEnd(drawMark);
+
+    ProfileMark presentMark = UProfileBegin("present", true);
+    UPresentFrame();
+    UProfileEnd(presentMark);
+}
+
+
+// Swaps the window buffers, or in headless mode optionally dumps the offscreen frame
+void UPresentFrame()
+{
+    if (!gHeadless)
+    {
+        glfwSwapBuffers(gWindow);
+        return;
+    }
+
+    if (gFrameDumpDir)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "frame_%05d.ppm", gFrameIndex);
+        if (!UWriteFrame((fs::path(gFrameDumpDir) / name).string()))
+            std::cerr << "Failed to write frame " << gFrameIndex << std::endl;
+    }
+}
+
+
+// Reads back the offscreen color buffer and writes it as a binary PPM (P6) image
+bool UWriteFrame(const std::string& path)
+{
+    std::vector<unsigned char> pixels(WINDOW_WIDTH * WINDOW_HEIGHT * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    // OpenGL rows start at the bottom, PPM rows start at the top
+    const size_t rowSize = WINDOW_WIDTH * 3;
+    for (int row = WINDOW_HEIGHT - 1; row >= 0; --row)
+        fwrite(pixels.data() + row * rowSize, 1, rowSize, file);
+
+    // A full disk shows up as a stream error or a failed flush on close
+    bool ok = ferror(file) == 0;
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(GLMesh &mesh)
+{
+    MeshData meshData;
+    if (!UBuildCubeMesh(meshData))
+        return;
+
+    UUploadMesh(mesh, meshData);
+}
+
+
+// Builds the indexed cube shared by the lit object and the lamp
+bool UBuildCubeMesh(MeshData& meshData)
+{
+     // Position and Color data
+    std::vector<GLfloat> verts = {
+        //Positions          //Normals
+        // ------------------------------------------------------
+        //Back Face          //Negative Z Normal  Texture Coords.
+       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+        0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+       -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+        //Front Face         //Positive Z Normal
+       -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+       -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+       -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+        //Left Face          //Negative X Normal
+       -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+       -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+       -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+       -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+       -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+       -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+        //Right Face         //Positive X Normal
+        0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+        0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+        0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+        //Bottom Face        //Negative Y Normal
+       -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+        0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+        0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+       -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+       -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+        //Top Face           //Positive Y Normal
+       -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+        0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+        0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+       -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+       -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Weld the 36 expanded vertices and optimize them for the post-transform cache
+    return UBuildIndexedMesh(verts, meshData, "cube");
+}
+
+
+// Turns a non-indexed triangle list into an indexed mesh: welds duplicate vertices, reorders triangles
+// for post-transform cache locality, then reorders vertices for fetch locality. Prints ACMR and bytes saved
+bool UBuildIndexedMesh(const std::vector<GLfloat>& expandedVerts, MeshData& meshData, const char* meshName)
+{
+    if (expandedVerts.size() % FLOATS_PER_VERTEX != 0 || (expandedVerts.size() / FLOATS_PER_VERTEX) % 3 != 0) {
+        std::cerr << "Error: Vertex data size is not aligned with expected layout." << std::endl;
+        return false;
+    }
+
+    UWeldVertices(expandedVerts, meshData);
+    UOptimizeMesh(meshData, expandedVerts.size() / FLOATS_PER_VERTEX, meshName);
+    return true;
+}
+
+
+// Reorders an indexed mesh for post-transform cache and vertex fetch locality, then reports
+// ACMR and the bytes saved against the expandedCount-vertex non-indexed equivalent
+void UOptimizeMesh(MeshData& meshData, size_t expandedCount, const char* meshName)
+{
+    float acmrBefore = UComputeACMR(meshData.indices, meshData.vertices.size() / FLOATS_PER_VERTEX, VERTEX_CACHE_SIZE);
+
+    UOptimizeVertexCache(meshData.indices, meshData.vertices.size() / FLOATS_PER_VERTEX);
+    UOptimizeVertexFetch(meshData);
+
+    const size_t vertexCount = meshData.vertices.size() / FLOATS_PER_VERTEX;
+    float acmrAfter = UComputeACMR(meshData.indices, vertexCount, VERTEX_CACHE_SIZE);
+
+    size_t indexSize = vertexCount <= 0xFFFF ? sizeof(GLushort) : sizeof(GLuint);
+    size_t bytesBefore = expandedCount * FLOATS_PER_VERTEX * sizeof(GLfloat);
+    size_t bytesAfter = meshData.vertices.size() * sizeof(GLfloat) + meshData.indices.size() * indexSize;
+
+    cout << "INFO: Mesh '" << meshName << "': " << expandedCount << " -> " << vertexCount << " vertices, ACMR "
+         << acmrBefore << " -> " << acmrAfter << " (FIFO " << VERTEX_CACHE_SIZE << "), " << bytesBefore << " -> "
+         << bytesAfter << " bytes (" << (long long)bytesBefore - (long long)bytesAfter << " saved)" << endl;
+}
+
+
+// Merges bitwise-identical vertices of an expanded triangle list and builds the index buffer
+void UWeldVertices(const std::vector<GLfloat>& expandedVerts, MeshData& meshData)
+{
+    const size_t expandedCount = expandedVerts.size() / FLOATS_PER_VERTEX;
+
+    // Open addressing hash table of unique vertex indices, kept at most half full
+    size_t tableSize = 1;
+    while (tableSize < expandedCount * 2)
+        tableSize <<= 1;
+    std::vector<GLuint> table(tableSize, ~0u);
+
+    meshData.vertices.clear();
+    meshData.indices.resize(expandedCount);
+
+    for (size_t v = 0; v < expandedCount; ++v)
+    {
+        const GLfloat* vertex = &expandedVerts[v * FLOATS_PER_VERTEX];
+
+        // FNV-1a over the float bits; -0.0 and 0.0 hash and compare equal
+        uint64_t hash = 14695981039346656037ull;
+        for (GLuint f = 0; f < FLOATS_PER_VERTEX; ++f)
+        {
+            GLfloat value = vertex[f] == 0.0f ? 0.0f : vertex[f];
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            hash = (hash ^ bits) * 1099511628211ull;
+        }
+
+        size_t slot = hash & (tableSize - 1);
+        while (true)
+        {
+            GLuint existing = table[slot];
+            if (existing == ~0u)
+            {
+                existing = (GLuint)(meshData.vertices.size() / FLOATS_PER_VERTEX);
+                meshData.vertices.insert(meshData.vertices.end(), vertex, vertex + FLOATS_PER_VERTEX);
+                table[slot] = existing;
+                meshData.indices[v] = existing;
+                break;
+            }
+
+            const GLfloat* candidate = &meshData.vertices[existing * FLOATS_PER_VERTEX];
+            bool same = true;
+            for (GLuint f = 0; f < FLOATS_PER_VERTEX && same; ++f)
+                same = candidate[f] == vertex[f];
+
+            if (same)
+            {
+                meshData.indices[v] = existing;
+                break;
+            }
+            slot = (slot + 1) & (tableSize - 1);
+        }
+    }
+}
+
+
+// Reorders triangles for post-transform vertex cache locality (Tom Forsyth's linear-speed algorithm)
+void UOptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount)
+{
+    const int cacheSize = 32;
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    // Vertex score: recently used vertices and vertices with few remaining triangles score higher
+    auto vertexScore = [cacheSize](int cachePosition, GLuint remainingTriangles) -> float
+    {
+        if (remainingTriangles == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 0)
+        {
+            if (cachePosition < 3)
+                score = 0.75f; // The last triangle's vertices score equally so its winding doesn't matter
+            else
+                score = std::pow(1.0f - (cachePosition - 3) / float(cacheSize - 3), 1.5f);
+        }
+        return score + 2.0f * std::pow((float)remainingTriangles, -0.5f);
+    };
+
+    // Triangle adjacency per vertex; the first remaining[v] entries are the triangles not yet emitted
+    std::vector<GLuint> remaining(vertexCount, 0);
+    for (GLuint index : indices)
+        remaining[index]++;
+
+    std::vector<GLuint> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v)
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + remaining[v];
+
+    std::vector<GLuint> adjacency(indices.size());
+    std::vector<GLuint> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (size_t t = 0; t < triangleCount; ++t)
+        for (int k = 0; k < 3; ++k)
+            adjacency[fill[indices[t * 3 + k]]++] = (GLuint)t;
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> score(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        score[v] = vertexScore(-1, remaining[v]);
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<char> emitted(triangleCount, 0);
+    for (size_t t = 0; t < triangleCount; ++t)
+        triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+
+    std::vector<GLuint> output;
+    output.reserve(indices.size());
+    std::vector<GLuint> cache;
+    cache.reserve(cacheSize + 3);
+    size_t scanCursor = 0;
+
+    for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        // Best triangle touching the cache; fall back to the next triangle not yet emitted
+        long best = -1;
+        float bestScore = -1.0f;
+        for (GLuint v : cache)
+            for (GLuint a = adjacencyOffset[v]; a < adjacencyOffset[v] + remaining[v]; ++a)
+            {
+                GLuint t = adjacency[a];
+                if (triangleScore[t] > bestScore)
+                {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+
+        if (best < 0)
+        {
+            while (emitted[scanCursor])
+                ++scanCursor;
+            best = (long)scanCursor;
+        }
+
+        emitted[best] = 1;
+        const GLuint* triangle = &indices[best * 3];
+        output.insert(output.end(), triangle, triangle + 3);
+
+        // Move the triangle's vertices to the front of the LRU cache and drop it from their adjacency
+        for (int k = 2; k >= 0; --k)
+        {
+            GLuint v = triangle[k];
+            auto it = std::find(cache.begin(), cache.end(), v);
+            if (it != cache.end())
+                cache.erase(it);
+            cache.insert(cache.begin(), v);
+
+            GLuint last = adjacencyOffset[v] + remaining[v] - 1;
+            for (GLuint a = adjacencyOffset[v]; a <= last; ++a)
+                if (adjacency[a] == (GLuint)best)
+                {
+                    std::swap(adjacency[a], adjacency[last]);
+                    break;
+                }
+            remaining[v]--;
+        }
+
+        // Vertices pushed out of the cache lose their position bonus
+        for (size_t c = 0; c < cache.size(); ++c)
+            cachePosition[cache[c]] = c < (size_t)cacheSize ? (int)c : -1;
+        std::vector<GLuint> touched(cache.begin(), cache.end());
+        if (cache.size() > (size_t)cacheSize)
+            cache.resize(cacheSize);
+
+        // Rescore the touched vertices and the triangles that still use them
+        for (GLuint v : touched)
+            score[v] = vertexScore(cachePosition[v], remaining[v]);
+        for (GLuint v : touched)
+            for (GLuint a = adjacencyOffset[v]; a < adjacencyOffset[v] + remaining[v]; ++a)
+            {
+                GLuint t = adjacency[a];
+                triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+            }
+    }
+
+    indices.swap(output);
+}
+
+
+// Renumbers vertices in order of first use so vertex fetches walk memory linearly; unused vertices are dropped
+void UOptimizeVertexFetch(MeshData& meshData)
+{
+    const size_t vertexCount = meshData.vertices.size() / FLOATS_PER_VERTEX;
+    std::vector<GLuint> remap(vertexCount, ~0u);
+    std::vector<GLfloat> reordered;
+    reordered.reserve(meshData.vertices.size());
+
+    GLuint next = 0;
+    for (GLuint& index : meshData.indices)
+    {
+        if (remap[index] == ~0u)
+        {
+            remap[index] = next++;
+            const GLfloat* vertex = &meshData.vertices[index * FLOATS_PER_VERTEX];
+            reordered.insert(reordered.end(), vertex, vertex + FLOATS_PER_VERTEX);
+        }
+        index = remap[index];
+    }
+
+    meshData.vertices.swap(reordered);
+}
+
+
+// Average cache miss ratio: vertices transformed per triangle with a FIFO post-transform cache (3.0 = no reuse)
+float UComputeACMR(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize)
+{
+    if (indices.empty())
+        return 0.0f;
+
+    // With a FIFO cache a vertex stays resident until cacheSize more misses have happened
+    std::vector<long long> loadedAt(vertexCount, -(long long)cacheSize - 1);
+    long long misses = 0;
+    for (GLuint index : indices)
+    {
+        if (misses - loadedAt[index] >= cacheSize)
+        {
+            loadedAt[index] = misses;
+            ++misses;
+        }
+    }
+
+    return (float)misses / (indices.size() / 3);
+}
+
+
+// Creates the VAO, vertex buffer and index buffer for an indexed mesh
+void UUploadMesh(GLMesh &mesh, const MeshData& meshData)
+{
+    PackedVertices packed;
+    std::vector<GLushort> shortIndices;
+    MeshBlob blob;
+    UMakeMeshBlob(meshData, packed, shortIndices, blob);
+    UUploadMeshBlob(mesh, blob);
+}
+
+
+// Converts a mesh to the bytes the GL consumes; blob points into packed, shortIndices or meshData
+void UMakeMeshBlob(const MeshData& meshData, PackedVertices& packed, std::vector<GLushort>& shortIndices, MeshBlob& blob)
+{
+    // Pick the smallest vertex layout that stays within the precision bound
+    UPackVertices(meshData, gVertexPrecision, packed);
+
+    blob.layout = packed.layout;
+    blob.positionScale = packed.positionScale;
+    blob.positionOffset = packed.positionOffset;
+    blob.nVertices = static_cast<GLuint>(meshData.vertices.size() / FLOATS_PER_VERTEX);
+    blob.nIndices = static_cast<GLuint>(meshData.indices.size());
+    blob.vertices = packed.bytes.data();
+    blob.vertexBytes = packed.bytes.size();
+
+    // 16-bit indices halve index bandwidth whenever the mesh is small enough
+    if (blob.nVertices <= 0xFFFF)
+    {
+        shortIndices.assign(meshData.indices.begin(), meshData.indices.end());
+        blob.indexType = GL_UNSIGNED_SHORT;
+        blob.indices = shortIndices.data();
+        blob.indexBytes = shortIndices.size() * sizeof(GLushort);
+    }
+    else
+    {
+        blob.indexType = GL_UNSIGNED_INT;
+        blob.indices = meshData.indices.data();
+        blob.indexBytes = meshData.indices.size() * sizeof(GLuint);
+    }
+}
+
+
+void UUseProgram(GLuint program)
+{
+    if (gGLState.program == program)
+    {
+        ++gGLState.elided;
+        return;
+    }
+    glUseProgram(program);
+    gGLState.program = program;
+    ++gGLState.issued;
+}
+
+
+void UBindVertexArray(GLuint vertexArray)
+{
+    if (gGLState.vertexArray == vertexArray)
+    {
+        ++gGLState.elided;
+        return;
+    }
+    glBindVertexArray(vertexArray);
+    gGLState.vertexArray = vertexArray;
+    ++gGLState.issued;
+}
+
+
+// Binds a 2D texture to a unit and leaves that unit active, so glTex* calls that follow affect it
+void UBindTexture(GLuint unit, GLuint texture)
+{
+    if (gGLState.activeTextureUnit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        gGLState.activeTextureUnit = unit;
+        ++gGLState.issued;
+    }
+
+    if (gGLState.textures[unit] == texture)
+    {
+        ++gGLState.elided;
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    gGLState.textures[unit] = texture;
+    ++gGLState.issued;
+}
+
+
+// Binds a buffer to a generic target; targets the cache does not track are always bound
+void UBindBuffer(GLenum target, GLuint buffer)
+{
+    for (int i = 0; i < CACHED_BUFFER_TARGET_COUNT; ++i)
+    {
+        if (CACHED_BUFFER_TARGETS[i] != target)
+            continue;
+        if (gGLState.buffers[i] == buffer)
+        {
+            ++gGLState.elided;
+            return;
+        }
+        gGLState.buffers[i] = buffer;
+        break;
+    }
+    glBindBuffer(target, buffer);
+    ++gGLState.issued;
+}
+
+
+// Indexed bindings are set once at creation and always issued; they replace the generic binding too
+void UBindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    glBindBufferBase(target, index, buffer);
+    ++gGLState.issued;
+    for (int i = 0; i < CACHED_BUFFER_TARGET_COUNT; ++i)
+        if (CACHED_BUFFER_TARGETS[i] == target)
+            gGLState.buffers[i] = buffer;
+}
+
+
+void USetCapability(GLenum capability, bool enabled)
+{
+    int i = 0;
+    while (i < CACHED_CAPABILITY_COUNT && CACHED_CAPABILITIES[i] != capability)
+        ++i;
+    if (i < CACHED_CAPABILITY_COUNT)
+    {
+        if (gGLState.capabilities[i] == enabled)
+        {
+            ++gGLState.elided;
+            return;
+        }
+        gGLState.capabilities[i] = enabled;
+    }
+
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+    ++gGLState.issued;
+}
+
+
+void USetClearColor(const glm::vec4& color)
+{
+    if (gGLState.clearColor == color)
+    {
+        ++gGLState.elided;
+        return;
+    }
+    glClearColor(color.r, color.g, color.b, color.a);
+    gGLState.clearColor = color;
+    ++gGLState.issued;
+}
+
+
+// A deleted program stays current, and allocated, until another is used; release it right away
+void UDeleteProgram(GLuint program)
+{
+    glDeleteProgram(program);
+    if (program && gGLState.program == program)
+    {
+        glUseProgram(0);
+        gGLState.program = 0;
+    }
+}
+
+
+void UDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    for (GLsizei i = 0; i < count; ++i)
+        if (vertexArrays[i] && gGLState.vertexArray == vertexArrays[i])
+            gGLState.vertexArray = 0;
+    glDeleteVertexArrays(count, vertexArrays);
+}
+
+
+void UDeleteTextures(GLsizei count, const GLuint* textures)
+{
+    for (GLsizei i = 0; i < count; ++i)
+        for (GLuint& bound : gGLState.textures)
+            if (textures[i] && bound == textures[i])
+                bound = 0;
+    glDeleteTextures(count, textures);
+}
+
+
+void UDeleteBuffers(GLsizei count, const GLuint* buffers)
+{
+    for (GLsizei i = 0; i < count; ++i)
+        for (GLuint& bound : gGLState.buffers)
+            if (buffers[i] && bound == buffers[i])
+                bound = 0;
+    glDeleteBuffers(count, buffers);
+}
+
+
+// Creates the VAO and buffers from GPU-ready bytes, with no intermediate copy
+void UUploadMeshBlob(GLMesh &mesh, const MeshBlob& blob)
+{
+    mesh.nVertices = blob.nVertices;
+    mesh.nIndices = blob.nIndices;
+    mesh.indexType = blob.indexType;
+    mesh.layout = blob.layout;
+    mesh.positionScale = blob.positionScale;
+    mesh.positionOffset = blob.positionOffset;
+    UComputeMeshBounds(blob, mesh.boundsCenter, mesh.boundsRadius);
+
+    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
+    UBindVertexArray(mesh.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(1, &mesh.vbo);
+    UBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, blob.vertexBytes, blob.vertices, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+
+    glGenBuffers(1, &mesh.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, blob.indexBytes, blob.indices, GL_STATIC_DRAW);
+
+    USetVertexLayout(mesh.layout);
+
+    // Unbind the VAO first so the index buffer binding stays recorded in it
+    UBindVertexArray(0);
+}
+
+
+// Sets up the vertex attribute pointers of the bound VAO/VBO for the given layout
+void USetVertexLayout(GLint layout)
+{
+    if (layout == VERTEX_LAYOUT_COMPACT)
+    {
+        // Normalized integer attributes arrive in the shader as floats in [-1, 1] or [0, 1]
+        GLint stride = sizeof(CompactVertex);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, position));
+        glEnableVertexAttribArray(0);
+
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offsetof(CompactVertex, normal));
+        glEnableVertexAttribArray(1);
+
+        glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, uv));
+        glEnableVertexAttribArray(2);
+        return;
+    }
+
+    const GLuint floatsPerVertex = FLOATS_PER_POSITION;
+    const GLuint floatsPerNormal = FLOATS_PER_NORMAL;
+    const GLuint floatsPerUV = FLOATS_PER_UV;
+
+    // Stride = position(3) + normal(3) + uv(2) = 8 floats per vertex. A tightly packed stride is 0.
+    GLint stride =  sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+
+    // Create Vertex Attribute Pointers
+    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    glEnableVertexAttribArray(2);
+}
+
+
+// Converts a mesh to the compact layout when it meets the precision bound, otherwise keeps floats
+void UPackVertices(const MeshData& meshData, float precision, PackedVertices& packed)
+{
+    const size_t vertexCount = meshData.vertices.size() / FLOATS_PER_VERTEX;
+
+    float maxError = 0.0f;
+    if (precision > 0.0f && UPackCompactVertices(meshData, precision, packed, maxError))
+    {
+        cout << "INFO: Compact vertex layout, " << vertexCount * sizeof(CompactVertex) << " bytes instead of "
+             << meshData.vertices.size() * sizeof(GLfloat) << " (max position error " << maxError << ")" << endl;
+        return;
+    }
+
+    packed.layout = VERTEX_LAYOUT_FLOAT;
+    packed.positionScale = glm::vec3(1.0f);
+    packed.positionOffset = glm::vec3(0.0f);
+    packed.bytes.resize(meshData.vertices.size() * sizeof(GLfloat));
+    memcpy(packed.bytes.data(), meshData.vertices.data(), packed.bytes.size());
+
+    cout << "INFO: Float vertex layout, " << packed.bytes.size() << " bytes" << endl;
+}
+
+
+// Quantizes positions to the mesh bounds, packs normals to 10 bits and UVs to 16 bits.
+// Fails when the UVs leave [0, 1] or the worst position error exceeds the bound
+bool UPackCompactVertices(const MeshData& meshData, float precision, PackedVertices& packed, float& maxError)
+{
+    const size_t vertexCount = meshData.vertices.size() / FLOATS_PER_VERTEX;
+    if (vertexCount == 0)
+        return false;
+
+    // Bounds of the mesh; positions are stored relative to its center, scaled by its half extent
+    glm::vec3 minimum(meshData.vertices[0], meshData.vertices[1], meshData.vertices[2]);
+    glm::vec3 maximum = minimum;
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        const GLfloat* vertex = &meshData.vertices[v * FLOATS_PER_VERTEX];
+        glm::vec3 position(vertex[0], vertex[1], vertex[2]);
+        minimum = glm::min(minimum, position);
+        maximum = glm::max(maximum, position);
+
+        const GLfloat* uv = vertex + FLOATS_PER_POSITION + FLOATS_PER_NORMAL;
+        if (uv[0] < 0.0f || uv[0] > 1.0f || uv[1] < 0.0f || uv[1] > 1.0f)
+            return false;
+    }
+
+    glm::vec3 offset = (minimum + maximum) * 0.5f;
+    glm::vec3 scale = (maximum - minimum) * 0.5f;
+    for (int axis = 0; axis < 3; ++axis)
+        if (scale[axis] <= 0.0f)
+            scale[axis] = 1.0f; // Flat along this axis; any scale reproduces it exactly
+
+    std::vector<CompactVertex> compact(vertexCount);
+    maxError = 0.0f;
+
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        const GLfloat* vertex = &meshData.vertices[v * FLOATS_PER_VERTEX];
+        const GLfloat* normal = vertex + FLOATS_PER_POSITION;
+        const GLfloat* uv = normal + FLOATS_PER_NORMAL;
+        CompactVertex& out = compact[v];
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float unit = glm::clamp((vertex[axis] - offset[axis]) / scale[axis], -1.0f, 1.0f);
+            out.position[axis] = (GLshort)std::lround(unit * 32767.0f);
+
+            // Decode exactly as the GL does for normalized shorts to measure the real error
+            float decoded = std::max(out.position[axis] / 32767.0f, -1.0f) * scale[axis] + offset[axis];
+            maxError = std::max(maxError, std::fabs(decoded - vertex[axis]));
+        }
+        out.position[3] = 0;
+
+        GLuint packedNormal = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int component = (int)std::lround(glm::clamp(normal[axis], -1.0f, 1.0f) * 511.0f);
+            packedNormal |= ((GLuint)component & 0x3FFu) << (10 * axis);
+        }
+        out.normal = packedNormal;
+
+        out.uv[0] = (GLushort)std::lround(uv[0] * 65535.0f);
+        out.uv[1] = (GLushort)std::lround(uv[1] * 65535.0f);
+    }
+
+    if (maxError > precision)
+        return false;
+
+    packed.layout = VERTEX_LAYOUT_COMPACT;
+    packed.positionScale = scale;
+    packed.positionOffset = offset;
+    packed.bytes.resize(compact.size() * sizeof(CompactVertex));
+    memcpy(packed.bytes.data(), compact.data(), packed.bytes.size());
+    return true;
+}
+
+
+void UDestroyMesh(GLMesh &mesh)
+{
+    UDeleteVertexArrays(1, &mesh.vao);
+    UDeleteBuffers(1, &mesh.vbo);
+    UDeleteBuffers(1, &mesh.ebo);
+}
+
+
+// Number of worker threads used by the loaders
+unsigned UWorkerCount()
+{
+    unsigned count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+
+// Runs body over [0, count) split into one contiguous range per worker thread; worker is the index
+// of the range. The ranges run as jobs while the job system is up, on threads of their own otherwise
+void UParallelFor(size_t count, const std::function<void(size_t begin, size_t end, unsigned worker)>& body)
+{
+    unsigned workers = (unsigned)std::min<size_t>(UWorkerCount(), std::max<size_t>(count, 1));
+    if (workers <= 1)
+    {
+        body(0, count, 0);
+        return;
+    }
+
+    if (!gJobs.queues.empty())
+    {
+        std::atomic<int> pending{ 0 };
+        for (unsigned w = 1; w < workers; ++w)
+            USubmitJob([&body, count, w, workers] { body(count * w / workers, count * (w + 1) / workers, w); }, pending);
+        body(0, count / workers, 0);
+        UWaitJobs(pending);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (unsigned w = 1; w < workers; ++w)
+        threads.emplace_back(body, count * w / workers, count * (w + 1) / workers, w);
+
+    body(0, count / workers, 0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+
+// Starts one worker per core besides the calling thread, which owns queue 0
+void UCreateJobSystem()
+{
+    unsigned threadCount = UWorkerCount();
+    for (unsigned q = 0; q < threadCount; ++q)
+        gJobs.queues.emplace_back(new JobQueue);
+    for (unsigned q = 1; q < threadCount; ++q)
+        gJobs.threads.emplace_back(UJobWorker, q);
+
+    cout << "INFO: Job system running on " << threadCount << " threads" << endl;
+}
+
+
+// Stops and joins the workers. Jobs still queued are dropped, so wait for every batch first
+void UDestroyJobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(gJobs.sleepMutex);
+        gJobs.stopping = true;
+    }
+    gJobs.wake.notify_all();
+    for (std::thread& thread : gJobs.threads)
+        thread.join();
+
+    gJobs.threads.clear();
+    gJobs.queues.clear();
+    gJobs.queued = 0;
+    gJobs.stopping = false;
+}
+
+
+// Queues run on the calling thread's own queue and counts it in pending
+void USubmitJob(std::function<void()> run, std::atomic<int>& pending)
+{
+    ++pending;
+    JobQueue& queue = *gJobs.queues[gJobQueueIndex];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back({ std::move(run), &pending });
+    }
+
+    // Counted under the sleep mutex, so a worker about to sleep cannot miss it
+    {
+        std::lock_guard<std::mutex> lock(gJobs.sleepMutex);
+        ++gJobs.queued;
+    }
+    gJobs.wake.notify_one();
+}
+
+
+// Runs one job: the newest of the caller's own queue, else the oldest stolen from another queue.
+// Returns false when every queue is empty
+bool URunJob()
+{
+    const size_t queueCount = gJobs.queues.size();
+    Job job;
+    bool found = false;
+    for (size_t offset = 0; offset < queueCount && !found; ++offset)
+    {
+        JobQueue& queue = *gJobs.queues[(gJobQueueIndex + offset) % queueCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+            continue;
+
+        if (offset == 0)
+        {
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+        }
+        else
+        {
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+        }
+        found = true;
+    }
+    if (!found)
+        return false;
+
+    --gJobs.queued;
+    job.run();
+    --*job.pending;
+    return true;
+}
+
+
+// Helps with queued jobs until every job counted in pending has returned
+void UWaitJobs(std::atomic<int>& pending)
+{
+    while (pending > 0)
+    {
+        if (!URunJob())
+            std::this_thread::yield();
+    }
+}
+
+
+// Worker loop: runs or steals jobs, and sleeps while there are none
+void UJobWorker(unsigned queueIndex)
+{
+    gJobQueueIndex = queueIndex;
+    while (true)
+    {
+        if (URunJob())
+            continue;
+
+        std::unique_lock<std::mutex> lock(gJobs.sleepMutex);
+        gJobs.wake.wait(lock, [] { return gJobs.stopping || gJobs.queued > 0; });
+        if (gJobs.stopping)
+            return;
+    }
+}
+
+
+// Maps a whole file read-only; the loaders parse straight out of the mapping
+bool UMapFile(const char* path, MappedFile& file)
+{
+#ifdef _WIN32
+    file.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file.file, &size);
+    file.size = (size_t)size.QuadPart;
+    if (file.size == 0)
+        return true;
+
+    file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!file.mapping)
+        return false;
+    file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    file.fd = open(path, O_RDONLY);
+    if (file.fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(file.fd, &info) != 0)
+        return false;
+    file.size = (size_t)info.st_size;
+    if (file.size == 0)
+        return true;
+
+    void* mapping = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    madvise(mapping, file.size, MADV_SEQUENTIAL);
+    file.data = (const unsigned char*)mapping;
+#endif
+    return file.data != nullptr;
+}
+
+
+void UUnmapFile(MappedFile& file)
+{
+#ifdef _WIN32
+    if (file.data)
+        UnmapViewOfFile(file.data);
+    if (file.mapping)
+        CloseHandle(file.mapping);
+    if (file.file != INVALID_HANDLE_VALUE)
+        CloseHandle(file.file);
+    file.mapping = NULL;
+    file.file = INVALID_HANDLE_VALUE;
+#else
+    if (file.data)
+        munmap((void*)file.data, file.size);
+    if (file.fd >= 0)
+        close(file.fd);
+    file.fd = -1;
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+
+// Loads an OBJ, glTF or GLB file into an indexed mesh in the interleaved position/normal/uv layout
+bool ULoadMesh(const char* path, MeshData& meshData)
+{
+    std::string extension = fs::path(path).extension().string();
+    for (char& c : extension)
+        c = (char)tolower((unsigned char)c);
+
+    auto start = std::chrono::steady_clock::now();
+    bool loaded;
+    if (extension == ".obj")
+        loaded = ULoadObj(path, meshData);
+    else if (extension == ".gltf" || extension == ".glb")
+        loaded = ULoadGltf(path, meshData);
+    else
+    {
+        std::cerr << "Unsupported mesh format: " << path << std::endl;
+        return false;
+    }
+
+    if (loaded)
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << "INFO: Loaded " << path << ": " << meshData.indices.size() / 3 << " triangles in " << seconds
+             << " s on " << UWorkerCount() << " threads" << endl;
+    }
+    return loaded;
+}
+
+
+// Skips spaces and tabs within a line
+const char* USkipBlanks(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+
+// Returns the start of the line after p
+const char* UNextLine(const char* p, const char* end)
+{
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+
+// Parses up to count floats from one OBJ statement; missing values stay 0
+void UParseObjFloats(const char* p, const char* end, float* out, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        p = USkipBlanks(p, end);
+        float value = 0.0f;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+            value = 0.0f;
+        out[i] = value;
+        p = result.ptr;
+    }
+}
+
+
+// Parses one "v", "v/vt", "v//vn" or "v/vt/vn" face corner into 0-based global indices (-1 when absent).
+// Negative OBJ indices are relative to the number of elements declared so far
+const char* UParseObjCorner(const char* p, const char* end, const int64_t declared[3], int32_t corner[3])
+{
+    corner[0] = corner[1] = corner[2] = -1;
+    for (int k = 0; k < 3; ++k)
+    {
+        int64_t value = 0;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec == std::errc() && value != 0)
+            corner[k] = (int32_t)(value > 0 ? value - 1 : declared[k] + value);
+        p = result.ptr;
+
+        if (p >= end || *p != '/')
+            break;
+        ++p;
+    }
+
+    // Skip anything left of the token
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        ++p;
+    return p;
+}
+
+
+// Counts the statements in [p, end) so every chunk knows where its output goes before parsing
+void UCountObjChunk(const char* p, const char* end, ObjChunkCounts& counts)
+{
+    while (p < end)
+    {
+        p = USkipBlanks(p, end);
+        const char* lineEnd = UNextLine(p, end);
+
+        if (end - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+            counts.positions++;
+        else if (end - p > 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+            counts.uvs++;
+        else if (end - p > 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+            counts.normals++;
+        else if (end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            // A polygon with n corners is triangulated into n - 2 triangles
+            int corners = 0;
+            const char* q = p + 1;
+            while (true)
+            {
+                q = USkipBlanks(q, lineEnd);
+                if (q >= lineEnd || *q == '\r' || *q == '\n')
+                    break;
+                ++corners;
+                while (q < lineEnd && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+                    ++q;
+            }
+            if (corners >= 3)
+                counts.triangles += corners - 2;
+        }
+
+        p = lineEnd;
+    }
+}
+
+
+// Streams an OBJ file from a memory mapping. Chunks split at line boundaries are counted and then parsed in
+// parallel straight into shared arrays; duplicate corners are welded in parallel hash partitions
+bool ULoadObj(const char* path, MeshData& meshData)
+{
+    MappedFile file;
+    if (!UMapFile(path, file))
+    {
+        std::cerr << "Failed to map mesh file: " << path << std::endl;
+        UUnmapFile(file);
+        return false;
+    }
+
+    const char* text = (const char*)file.data;
+    const char* textEnd = text + file.size;
+
+    // Chunk boundaries always fall on the start of a line
+    const unsigned chunkCount = std::max(1u, std::min<unsigned>(UWorkerCount() * 4, (unsigned)(file.size / 65536 + 1)));
+    std::vector<const char*> chunkStart(chunkCount + 1, textEnd);
+    chunkStart[0] = text;
+    for (unsigned c = 1; c < chunkCount; ++c)
+        chunkStart[c] = std::max(chunkStart[c - 1], UNextLine(text + file.size * c / chunkCount - 1, textEnd));
+
+    // Pass 1: count statements per chunk, then prefix sums give each chunk its output offsets
+    std::vector<ObjChunkCounts> counts(chunkCount);
+    UParallelFor(chunkCount, [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t c = begin; c < end; ++c)
+            UCountObjChunk(chunkStart[c], chunkStart[c + 1], counts[c]);
+    });
+
+    std::vector<ObjChunkCounts> offsets(chunkCount + 1);
+    for (unsigned c = 0; c < chunkCount; ++c)
+    {
+        offsets[c + 1].positions = offsets[c].positions + counts[c].positions;
+        offsets[c + 1].uvs = offsets[c].uvs + counts[c].uvs;
+        offsets[c + 1].normals = offsets[c].normals + counts[c].normals;
+        offsets[c + 1].triangles = offsets[c].triangles + counts[c].triangles;
+    }
+
+    const ObjChunkCounts& total = offsets[chunkCount];
+    if (total.triangles == 0 || total.positions == 0)
+    {
+        std::cerr << "No triangles found in " << path << std::endl;
+        UUnmapFile(file);
+        return false;
+    }
+
+    std::vector<float> positions(total.positions * 3);
+    std::vector<float> uvs(total.uvs * 2);
+    std::vector<float> normals(total.normals * 3);
+    std::vector<int32_t> corners(total.triangles * 9); // (position, uv, normal) for each triangle corner
+
+    // Pass 2: parse every chunk in place into its slice of the shared arrays
+    UParallelFor(chunkCount, [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t c = begin; c < end; ++c)
+        {
+            ObjChunkCounts cursor = offsets[c];
+            const char* p = chunkStart[c];
+            const char* chunkEnd = chunkStart[c + 1];
+
+            while (p < chunkEnd)
+            {
+                p = USkipBlanks(p, chunkEnd);
+                const char* lineEnd = UNextLine(p, chunkEnd);
+
+                if (chunkEnd - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+                    UParseObjFloats(p + 2, lineEnd, &positions[3 * cursor.positions++], 3);
+                else if (chunkEnd - p > 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+                    UParseObjFloats(p + 3, lineEnd, &uvs[2 * cursor.uvs++], 2);
+                else if (chunkEnd - p > 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+                    UParseObjFloats(p + 3, lineEnd, &normals[3 * cursor.normals++], 3);
+                else if (chunkEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+                {
+                    const int64_t declared[3] = { cursor.positions, cursor.uvs, cursor.normals };
+                    int32_t first[3], previous[3], current[3];
+                    int cornerIndex = 0;
+                    const char* q = p + 1;
+                    while (true)
+                    {
+                        q = USkipBlanks(q, lineEnd);
+                        if (q >= lineEnd || *q == '\r' || *q == '\n')
+                            break;
+                        q = UParseObjCorner(q, lineEnd, declared, current);
+
+                        // Fan triangulation: (first, previous, current)
+                        if (cornerIndex == 0)
+                            memcpy(first, current, sizeof(first));
+                        else if (cornerIndex >= 2)
+                        {
+                            int32_t* out = &corners[9 * cursor.triangles++];
+                            memcpy(out, first, sizeof(first));
+                            memcpy(out + 3, previous, sizeof(previous));
+                            memcpy(out + 6, current, sizeof(current));
+                        }
+                        memcpy(previous, current, sizeof(previous));
+                        ++cornerIndex;
+                    }
+                }
+
+                p = lineEnd;
+            }
+        }
+    });
+
+    UUnmapFile(file);
+
+    // Validate indices once, so the welding pass can trust them
+    const int32_t limits[3] = { (int32_t)total.positions, (int32_t)total.uvs, (int32_t)total.normals };
+    for (size_t i = 0; i < corners.size(); ++i)
+    {
+        int32_t value = corners[i];
+        if (value >= limits[i % 3] || (value < 0 && (i % 3 == 0 || value != -1)))
+        {
+            std::cerr << "Invalid face index in " << path << std::endl;
+            return false;
+        }
+    }
+
+    // Corners without a normal get the flat normal of their triangle, so they must not be shared across triangles
+    const size_t cornerCount = corners.size() / 3;
+    for (size_t c = 0; c < cornerCount; ++c)
+        if (corners[c * 3 + 2] < 0)
+            corners[c * 3 + 2] = -2 - (int32_t)(c / 3);
+
+    // Weld identical (position, uv, normal) corners. Each worker owns one hash partition of the keys,
+    // so the tables need no locking; partition bases are then prefix-summed into global vertex ids
+    auto cornerHash = [&corners](size_t c) -> uint64_t
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (int k = 0; k < 3; ++k)
+            hash = (hash ^ (uint32_t)corners[c * 3 + k]) * 1099511628211ull;
+        return hash;
+    };
+
+    const unsigned partitions = UWorkerCount();
+    std::vector<GLuint> cornerVertex(cornerCount);
+    std::vector<std::vector<size_t>> partitionFirstCorner(partitions); // Corner that introduced each unique vertex
+
+    UParallelFor(partitions, [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t part = begin; part < end; ++part)
+        {
+            size_t tableSize = 1;
+            while (tableSize < 2 * cornerCount / partitions + 16)
+                tableSize <<= 1;
+            std::vector<GLuint> table(tableSize, ~0u);
+            std::vector<size_t>& uniques = partitionFirstCorner[part];
+
+            for (size_t c = 0; c < cornerCount; ++c)
+            {
+                uint64_t hash = cornerHash(c);
+                if ((hash >> 32) % partitions != part)
+                    continue;
+
+                size_t slot = hash & (tableSize - 1);
+                while (true)
+                {
+                    GLuint existing = table[slot];
+                    if (existing == ~0u)
+                    {
+                        table[slot] = (GLuint)uniques.size();
+                        cornerVertex[c] = (GLuint)uniques.size();
+                        uniques.push_back(c);
+                        break;
+                    }
+                    if (memcmp(&corners[uniques[existing] * 3], &corners[c * 3], 3 * sizeof(int32_t)) == 0)
+                    {
+                        cornerVertex[c] = existing;
+                        break;
+                    }
+                    slot = (slot + 1) & (tableSize - 1);
+                }
+
+                // Grow before the table gets more than half full
+                if (uniques.size() * 2 > tableSize)
+                {
+                    tableSize <<= 1;
+                    table.assign(tableSize, ~0u);
+                    for (GLuint u = 0; u < uniques.size(); ++u)
+                    {
+                        size_t s = cornerHash(uniques[u]) & (tableSize - 1);
+                        while (table[s] != ~0u)
+                            s = (s + 1) & (tableSize - 1);
+                        table[s] = u;
+                    }
+                }
+            }
+        }
+    });
+
+    std::vector<GLuint> partitionBase(partitions + 1, 0);
+    for (unsigned part = 0; part < partitions; ++part)
+        partitionBase[part + 1] = partitionBase[part] + (GLuint)partitionFirstCorner[part].size();
+
+    meshData.vertices.resize((size_t)partitionBase[partitions] * FLOATS_PER_VERTEX);
+    meshData.indices.resize(cornerCount);
+
+    // Assemble the interleaved vertices of every partition, then translate corners to global indices
+    UParallelFor(partitions, [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t part = begin; part < end; ++part)
+        {
+            const std::vector<size_t>& uniques = partitionFirstCorner[part];
+            for (size_t u = 0; u < uniques.size(); ++u)
+            {
+                const int32_t* corner = &corners[uniques[u] * 3];
+                GLfloat* vertex = &meshData.vertices[(partitionBase[part] + u) * FLOATS_PER_VERTEX];
+
+                memcpy(vertex, &positions[corner[0] * 3], 3 * sizeof(float));
+
+                if (corner[2] >= 0)
+                    memcpy(vertex + 3, &normals[corner[2] * 3], 3 * sizeof(float));
+                else
+                {
+                    const int32_t* triangle = &corners[(size_t)(-2 - corner[2]) * 9];
+                    glm::vec3 a(positions[triangle[0] * 3], positions[triangle[0] * 3 + 1], positions[triangle[0] * 3 + 2]);
+                    glm::vec3 b(positions[triangle[3] * 3], positions[triangle[3] * 3 + 1], positions[triangle[3] * 3 + 2]);
+                    glm::vec3 c(positions[triangle[6] * 3], positions[triangle[6] * 3 + 1], positions[triangle[6] * 3 + 2]);
+                    glm::vec3 normal = glm::cross(b - a, c - a);
+                    float length = glm::length(normal);
+                    normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+                    vertex[3] = normal.x;
+                    vertex[4] = normal.y;
+                    vertex[5] = normal.z;
+                }
+
+                if (corner[1] >= 0)
+                    memcpy(vertex + 6, &uvs[corner[1] * 2], 2 * sizeof(float));
+                else
+                    vertex[6] = vertex[7] = 0.0f;
+            }
+        }
+    });
+
+    UParallelFor(cornerCount, [&](size_t begin, size_t end, unsigned)
+    {
+        for (size_t c = begin; c < end; ++c)
+            meshData.indices[c] = partitionBase[(cornerHash(c) >> 32) % partitions] + cornerVertex[c];
+    });
+
+    UOptimizeMesh(meshData, cornerCount, path);
+    return true;
+}
+
+
+// Returns the member of a JSON object, or nullptr
+const JsonValue* UJsonFind(const JsonValue& object, const char* key)
+{
+    for (const auto& member : object.object)
+        if (member.first == key)
+            return &member.second;
+    return nullptr;
+}
+
+
+// Returns a numeric member of a JSON object, or the fallback when it is missing
+double UJsonNumber(const JsonValue& object, const char* key, double fallback)
+{
+    const JsonValue* value = UJsonFind(object, key);
+    return value && value->type == JsonValue::Number ? value->number : fallback;
+}
+
+
+// Minimal recursive-descent JSON parser, enough for glTF documents
+bool UParseJson(const char*& p, const char* end, JsonValue& value)
+{
+    while (p < end && isspace((unsigned char)*p))
+        ++p;
+    if (p >= end)
+        return false;
+
+    if (*p == '{')
+    {
+        value.type = JsonValue::Object;
+        ++p;
+        while (true)
+        {
+            while (p < end && isspace((unsigned char)*p))
+                ++p;
+            if (p < end && *p == '}')
+            {
+                ++p;
+                return true;
+            }
+
+            JsonValue key;
+            if (!UParseJson(p, end, key) || key.type != JsonValue::String)
+                return false;
+            while (p < end && isspace((unsigned char)*p))
+                ++p;
+            if (p >= end || *p++ != ':')
+                return false;
+
+            value.object.emplace_back(key.string, JsonValue());
+            if (!UParseJson(p, end, value.object.back().second))
+                return false;
+
+            while (p < end && isspace((unsigned char)*p))
+                ++p;
+            if (p < end && *p == ',')
+                ++p;
+        }
+    }
+
+    if (*p == '[')
+    {
+        value.type = JsonValue::Array;
+        ++p;
+        while (true)
+        {
+            while (p < end && isspace((unsigned char)*p))
+                ++p;
+            if (p < end && *p == ']')
+            {
+                ++p;
+                return true;
+            }
+
+            value.array.emplace_back();
+            if (!UParseJson(p, end, value.array.back()))
+                return false;
+
+            while (p < end && isspace((unsigned char)*p))
+                ++p;
+            if (p < end && *p == ',')
+                ++p;
+        }
+    }
+
+    if (*p == '"')
+    {
+        value.type = JsonValue::String;
+        ++p;
+        while (p < end && *p != '"')
+        {
+            if (*p == '\\' && p + 1 < end)
+            {
+                ++p;
+                switch (*p)
+                {
+                    case 'n': value.string += '\n'; break;
+                    case 't': value.string += '\t'; break;
+                    case 'r': value.string += '\r'; break;
+                    case 'b': value.string += '\b'; break;
+                    case 'f': value.string += '\f'; break;
+                    case 'u':
+                    {
+                        // Basic multilingual plane only, encoded back to UTF-8
+                        unsigned code = 0;
+                        if (end - p < 5)
+                            return false;
+                        std::from_chars(p + 1, p + 5, code, 16);
+                        p += 4;
+                        if (code < 0x80)
+                            value.string += (char)code;
+                        else if (code < 0x800)
+                        {
+                            value.string += (char)(0xC0 | (code >> 6));
+                            value.string += (char)(0x80 | (code & 0x3F));
+                        }
+                        else
+                        {
+                            value.string += (char)(0xE0 | (code >> 12));
+                            value.string += (char)(0x80 | ((code >> 6) & 0x3F));
+                            value.string += (char)(0x80 | (code & 0x3F));
+                        }
+                    }
+                    break;
+                    default: value.string += *p; break; // \" \\ \/
+                }
+                ++p;
+            }
+            else
+                value.string += *p++;
+        }
+        if (p >= end)
+            return false;
+        ++p;
+        return true;
+    }
+
+    if (strncmp(p, "true", std::min<size_t>(4, end - p)) == 0 && end - p >= 4)
+    {
+        value.type = JsonValue::Bool;
+        value.boolean = true;
+        p += 4;
+        return true;
+    }
+    if (strncmp(p, "false", std::min<size_t>(5, end - p)) == 0 && end - p >= 5)
+    {
+        value.type = JsonValue::Bool;
+        value.boolean = false;
+        p += 5;
+        return true;
+    }
+    if (strncmp(p, "null", std::min<size_t>(4, end - p)) == 0 && end - p >= 4)
+    {
+        value.type = JsonValue::Null;
+        p += 4;
+        return true;
+    }
+
+    value.type = JsonValue::Number;
+    auto result = std::from_chars(p, end, value.number);
+    if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+
+// Decodes the payload of a base64 "data:" URI
+bool UDecodeBase64(const std::string& text, std::vector<unsigned char>& out)
+{
+    auto decode = [](char c) -> int
+    {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '+' || c == '-') return 62;
+        if (c == '/' || c == '_') return 63;
+        return -1;
+    };
+
+    unsigned accumulator = 0;
+    int bits = 0;
+    for (char c : text)
+    {
+        if (c == '=')
+            break;
+        int value = decode(c);
+        if (value < 0)
+            return false;
+        accumulator = (accumulator << 6) | (unsigned)value;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back((unsigned char)(accumulator >> bits));
+        }
+    }
+    return true;
+}
+
+
+// Resolves a glTF accessor to a strided view into one of the loaded buffers
+bool UGltfAccessor(const JsonValue& root, const std::vector<GltfBuffer>& buffers, int accessorIndex, GltfAccessorView& view)
+{
+    const JsonValue* accessors = UJsonFind(root, "accessors");
+    const JsonValue* bufferViews = UJsonFind(root, "bufferViews");
+    if (!accessors || accessorIndex < 0 || accessorIndex >= (int)accessors->array.size() || !bufferViews)
+        return false;
+
+    const JsonValue& accessor = accessors->array[accessorIndex];
+    if (UJsonFind(accessor, "sparse"))
+        std::cout << "WARNING: sparse glTF accessors are not supported, using base values" << std::endl;
+
+    int bufferViewIndex = (int)UJsonNumber(accessor, "bufferView", -1);
+    if (bufferViewIndex < 0 || bufferViewIndex >= (int)bufferViews->array.size())
+        return false;
+    const JsonValue& bufferView = bufferViews->array[bufferViewIndex];
+
+    int bufferIndex = (int)UJsonNumber(bufferView, "buffer", -1);
+    if (bufferIndex < 0 || bufferIndex >= (int)buffers.size())
+        return false;
+
+    const JsonValue* type = UJsonFind(accessor, "type");
+    std::string typeName = type ? type->string : "SCALAR";
+    view.components = typeName == "VEC2" ? 2 : typeName == "VEC3" ? 3 : typeName == "VEC4" ? 4 : 1;
+    view.componentType = (int)UJsonNumber(accessor, "componentType", 5126);
+    const JsonValue* normalized = UJsonFind(accessor, "normalized");
+    view.normalized = normalized && normalized->type == JsonValue::Bool && normalized->boolean;
+    view.count = (size_t)UJsonNumber(accessor, "count", 0);
+
+    size_t componentSize = (view.componentType == 5120 || view.componentType == 5121) ? 1
+                         : (view.componentType == 5122 || view.componentType == 5123) ? 2 : 4;
+    view.stride = (size_t)UJsonNumber(bufferView, "byteStride", 0);
+    if (view.stride == 0)
+        view.stride = componentSize * view.components;
+
+    size_t offset = (size_t)UJsonNumber(bufferView, "byteOffset", 0) + (size_t)UJsonNumber(accessor, "byteOffset", 0);
+    size_t needed = view.count ? offset + view.stride * (view.count - 1) + componentSize * view.components : offset;
+    if (needed > buffers[bufferIndex].size)
+        return false;
+
+    view.data = buffers[bufferIndex].data + offset;
+    return true;
+}
+
+
+// Reads one component of an accessor element as a float, applying glTF normalization rules
+float UGltfComponent(const GltfAccessorView& view, size_t element, int component)
+{
+    const unsigned char* p = view.data + element * view.stride;
+    switch (view.componentType)
+    {
+        case 5126: { float v; memcpy(&v, p + component * 4, 4); return v; }
+        case 5121: { float v = p[component]; return view.normalized ? v / 255.0f : v; }
+        case 5120: { float v = (float)(int8_t)p[component]; return view.normalized ? std::max(v / 127.0f, -1.0f) : v; }
+        case 5123: { uint16_t v; memcpy(&v, p + component * 2, 2); return view.normalized ? v / 65535.0f : v; }
+        case 5122: { int16_t v; memcpy(&v, p + component * 2, 2); return view.normalized ? std::max(v / 32767.0f, -1.0f) : v; }
+        case 5125: { uint32_t v; memcpy(&v, p + component * 4, 4); return (float)v; }
+    }
+    return 0.0f;
+}
+
+
+// Reads an index accessor element
+GLuint UGltfIndex(const GltfAccessorView& view, size_t element)
+{
+    const unsigned char* p = view.data + element * view.stride;
+    if (view.componentType == 5121)
+        return p[0];
+    if (view.componentType == 5123)
+    {
+        uint16_t v;
+        memcpy(&v, p, 2);
+        return v;
+    }
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+// Local transform of a glTF node, from either "matrix" or translation/rotation/scale
+glm::mat4 UGltfNodeTransform(const JsonValue& node)
+{
+    glm::mat4 local(1.0f);
+    const JsonValue* matrix = UJsonFind(node, "matrix");
+    if (matrix && matrix->array.size() == 16)
+    {
+        for (int i = 0; i < 16; ++i)
+            local[i / 4][i % 4] = (float)matrix->array[i].number;
+        return local;
+    }
+
+    glm::vec3 translation(0.0f);
+    glm::vec3 scale(1.0f);
+    float q[4] = { 0.0f, 0.0f, 0.0f, 1.0f }; // x, y, z, w
+    if (const JsonValue* t = UJsonFind(node, "translation"))
+        for (int i = 0; i < 3 && i < (int)t->array.size(); ++i)
+            translation[i] = (float)t->array[i].number;
+    if (const JsonValue* s = UJsonFind(node, "scale"))
+        for (int i = 0; i < 3 && i < (int)s->array.size(); ++i)
+            scale[i] = (float)s->array[i].number;
+    if (const JsonValue* r = UJsonFind(node, "rotation"))
+        for (int i = 0; i < 4 && i < (int)r->array.size(); ++i)
+            q[i] = (float)r->array[i].number;
+
+    const float x = q[0], y = q[1], z = q[2], w = q[3];
+    glm::mat4 rotation(1.0f);
+    rotation[0] = glm::vec4(1 - 2 * (y * y + z * z), 2 * (x * y + w * z), 2 * (x * z - w * y), 0.0f);
+    rotation[1] = glm::vec4(2 * (x * y - w * z), 1 - 2 * (x * x + z * z), 2 * (y * z + w * x), 0.0f);
+    rotation[2] = glm::vec4(2 * (x * z + w * y), 2 * (y * z - w * x), 1 - 2 * (x * x + y * y), 0.0f);
+
+    return glm::translate(translation) * rotation * glm::scale(scale);
+}
+
+
+// Appends every primitive of a glTF mesh, transformed to world space, converting vertices in parallel.
+// Only indexed or unindexed triangle lists are accepted
+bool UAppendGltfMesh(const JsonValue& root, const std::vector<GltfBuffer>& buffers, const JsonValue& mesh,
+                            const glm::mat4& world, MeshData& meshData)
+{
+    const JsonValue* primitives = UJsonFind(mesh, "primitives");
+    if (!primitives)
+        return true;
+
+    const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(world)));
+
+    for (const JsonValue& primitive : primitives->array)
+    {
+        int mode = (int)UJsonNumber(primitive, "mode", 4);
+        if (mode != 4)
+        {
+            std::cerr << "glTF primitive has mode " << mode << "; only TRIANGLES (4) is supported" << std::endl;
+            return false;
+        }
+
+        const JsonValue* attributes = UJsonFind(primitive, "attributes");
+        GltfAccessorView positions, normals, uvs, indices;
+        if (!attributes || !UGltfAccessor(root, buffers, (int)UJsonNumber(*attributes, "POSITION", -1), positions))
+        {
+            std::cerr << "glTF primitive without a readable POSITION accessor" << std::endl;
+            return false;
+        }
+        bool hasNormals = UGltfAccessor(root, buffers, (int)UJsonNumber(*attributes, "NORMAL", -1), normals)
+                          && normals.count == positions.count;
+        bool hasUVs = UGltfAccessor(root, buffers, (int)UJsonNumber(*attributes, "TEXCOORD_0", -1), uvs)
+                      && uvs.count == positions.count;
+
+        // A primitive that names an index accessor must be able to read it, never fall back to unindexed
+        bool hasIndices = UJsonFind(primitive, "indices") != nullptr;
+        if (hasIndices && !UGltfAccessor(root, buffers, (int)UJsonNumber(primitive, "indices", -1), indices))
+        {
+            std::cerr << "glTF primitive with an unreadable indices accessor" << std::endl;
+            return false;
+        }
+
+        const size_t baseVertex = meshData.vertices.size() / FLOATS_PER_VERTEX;
+        const size_t baseIndex = meshData.indices.size();
+        const size_t indexCount = hasIndices ? indices.count : positions.count;
+        if (indexCount % 3 != 0)
+        {
+            std::cerr << "glTF primitive has " << indexCount << " indices, which is not a whole number of triangles" << std::endl;
+            return false;
+        }
+
+        meshData.vertices.resize((baseVertex + positions.count) * FLOATS_PER_VERTEX);
+        meshData.indices.resize(baseIndex + indexCount);
+
+        UParallelFor(positions.count, [&](size_t begin, size_t end, unsigned)
+        {
+            for (size_t v = begin; v < end; ++v)
+            {
+                GLfloat* vertex = &meshData.vertices[(baseVertex + v) * FLOATS_PER_VERTEX];
+                glm::vec4 position(UGltfComponent(positions, v, 0), UGltfComponent(positions, v, 1), UGltfComponent(positions, v, 2), 1.0f);
+                position = world * position;
+                vertex[0] = position.x;
+                vertex[1] = position.y;
+                vertex[2] = position.z;
+
+                glm::vec3 normal(0.0f, 1.0f, 0.0f);
+                if (hasNormals)
+                {
+                    normal = normalMatrix * glm::vec3(UGltfComponent(normals, v, 0), UGltfComponent(normals, v, 1), UGltfComponent(normals, v, 2));
+                    float length = glm::length(normal);
+                    normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+                }
+                vertex[3] = normal.x;
+                vertex[4] = normal.y;
+                vertex[5] = normal.z;
+
+                // glTF puts the UV origin at the top left, OpenGL at the bottom left
+                vertex[6] = hasUVs ? UGltfComponent(uvs, v, 0) : 0.0f;
+                vertex[7] = hasUVs ? 1.0f - UGltfComponent(uvs, v, 1) : 0.0f;
+            }
+        });
+
+        std::atomic<bool> indicesValid(true);
+        UParallelFor(indexCount, [&](size_t begin, size_t end, unsigned)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                GLuint index = hasIndices ? UGltfIndex(indices, i) : (GLuint)i;
+                if (index >= positions.count)
+                {
+                    indicesValid = false;
+                    index = 0;
+                }
+                meshData.indices[baseIndex + i] = (GLuint)baseVertex + index;
+            }
+        });
+
+        if (!indicesValid)
+        {
+            std::cerr << "glTF primitive has out of range indices" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Walks a glTF node tree, accumulating transforms and appending every referenced mesh
+bool UAppendGltfNode(const JsonValue& root, const std::vector<GltfBuffer>& buffers, int nodeIndex,
+                            const glm::mat4& parent, MeshData& meshData, int depth)
+{
+    const JsonValue* nodes = UJsonFind(root, "nodes");
+    if (!nodes || nodeIndex < 0 || nodeIndex >= (int)nodes->array.size() || depth > 64)
+        return false;
+
+    const JsonValue& node = nodes->array[nodeIndex];
+    glm::mat4 world = parent * UGltfNodeTransform(node);
+
+    const JsonValue* meshes = UJsonFind(root, "meshes");
+    int meshIndex = (int)UJsonNumber(node, "mesh", -1);
+    if (meshes && meshIndex >= 0 && meshIndex < (int)meshes->array.size())
+        if (!UAppendGltfMesh(root, buffers, meshes->array[meshIndex], world, meshData))
+            return false;
+
+    if (const JsonValue* children = UJsonFind(node, "children"))
+        for (const JsonValue& child : children->array)
+            if (!UAppendGltfNode(root, buffers, (int)child.number, world, meshData, depth + 1))
+                return false;
+
+    return true;
+}
+
+
+// Loads a glTF 2.0 file (.gltf + .bin, embedded data URIs, or binary .glb) from memory mappings.
+// All meshes of the default scene are merged into one mesh in world space
+bool ULoadGltf(const char* path, MeshData& meshData)
+{
+    MappedFile file;
+    std::vector<MappedFile> externalFiles;
+    std::vector<std::vector<unsigned char>> decodedBuffers;
+    auto cleanup = [&]()
+    {
+        UUnmapFile(file);
+        for (MappedFile& external : externalFiles)
+            UUnmapFile(external);
+    };
+
+    if (!UMapFile(path, file) || file.size < 4)
+    {
+        std::cerr << "Failed to map mesh file: " << path << std::endl;
+        cleanup();
+        return false;
+    }
+
+    const char* json = (const char*)file.data;
+    const char* jsonEnd = json + file.size;
+    GltfBuffer binaryChunk = { nullptr, 0 };
+
+    // Binary container: 12-byte header, then a JSON chunk and an optional BIN chunk
+    uint32_t magic;
+    memcpy(&magic, file.data, 4);
+    if (magic == 0x46546C67u) // "glTF"
+    {
+        uint32_t header[5];
+        if (file.size < 20)
+        {
+            cleanup();
+            return false;
+        }
+        memcpy(header, file.data, sizeof(header));
+        json = (const char*)file.data + 20;
+        jsonEnd = json + std::min<size_t>(header[3], file.size - 20);
+
+        size_t binOffset = 20 + ((header[3] + 3) & ~3u);
+        if (binOffset + 8 <= file.size)
+        {
+            uint32_t chunk[2];
+            memcpy(chunk, file.data + binOffset, sizeof(chunk));
+            if (chunk[1] == 0x004E4942u) // "BIN\0"
+                binaryChunk = { file.data + binOffset + 8, std::min<size_t>(chunk[0], file.size - binOffset - 8) };
+        }
+    }
+
+    JsonValue root;
+    const char* cursor = json;
+    if (!UParseJson(cursor, jsonEnd, root) || root.type != JsonValue::Object)
+    {
+        std::cerr << "Invalid glTF JSON in " << path << std::endl;
+        cleanup();
+        return false;
+    }
+
+    // Resolve buffers: GLB chunk and external .bin files stay memory mapped; only data URIs are decoded
+    std::vector<GltfBuffer> buffers;
+    if (const JsonValue* bufferList = UJsonFind(root, "buffers"))
+    {
+        decodedBuffers.reserve(bufferList->array.size());
+        externalFiles.reserve(bufferList->array.size());
+        for (const JsonValue& buffer : bufferList->array)
+        {
+            const JsonValue* uri = UJsonFind(buffer, "uri");
+            if (!uri)
+            {
+                buffers.push_back(binaryChunk);
+                continue;
+            }
+
+            const std::string& text = uri->string;
+            if (text.compare(0, 5, "data:") == 0)
+            {
+                size_t comma = text.find(',');
+                decodedBuffers.emplace_back();
+                if (comma == std::string::npos || !UDecodeBase64(text.substr(comma + 1), decodedBuffers.back()))
+                {
+                    std::cerr << "Invalid data URI in " << path << std::endl;
+                    cleanup();
+                    return false;
+                }
+                buffers.push_back({ decodedBuffers.back().data(), decodedBuffers.back().size() });
+                continue;
+            }
+
+            externalFiles.emplace_back();
+            std::string bufferPath = (fs::path(path).parent_path() / text).string();
+            if (!UMapFile(bufferPath.c_str(), externalFiles.back()))
+            {
+                std::cerr << "Failed to map glTF buffer: " << bufferPath << std::endl;
+                cleanup();
+                return false;
+            }
+            buffers.push_back({ externalFiles.back().data, externalFiles.back().size });
+        }
+    }
+
+    meshData.vertices.clear();
+    meshData.indices.clear();
+
+    // Default scene's root nodes; files without scenes get every mesh untransformed
+    bool ok = true;
+    const JsonValue* scenes = UJsonFind(root, "scenes");
+    if (scenes && !scenes->array.empty())
+    {
+        int sceneIndex = (int)UJsonNumber(root, "scene", 0);
+        if (sceneIndex < 0 || sceneIndex >= (int)scenes->array.size())
+            sceneIndex = 0;
+        if (const JsonValue* sceneNodes = UJsonFind(scenes->array[sceneIndex], "nodes"))
+            for (const JsonValue& node : sceneNodes->array)
+                ok = ok && UAppendGltfNode(root, buffers, (int)node.number, glm::mat4(1.0f), meshData, 0);
+    }
+    else if (const JsonValue* meshes = UJsonFind(root, "meshes"))
+    {
+        for (const JsonValue& mesh : meshes->array)
+            ok = ok && UAppendGltfMesh(root, buffers, mesh, glm::mat4(1.0f), meshData);
+    }
+
+    cleanup();
+
+    if (!ok || meshData.indices.empty())
+    {
+        std::cerr << "No triangles loaded from " << path << std::endl;
+        return false;
+    }
+
+    UOptimizeMesh(meshData, meshData.indices.size(), path);
+    return true;
+}
+
+
+// Starts the decode threads and creates the placeholder bound while textures stream in
+void UCreateTextureLoader()
+{
+    // Mid grey, so untextured surfaces still show their lighting
+    const unsigned char grey[2 * 2 * 4] = {
+        128, 128, 128, 255,  128, 128, 128, 255,
+        128, 128, 128, 255,  128, 128, 128, 255
+    };
+    UCreateTextureFromPixels(grey, 2, 2, 4, "placeholder", gTextureLoader.placeholder);
+
+    // Leave one core to the GL thread
+    unsigned threadCount = std::max(1u, UWorkerCount() - 1);
+    for (unsigned t = 0; t < threadCount; ++t)
+        gTextureLoader.threads.emplace_back(UDecodeTextures);
+}
+
+
+// Worker loop: decodes queued image files and hands the pixels back to the GL thread
+void UDecodeTextures()
+{
+    // Flip image vertically (optional, depending on your UV orientation)
+    stbi_set_flip_vertically_on_load_thread(1);
+
+    while (true)
+    {
+        AsyncTexture* texture;
+        {
+            std::unique_lock<std::mutex> lock(gTextureLoader.mutex);
+            gTextureLoader.wake.wait(lock, [] { return gTextureLoader.stopping || !gTextureLoader.decodeQueue.empty(); });
+            if (gTextureLoader.stopping)
+                return;
+            texture = gTextureLoader.decodeQueue.front();
+            gTextureLoader.decodeQueue.pop_front();
+        }
+
+        ProfileMark decodeMark = UProfileBegin("decode texture", false);
+
+        // Block-compressed containers are only mapped and indexed; the GL thread copies the levels out
+        std::string extension = fs::path(texture->path).extension().string();
+        for (char& c : extension)
+            c = (char)tolower((unsigned char)c);
+
+        if (extension == ".ktx2" || extension == ".dds")
+        {
+            if (!UMapFile(texture->path.c_str(), texture->file) || texture->file.size == 0)
+                texture->error = "can't open file";
+            else
+                UParseCompressedTexture(*texture);
+            if (!texture->error.empty())
+                UUnmapFile(texture->file);
+        }
+        else if (!(texture->pixels = stbi_load(texture->path.c_str(), &texture->width, &texture->height, &texture->channels, 0)))
+            texture->error = stbi_failure_reason();
+        else if (texture->channels != 3 && texture->channels != 4)
+        {
+            texture->error = "unsupported format (" + std::to_string(texture->channels) + " channels)";
+            stbi_image_free(texture->pixels);
+            texture->pixels = nullptr;
+        }
+        UProfileEnd(decodeMark);
+
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.decoded.push_back(texture);
+    }
+}
+
+
+// Returns a texture name immediately and queues the file for decoding. The name can be used
+// for sampler state right away; draws should bind UResidentTexture(name) until the pixels land
+GLuint URequestTexture(const char* filename)
+{
+    std::unique_ptr<AsyncTexture> texture(new AsyncTexture);
+    texture->path = filename;
+
+    glGenTextures(1, &texture->texture);
+    UBindTexture(0, texture->texture);
+    UApplyTextureParameters();
+    UBindTexture(0, 0);
+
+    GLuint name = texture->texture;
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.decodeQueue.push_back(texture.get());
+        gTextureLoader.pending[name] = std::move(texture);
+    }
+    gTextureLoader.wake.notify_one();
+    return name;
+}
+
+
+// The texture to bind for a draw: the placeholder until the requested texture is complete
+GLuint UResidentTexture(GLuint textureId)
+{
+    if (gTextureLoader.pending.empty())
+        return textureId;
+    return gTextureLoader.pending.count(textureId) ? gTextureLoader.placeholder : textureId;
+}
+
+
+// Called once per frame on the GL thread. Retires uploads whose fence has signaled, then starts
+// uploads for decoded images until budgetBytes have been streamed (at least one per call)
+void UPumpTextureUploads(size_t budgetBytes)
+{
+    // Retire finished uploads without ever waiting on the GPU
+    for (size_t i = 0; i < gTextureLoader.uploading.size();)
+    {
+        AsyncTexture* texture = gTextureLoader.uploading[i];
+        GLenum status = glClientWaitSync(texture->fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        {
+            ++i;
+            continue;
+        }
+
+        glDeleteSync(texture->fence);
+        UDeleteBuffers(1, &texture->pbo);
+        gTextureLoader.uploading[i] = gTextureLoader.uploading.back();
+        gTextureLoader.uploading.pop_back();
+        gTextureLoader.pending.erase(texture->texture); // Frees the record; draws now get the real texture
+    }
+
+    size_t uploadedBytes = 0;
+    while (uploadedBytes == 0 || uploadedBytes < budgetBytes)
+    {
+        AsyncTexture* texture;
+        {
+            std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+            if (gTextureLoader.decoded.empty())
+                return;
+            texture = gTextureLoader.decoded.front();
+            gTextureLoader.decoded.pop_front();
+        }
+
+        if (texture->compressedFormat && texture->error.empty() && !UCompressedFormatSupported(texture->compressedFormat))
+        {
+            texture->error = "compressed format not supported by this driver";
+            UUnmapFile(texture->file);
+        }
+
+        // Failed files keep showing the placeholder forever
+        if (!texture->error.empty())
+        {
+            std::cerr << "Failed to load texture: " << texture->path << std::endl;
+            std::cerr << "Reason: " << texture->error << std::endl;
+            ++gTextureLoader.failedCount;
+            continue;
+        }
+
+        if (texture->compressedFormat)
+        {
+            uploadedBytes += UStageCompressedTexture(*texture);
+            gTextureLoader.uploading.push_back(texture);
+            continue;
+        }
+
+        size_t size = (size_t)texture->width * texture->height * texture->channels;
+
+        // Stage the pixels in a pixel-unpack buffer, so glTexSubImage2D returns without waiting for the copy.
+        // If the buffer cannot be mapped, upload straight from client memory instead
+        glGenBuffers(1, &texture->pbo);
+        UBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture->pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        void* staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        const void* source = 0;
+        if (staging)
+        {
+            memcpy(staging, texture->pixels, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        else
+        {
+            UBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            UDeleteBuffers(1, &texture->pbo);
+            texture->pbo = 0;
+            source = texture->pixels;
+        }
+
+        // Immutable storage for the whole mip chain, then level 0 from the buffer
+        GLsizei levels = 1;
+        while ((std::max(texture->width, texture->height) >> levels) > 0)
+            ++levels;
+        bool rgb = texture->channels == 3;
+
+        UBindTexture(0, texture->texture);
+        glTexStorage2D(GL_TEXTURE_2D, levels, rgb ? GL_RGB8 : GL_RGBA8, texture->width, texture->height);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture->width, texture->height, rgb ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, source);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        UBindTexture(0, 0);
+        UBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        stbi_image_free(texture->pixels);
+        texture->pixels = nullptr;
+
+        texture->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        gTextureLoader.uploading.push_back(texture);
+        uploadedBytes += size;
+    }
+}
+
+
+// Uploads every precomputed level of a compressed texture through one pixel-unpack buffer, or
+// straight from the mapped file if that buffer cannot be mapped. No mipmaps are generated; returns the bytes staged
+size_t UStageCompressedTexture(AsyncTexture& texture)
+{
+    size_t size = 0;
+    for (const CompressedLevel& mip : texture.levels)
+        size += mip.size;
+
+    glGenBuffers(1, &texture.pbo);
+    UBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture.pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    unsigned char* staging = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    std::vector<const unsigned char*> sources;
+    if (staging)
+    {
+        size_t offset = 0;
+        for (const CompressedLevel& mip : texture.levels)
+        {
+            memcpy(staging + offset, texture.file.data + mip.offset, mip.size);
+            sources.push_back((const unsigned char*)offset);
+            offset += mip.size;
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    else
+    {
+        UBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        UDeleteBuffers(1, &texture.pbo);
+        texture.pbo = 0;
+        for (const CompressedLevel& mip : texture.levels)
+            sources.push_back(texture.file.data + mip.offset);
+    }
+
+    UBindTexture(0, texture.texture);
+    glTexStorage2D(GL_TEXTURE_2D, (GLsizei)texture.levels.size(), texture.compressedFormat, texture.width, texture.height);
+    for (size_t level = 0; level < texture.levels.size(); ++level)
+    {
+        const CompressedLevel& mip = texture.levels[level];
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, (GLint)level, 0, 0, mip.width, mip.height, texture.compressedFormat,
+                                  (GLsizei)mip.size, sources[level]);
+    }
+    UBindTexture(0, 0);
+    UBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    UUnmapFile(texture.file);
+
+    texture.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return size;
+}
+
+
+// Blocks until every requested texture is resident; used where frames must be reproducible
+void UFinishTextureLoads()
+{
+    while (gTextureLoader.pending.size() > gTextureLoader.failedCount)
+    {
+        UPumpTextureUploads(SIZE_MAX);
+        if (!gTextureLoader.uploading.empty())
+            glFinish();
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+
+// Stops the decode threads and releases everything still in flight. Texture names belong to the caller
+void UDestroyTextureLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.stopping = true;
+    }
+    gTextureLoader.wake.notify_all();
+    for (std::thread& thread : gTextureLoader.threads)
+        thread.join();
+    gTextureLoader.threads.clear();
+
+    for (AsyncTexture* texture : gTextureLoader.uploading)
+    {
+        glDeleteSync(texture->fence);
+        UDeleteBuffers(1, &texture->pbo);
+    }
+    gTextureLoader.uploading.clear();
+
+    for (auto& entry : gTextureLoader.pending)
+    {
+        if (entry.second->pixels)
+            stbi_image_free(entry.second->pixels);
+        UUnmapFile(entry.second->file);
+    }
+    gTextureLoader.pending.clear();
+    gTextureLoader.decodeQueue.clear();
+    gTextureLoader.decoded.clear();
+    gTextureLoader.failedCount = 0;
+
+    UDestroyTexture(gTextureLoader.placeholder);
+    gTextureLoader.placeholder = 0;
+}
+
+
+// Reads the mip chain of a KTX2 or DDS container into texture->levels; the data stays in texture->file
+bool UParseCompressedTexture(AsyncTexture& texture)
+{
+    const unsigned char* data = texture.file.data;
+    size_t size = texture.file.size;
+
+    static const unsigned char ktx2Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    if (size >= 80 && memcmp(data, ktx2Identifier, sizeof(ktx2Identifier)) == 0)
+        return UParseKtx2(texture);
+    if (size >= 128 && memcmp(data, "DDS ", 4) == 0)
+        return UParseDds(texture);
+
+    texture.error = "not a KTX2 or DDS file";
+    return false;
+}
+
+
+// KTX2: fixed header, then a level index of (offset, length) pairs. Only non-supercompressed 2D images
+bool UParseKtx2(AsyncTexture& texture)
+{
+    const unsigned char* data = texture.file.data;
+    uint32_t header[9]; // vkFormat, typeSize, width, height, depth, layerCount, faceCount, levelCount, supercompression
+    memcpy(header, data + 12, sizeof(header));
+
+    texture.compressedFormat = UGlFormatFromVulkan(header[0]);
+    if (!texture.compressedFormat)
+    {
+        texture.error = "unsupported vkFormat " + std::to_string(header[0]);
+        return false;
+    }
+    if (header[4] > 1 || header[5] > 1 || header[6] != 1 || header[8] != 0)
+    {
+        texture.error = "only uncompressed, single-layer 2D KTX2 images are supported";
+        return false;
+    }
+
+    texture.width = (int)header[2];
+    texture.height = (int)header[3];
+    uint32_t levelCount = std::max(header[7], 1u);
+    if (!UCheckCompressedLevelCount(texture, levelCount))
+        return false;
+
+    // The level index follows the 80-byte header and data format index block
+    if (80 + (size_t)levelCount * 24 > texture.file.size)
+    {
+        texture.error = "truncated level index";
+        return false;
+    }
+
+    for (uint32_t level = 0; level < levelCount; ++level)
+    {
+        uint64_t entry[2]; // byteOffset, byteLength
+        memcpy(entry, data + 80 + level * 24, sizeof(entry));
+
+        CompressedLevel mip;
+        mip.offset = (size_t)entry[0];
+        mip.size = (size_t)entry[1];
+        mip.width = std::max(texture.width >> level, 1);
+        mip.height = std::max(texture.height >> level, 1);
+        texture.levels.push_back(mip);
+    }
+
+    return UValidateCompressedLevels(texture);
+}
+
+
+// DDS: legacy FourCC (DXT1, DXT5, ATI2/BC5U) or DX10 extended header, mips stored back to back
+bool UParseDds(AsyncTexture& texture)
+{
+    const unsigned char* data = texture.file.data;
+    uint32_t header[31]; // DDS_HEADER, without the "DDS " magic
+    memcpy(header, data + 4, sizeof(header));
+
+    texture.height = (int)header[2];
+    texture.width = (int)header[3];
+    uint32_t levelCount = std::max(header[6], 1u);
+    uint32_t fourCC = header[20];
+    size_t offset = 128;
+
+    auto code = [](const char* text) { return (uint32_t)text[0] | (uint32_t)text[1] << 8 | (uint32_t)text[2] << 16 | (uint32_t)text[3] << 24; };
+    if (fourCC == code("DXT1"))
+        texture.compressedFormat = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    else if (fourCC == code("DXT5"))
+        texture.compressedFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    else if (fourCC == code("ATI2") || fourCC == code("BC5U"))
+        texture.compressedFormat = GL_COMPRESSED_RG_RGTC2;
+    else if (fourCC == code("DX10"))
+    {
+        if (texture.file.size < 148)
+        {
+            texture.error = "truncated DX10 header";
+            return false;
+        }
+        uint32_t dxgiFormat;
+        memcpy(&dxgiFormat, data + 128, sizeof(dxgiFormat));
+        texture.compressedFormat = UGlFormatFromDxgi(dxgiFormat);
+        offset = 148;
+    }
+
+    if (!texture.compressedFormat)
+    {
+        texture.error = "unsupported DDS pixel format";
+        return false;
+    }
+    if (!UCheckCompressedLevelCount(texture, levelCount))
+        return false;
+
+    for (uint32_t level = 0; level < levelCount; ++level)
+    {
+        CompressedLevel mip;
+        mip.width = std::max(texture.width >> level, 1);
+        mip.height = std::max(texture.height >> level, 1);
+        mip.offset = offset;
+        mip.size = (size_t)((mip.width + 3) / 4) * ((mip.height + 3) / 4) * UCompressedBlockBytes(texture.compressedFormat);
+        texture.levels.push_back(mip);
+        offset += mip.size;
+    }
+
+    return UValidateCompressedLevels(texture);
+}
+
+
+// The image must have a size, and no more levels than its full mip chain: floor(log2(max(w, h))) + 1
+bool UCheckCompressedLevelCount(AsyncTexture& texture, uint32_t levelCount)
+{
+    if (texture.width <= 0 || texture.height <= 0)
+    {
+        texture.error = "empty image";
+        return false;
+    }
+
+    uint32_t maxLevels = 1;
+    while ((std::max(texture.width, texture.height) >> maxLevels) > 0)
+        ++maxLevels;
+    if (levelCount > maxLevels)
+    {
+        texture.error = std::to_string(levelCount) + " mip levels, but a " + std::to_string(texture.width) + "x" +
+                        std::to_string(texture.height) + " image has at most " + std::to_string(maxLevels);
+        return false;
+    }
+    return true;
+}
+
+
+// Every level must be inside the file and exactly as large as its block grid
+bool UValidateCompressedLevels(AsyncTexture& texture)
+{
+    for (const CompressedLevel& mip : texture.levels)
+    {
+        size_t expected = (size_t)((mip.width + 3) / 4) * ((mip.height + 3) / 4) * UCompressedBlockBytes(texture.compressedFormat);
+        if (mip.size != expected || mip.offset > texture.file.size || mip.size > texture.file.size - mip.offset)
+        {
+            texture.error = "mip level data is truncated or has the wrong size";
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Bytes per 4x4 block: 8 for BC1 and the RGB ETC2 formats, 16 for the rest
+GLsizei UCompressedBlockBytes(GLenum format)
+{
+    switch (format)
+    {
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGB8_ETC2:
+        case GL_COMPRESSED_SRGB8_ETC2:
+        case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+        case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+            return 8;
+        default:
+            return 16;
+    }
+}
+
+
+// Maps the VkFormat of a KTX2 file to the GL compressed format, 0 when unsupported
+GLenum UGlFormatFromVulkan(uint32_t vkFormat)
+{
+    switch (vkFormat)
+    {
+        case 131: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;            // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+        case 132: return GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;           // VK_FORMAT_BC1_RGB_SRGB_BLOCK
+        case 133: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;           // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+        case 134: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;     // VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+        case 137: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;           // VK_FORMAT_BC3_UNORM_BLOCK
+        case 138: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;     // VK_FORMAT_BC3_SRGB_BLOCK
+        case 141: return GL_COMPRESSED_RG_RGTC2;                     // VK_FORMAT_BC5_UNORM_BLOCK
+        case 142: return GL_COMPRESSED_SIGNED_RG_RGTC2;              // VK_FORMAT_BC5_SNORM_BLOCK
+        case 145: return GL_COMPRESSED_RGBA_BPTC_UNORM;              // VK_FORMAT_BC7_UNORM_BLOCK
+        case 146: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;        // VK_FORMAT_BC7_SRGB_BLOCK
+        case 147: return GL_COMPRESSED_RGB8_ETC2;                    // VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK
+        case 148: return GL_COMPRESSED_SRGB8_ETC2;                   // VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK
+        case 149: return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2; // VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK
+        case 150: return GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2; // VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK
+        case 151: return GL_COMPRESSED_RGBA8_ETC2_EAC;               // VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK
+        case 152: return GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC;        // VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK
+        default: return 0;
+    }
+}
+
+
+// Maps the DXGI_FORMAT of a DX10 DDS header to the GL compressed format, 0 when unsupported
+GLenum UGlFormatFromDxgi(uint32_t dxgiFormat)
+{
+    switch (dxgiFormat)
+    {
+        case 71: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;        // DXGI_FORMAT_BC1_UNORM
+        case 72: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;  // DXGI_FORMAT_BC1_UNORM_SRGB
+        case 77: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;        // DXGI_FORMAT_BC3_UNORM
+        case 78: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;  // DXGI_FORMAT_BC3_UNORM_SRGB
+        case 83: return GL_COMPRESSED_RG_RGTC2;                  // DXGI_FORMAT_BC5_UNORM
+        case 84: return GL_COMPRESSED_SIGNED_RG_RGTC2;           // DXGI_FORMAT_BC5_SNORM
+        case 98: return GL_COMPRESSED_RGBA_BPTC_UNORM;           // DXGI_FORMAT_BC7_UNORM
+        case 99: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;     // DXGI_FORMAT_BC7_UNORM_SRGB
+        default: return 0;
+    }
+}
+
+
+// RGTC (BC5) and BPTC (BC7) are core in 4.4; S3TC and ETC2 depend on the driver
+bool UCompressedFormatSupported(GLenum format)
+{
+    switch (format)
+    {
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+            return GLEW_EXT_texture_compression_s3tc;
+        case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+            return GLEW_EXT_texture_compression_s3tc && GLEW_EXT_texture_sRGB;
+        case GL_COMPRESSED_RGB8_ETC2:
+        case GL_COMPRESSED_SRGB8_ETC2:
+        case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+        case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+        case GL_COMPRESSED_RGBA8_ETC2_EAC:
+        case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+            return GLEW_ARB_ES3_compatibility;
+        default:
+            return true;
+    }
+}
+
+
+// Wrapping and filtering shared by every texture, applied to the bound GL_TEXTURE_2D
+void UApplyTextureParameters()
+{
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+
+/*Generate and load the texture*/
+// Creates a mipmapped texture from decoded, bottom-up pixel rows
+bool UCreateTextureFromPixels(const unsigned char* image, int width, int height, int channels, const char* name, GLuint& textureId)
+{
+    if (channels != 3 && channels != 4) {
+        std::cerr << "Unsupported image format: " << channels << " channels in " << name << std::endl;
+        return false;
+    }
+
+    glGenTextures(1, &textureId);
+    UBindTexture(0, textureId);
+
+    // Texture wrapping and filtering
+    UApplyTextureParameters();
+
+    // Handle formats; RGB rows are tightly packed, so they need byte alignment
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (channels == 3) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+    }
+    else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glGenerateMipmap(GL_TEXTURE_2D);
+    UBindTexture(0, 0);
+
+    return true;
+}
+
+
+void UDestroyTexture(GLuint textureId)
+{
+    UDeleteTextures(1, &textureId);  // Deletes the texture from GPU memory
+}
+
+// Opens a cooked pack and validates its table of contents against the file size
+bool UOpenPack(const char* path, AssetPack& pack)
+{
+    if (!UMapFile(path, pack.file) || pack.file.size < sizeof(PackHeader))
+    {
+        std::cerr << "Failed to open pack " << path << std::endl;
+        UUnmapFile(pack.file);
+        return false;
+    }
+
+    pack.header = (const PackHeader*)pack.file.data;
+    if (pack.header->magic != PACK_MAGIC || pack.header->version != PACK_VERSION)
+    {
+        std::cerr << "Not a version " << PACK_VERSION << " asset pack: " << path << std::endl;
+        UClosePack(pack);
+        return false;
+    }
+
+    size_t tocEnd = sizeof(PackHeader) + (size_t)pack.header->sectionCount * sizeof(PackSection);
+    if (tocEnd > pack.file.size)
+    {
+        std::cerr << "Truncated table of contents in " << path << std::endl;
+        UClosePack(pack);
+        return false;
+    }
+    pack.sections = (const PackSection*)(pack.file.data + sizeof(PackHeader));
+
+    // The pack is untrusted input: every section must describe data the uploads can consume as is
+    for (uint32_t i = 0; i < pack.header->sectionCount; ++i)
+    {
+        const PackSection& section = pack.sections[i];
+        const char* error = UValidatePackSection(pack, section);
+        if (error)
+        {
+            std::cerr << "Section '" << std::string(section.name, strnlen(section.name, sizeof(section.name)))
+                      << "' of " << path << " " << error << std::endl;
+            UClosePack(pack);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Why a section cannot be uploaded straight from the mapping, or nullptr when it can. Blobs must
+// lie inside the file, and their sizes must match what the GL calls will read
+const char* UValidatePackSection(const AssetPack& pack, const PackSection& section)
+{
+    const uint64_t size = pack.file.size;
+    auto inside = [size](uint64_t offset, uint64_t length) { return offset <= size && length <= size - offset; };
+    if (!inside(section.dataOffset, section.dataSize) || !inside(section.indexOffset, section.indexSize))
+        return "lies outside the file";
+
+    if (section.type == PACK_SECTION_MESH)
+    {
+        uint64_t stride;
+        if (section.vertexLayout == (uint32_t)VERTEX_LAYOUT_FLOAT)
+            stride = FLOATS_PER_VERTEX * sizeof(GLfloat);
+        else if (section.vertexLayout == (uint32_t)VERTEX_LAYOUT_COMPACT)
+            stride = sizeof(CompactVertex);
+        else
+            return "has an unknown vertex layout";
+
+        uint64_t indexSize;
+        if (section.indexType == GL_UNSIGNED_SHORT)
+            indexSize = sizeof(GLushort);
+        else if (section.indexType == GL_UNSIGNED_INT)
+            indexSize = sizeof(GLuint);
+        else
+            return "has an unknown index type";
+
+        if ((uint64_t)section.vertexCount * stride != section.dataSize || (uint64_t)section.indexCount * indexSize != section.indexSize)
+            return "has vertex or index data of the wrong size";
+        if (section.indexCount % 3 != 0)
+            return "is not a triangle list";
+
+        // Draws would otherwise fetch vertices past the end of the vertex buffer
+        const unsigned char* indices = pack.file.data + section.indexOffset;
+        for (uint32_t i = 0; i < section.indexCount; ++i)
+        {
+            uint32_t index;
+            if (indexSize == sizeof(GLushort))
+            {
+                GLushort value;
+                memcpy(&value, indices + i * indexSize, sizeof(value));
+                index = value;
+            }
+            else
+                memcpy(&index, indices + i * indexSize, sizeof(index));
+            if (index >= section.vertexCount)
+                return "has an index past its last vertex";
+        }
+    }
+    else if (section.type == PACK_SECTION_TEXTURE)
+    {
+        if ((section.channels != 3 && section.channels != 4) || section.width < 1 || section.width > 16384 ||
+            section.height < 1 || section.height > 16384)
+            return "has an unsupported image size or channel count";
+        if ((uint64_t)section.width * section.height * section.channels != section.dataSize)
+            return "has pixel data of the wrong size";
+    }
+
+    return nullptr;
+}
+
+
+void UClosePack(AssetPack& pack)
+{
+    UUnmapFile(pack.file);
+    pack.header = nullptr;
+    pack.sections = nullptr;
+}
+
+
+// Returns the section with the given name and type, or nullptr
+const PackSection* UFindPackSection(const AssetPack& pack, const char* name, uint32_t type)
+{
+    for (uint32_t i = 0; i < pack.header->sectionCount; ++i)
+    {
+        const PackSection& section = pack.sections[i];
+        if (section.type == type && strncmp(section.name, name, sizeof(section.name)) == 0)
+            return &section;
+    }
+    return nullptr;
+}
+
+
+// Uploads a mesh section straight from the mapped pack; UOpenPack has validated it
+bool UUploadPackMesh(const AssetPack& pack, const char* name, GLMesh& mesh)
+{
+    const PackSection* section = UFindPackSection(pack, name, PACK_SECTION_MESH);
+    if (!section)
+        return false;
+
+    MeshBlob blob;
+    blob.layout = (GLint)section->vertexLayout;
+    blob.positionScale = glm::make_vec3(section->positionScale);
+    blob.positionOffset = glm::make_vec3(section->positionOffset);
+    blob.nVertices = section->vertexCount;
+    blob.nIndices = section->indexCount;
+    blob.indexType = section->indexType;
+    blob.vertices = pack.file.data + section->dataOffset;
+    blob.vertexBytes = (size_t)section->dataSize;
+    blob.indices = pack.file.data + section->indexOffset;
+    blob.indexBytes = (size_t)section->indexSize;
+
+    UUploadMeshBlob(mesh, blob);
+    return true;
+}
+
+
+// Uploads a texture section straight from the mapped pack
+bool UCreatePackTexture(const AssetPack& pack, const char* name, GLuint& textureId)
+{
+    // UOpenPack has checked the image size against the pixel data
+    const PackSection* section = UFindPackSection(pack, name, PACK_SECTION_TEXTURE);
+    if (!section)
+        return false;
+
+    return UCreateTextureFromPixels(pack.file.data + section->dataOffset, (int)section->width, (int)section->height,
+                                    (int)section->channels, name, textureId);
+}
+
+
+// Pads the pack file with zeros up to the next section alignment
+uint64_t UAlignPack(FILE* file, uint64_t offset, bool& ok)
+{
+    static const unsigned char zeros[PACK_ALIGNMENT] = {};
+    uint64_t aligned = (offset + PACK_ALIGNMENT - 1) & ~(uint64_t)(PACK_ALIGNMENT - 1);
+    size_t padding = (size_t)(aligned - offset);
+    if (fwrite(zeros, 1, padding, file) != padding)
+        ok = false;
+    return aligned;
+}
+
+
+// Writes one blob at the next aligned offset and returns that offset. A short write clears ok
+uint64_t UWritePackBlob(FILE* file, uint64_t& offset, const void* data, size_t size, bool& ok)
+{
+    offset = UAlignPack(file, offset, ok);
+    uint64_t start = offset;
+    if (fwrite(data, 1, size, file) != size)
+        ok = false;
+    offset += size;
+    return start;
+}
+
+
+// Builds a pack from the source assets: the built-in cube, the --mesh model (if any) and the
+// diffuse texture, each already in the exact byte layout the GL calls consume. Needs no GL context
+bool UCookPack(const char* path)
+{
+    // Gather the sources first, so a missing source never touches the output file
+    MeshData cubeData;
+    if (!UBuildCubeMesh(cubeData))
+        return false;
+
+    MeshData modelData;
+    if (gModelPath && !ULoadMesh(gModelPath, modelData))
+        return false;
+
+    // The renderer only uploads RGB and RGBA, so grey cooks as RGB and grey+alpha as RGBA
+    stbi_set_flip_vertically_on_load(1);
+    int width, height, channels = 0;
+    stbi_info(gTextureFilename, &width, &height, &channels);
+    int expanded = channels == 1 ? 3 : channels == 2 ? 4 : 0;
+    unsigned char* image = stbi_load(gTextureFilename, &width, &height, &channels, expanded);
+    if (image && expanded)
+        channels = expanded;
+    if (!image)
+    {
+        std::cerr << "stbi_load failed to load texture: " << gTextureFilename << std::endl;
+        std::cerr << "Reason: " << stbi_failure_reason() << std::endl;
+        return false;
+    }
+    if (channels != 3 && channels != 4)
+    {
+        std::cerr << "Texture " << gTextureFilename << " has an unsupported channel count: " << channels << std::endl;
+        stbi_image_free(image);
+        return false;
+    }
+
+    // Write to a temporary file that only replaces the pack once it is complete
+    std::string tempPath = std::string(path) + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Could not create pack " << tempPath << std::endl;
+        stbi_image_free(image);
+        return false;
+    }
+
+    std::vector<PackSection> sections;
+    struct CookMesh { const char* name; const MeshData* data; };
+    std::vector<CookMesh> meshes = { { PACK_CUBE_MESH, &cubeData } };
+    if (gModelPath)
+        meshes.push_back({ PACK_MODEL_MESH, &modelData });
+    sections.resize(meshes.size() + 1);
+
+    // Reserve the header and table of contents; they are rewritten once the offsets are known
+    PackHeader header = { PACK_MAGIC, PACK_VERSION, (uint32_t)sections.size(), 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fwrite(sections.data(), sizeof(PackSection), sections.size(), file) == sections.size() && ok;
+    uint64_t offset = sizeof(header) + sections.size() * sizeof(PackSection);
+
+    for (size_t m = 0; m < meshes.size(); ++m)
+    {
+        PackedVertices packed;
+        std::vector<GLushort> shortIndices;
+        MeshBlob blob;
+        UMakeMeshBlob(*meshes[m].data, packed, shortIndices, blob);
+
+        PackSection& section = sections[m];
+        strncpy(section.name, meshes[m].name, sizeof(section.name) - 1);
+        section.type = PACK_SECTION_MESH;
+        section.vertexLayout = (uint32_t)blob.layout;
+        section.vertexCount = blob.nVertices;
+        section.indexCount = blob.nIndices;
+        section.indexType = blob.indexType;
+        memcpy(section.positionScale, glm::value_ptr(blob.positionScale), sizeof(section.positionScale));
+        memcpy(section.positionOffset, glm::value_ptr(blob.positionOffset), sizeof(section.positionOffset));
+        section.dataSize = blob.vertexBytes;
+        section.dataOffset = UWritePackBlob(file, offset, blob.vertices, blob.vertexBytes, ok);
+        section.indexSize = blob.indexBytes;
+        section.indexOffset = UWritePackBlob(file, offset, blob.indices, blob.indexBytes, ok);
+    }
+
+    PackSection& texture = sections.back();
+    strncpy(texture.name, PACK_DIFFUSE_TEXTURE, sizeof(texture.name) - 1);
+    texture.type = PACK_SECTION_TEXTURE;
+    texture.width = (uint32_t)width;
+    texture.height = (uint32_t)height;
+    texture.channels = (uint32_t)channels;
+    texture.dataSize = (uint64_t)width * height * channels;
+    texture.dataOffset = UWritePackBlob(file, offset, image, (size_t)texture.dataSize, ok);
+    stbi_image_free(image);
+
+    ok = fseek(file, (long)sizeof(header), SEEK_SET) == 0 && ok;
+    ok = fwrite(sections.data(), sizeof(PackSection), sections.size(), file) == sections.size() && ok;
+    ok = ferror(file) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+
+    // rename() does not replace an existing file everywhere, so drop the old pack first
+    if (ok)
+    {
+        remove(path);
+        ok = rename(tempPath.c_str(), path) == 0;
+    }
+    if (!ok)
+    {
+        std::cerr << "Failed to write pack " << path << std::endl;
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    cout << "INFO: Cooked " << sections.size() << " sections into " << path << " (" << offset << " bytes)" << endl;
+    return true;
+}
+
+
+// Inserts the variant defines and shared includes right after the #version line of a GLSL(...) source
+std::string UBuildShaderSource(const char* shaderSource, const std::string& defines)
+{
+    std::string source = shaderSource;
+    size_t versionEnd = source.find('\n') + 1;
+
+    std::string includes = defines;
+    includes += "#define FRAME_DATA_BINDING " + std::to_string(FRAME_DATA_BINDING) + "\n";
+    includes += "#define INSTANCE_DATA_BINDING " + std::to_string(INSTANCE_DATA_BINDING) + "\n";
+    includes += "#define VISIBLE_INSTANCE_BINDING " + std::to_string(VISIBLE_INSTANCE_BINDING) + "\n";
+    includes += "#define POINT_LIGHT_BINDING " + std::to_string(POINT_LIGHT_BINDING) + "\n";
+    includes += "#define LIGHT_CLUSTER_BINDING " + std::to_string(LIGHT_CLUSTER_BINDING) + "\n";
+    includes += "#define LIGHT_INDEX_BINDING " + std::to_string(LIGHT_INDEX_BINDING) + "\n";
+    includes += "#define CLUSTER_GRID_X " + std::to_string(CLUSTER_GRID_X) + "\n";
+    includes += "#define CLUSTER_GRID_Y " + std::to_string(CLUSTER_GRID_Y) + "\n";
+    includes += "#define CLUSTER_GRID_Z " + std::to_string(CLUSTER_GRID_Z) + "\n";
+    includes += "#define CAMERA_NEAR_PLANE " + std::to_string(CAMERA_NEAR_PLANE) + "\n";
+    includes += "#define CAMERA_FAR_PLANE " + std::to_string(CAMERA_FAR_PLANE) + "\n";
+    includes += frameDataBlockSource;
+
+    source.insert(versionEnd, includes);
+    return source;
+}
+
+// Submits a shader for compilation without waiting for the result
+GLuint CompileShader(GLenum shaderType, const char* shaderSource, const std::string& defines)
+{
+    std::string fullSource = UBuildShaderSource(shaderSource, defines);
+    const char* sourcePtr = fullSource.c_str();
+
+    GLuint shaderId = glCreateShader(shaderType);
+    glShaderSource(shaderId, 1, &sourcePtr, NULL);
+    glCompileShader(shaderId);
+    return shaderId;
+}
+
+
+// Reports the compile log of a shader; querying the status waits for its compilation
+bool UCheckShaderCompile(GLuint shaderId, const char* shaderName)
+{
+    GLint success;
+    char infoLog[512];
+    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+
+    if (!success)
+    {
+        glGetShaderInfoLog(shaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::" << shaderName << "::COMPILATION_FAILED\n" << infoLog << std::endl;
+        return false;
+    }
 
-    // --- Cube ---
-    glUseProgram(gCubeProgramId);
-    glm::mat4 cubeModel = glm::translate(gCubePosition) * glm::scale(gCubeScale);
-    SetTransformMatrices(gCubeProgramId, cubeModel, view, projection);
+    return true;
+}
 
-    // Set other cube uniforms
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "objectColor"), gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "viewPosition"), gCamera.Position.x, gCamera.Position.y, gCamera.Position.z);
-    glUniform2fv(glGetUniformLocation(gCubeProgramId, "uvScale"), 1, glm::value_ptr(gUVScale));
+// Implements the UCreateShaders function
+// Issues the cache lookup or the compile and link of a program, without querying any status
+void UBeginShaderProgram(PendingProgram& pending)
+{
+    GLuint programId = glCreateProgram();
+    pending.program->id = programId;
+    pending.start = std::chrono::steady_clock::now();
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+    // A cached binary from an earlier run skips compiling and linking entirely
+    if (gShaderCacheDir)
+    {
+        pending.cachePath = UShaderCachePath(UBuildShaderSource(pending.vertexSource, pending.defines),
+                                             UBuildShaderSource(pending.fragmentSource, pending.defines));
+        if (ULoadProgramBinary(programId, pending.cachePath))
+        {
+            pending.fromCache = true;
+            return;
+        }
+        glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        pending.start = std::chrono::steady_clock::now();
+    }
 
-    // --- Lamp ---
-    glUseProgram(gLampProgramId);
-    glm::mat4 lampModel = glm::translate(gLightPosition) * glm::scale(gLightScale);
-    SetTransformMatrices(gLampProgramId, lampModel, view, projection);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+    // Compile shaders
+    pending.vertexShader = CompileShader(GL_VERTEX_SHADER, pending.vertexSource, pending.defines);
+    pending.fragmentShader = CompileShader(GL_FRAGMENT_SHADER, pending.fragmentSource, pending.defines);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
-    glfwSwapBuffers(gWindow);
+    // Attach and link shaders; a failed compile just makes the link fail too
+    glAttachShader(programId, pending.vertexShader);
+    glAttachShader(programId, pending.fragmentShader);
+    glLinkProgram(programId);
 }
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh &mesh)
+// True once querying the program's results will not block (always true without the extension)
+bool UIsShaderProgramReady(const PendingProgram& pending)
 {
-     // Position and Color data
-    std::vector<GLfloat> verts = {
-        //Positions          //Normals
-        // ------------------------------------------------------
-        //Back Face          //Negative Z Normal  Texture Coords.
-       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-        0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-       -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    if (pending.fromCache || !(GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile))
+        return true;
 
-        //Front Face         //Positive Z Normal
-       -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-        0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-        0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-       -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-       -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+    GLint complete = GL_FALSE;
+    glGetProgramiv(pending.program->id, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete == GL_TRUE;
+}
 
-        //Left Face          //Negative X Normal
-       -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-       -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-       -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-       -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-       -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-       -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
 
-        //Right Face         //Positive X Normal
-        0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-        0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-        0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-        0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-        0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-        0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+// Checks the results of a submitted program, waiting for them if needed, then caches and reflects it
+bool UEndShaderProgram(PendingProgram& pending)
+{
+    ShaderProgram& program = *pending.program;
+    if (!pending.fromCache)
+    {
+        bool compiled = UCheckShaderCompile(pending.vertexShader, "VERTEX");
+        compiled = UCheckShaderCompile(pending.fragmentShader, "FRAGMENT") && compiled;
 
-        //Bottom Face        //Negative Y Normal
-       -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-        0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-        0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-        0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-       -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-       -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+        GLint success = GL_FALSE;
+        if (compiled)
+        {
+            char infoLog[512];
+            glGetProgramiv(program.id, GL_LINK_STATUS, &success);
+            if (!success)
+            {
+                glGetProgramInfoLog(program.id, sizeof(infoLog), NULL, infoLog);
+                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+            }
+        }
 
-        //Top Face           //Positive Y Normal
-       -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-        0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-        0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-        0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-       -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-       -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-    };
+        // Cleanup shaders once linked
+        glDeleteShader(pending.vertexShader);
+        glDeleteShader(pending.fragmentShader);
+        pending.vertexShader = pending.fragmentShader = 0;
+        if (!success)
+            return false;
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
-    const GLuint floatsPerElement = floatsPerVertex + floatsPerNormal + floatsPerUV;
+        if (gShaderCacheDir)
+        {
+            float compileMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - pending.start).count();
+            USaveProgramBinary(program.id, pending.cachePath, compileMs);
+        }
+    }
 
-    if (verts.size() % floatsPerElement != 0) {
-        std::cerr << "Error: Vertex data size is not aligned with expected layout." << std::endl;
+    UReflectShaderProgram(program);
+    return true;
+}
+
+
+// Starts compiling every program of the batch and returns immediately
+void USubmitShaderBatch(ShaderBatch& batch)
+{
+    batch.parallelExtension = GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    if (batch.parallelExtension)
+    {
+        // Let the driver use as many compiler threads as it likes. GLEW only loads the entry point
+        // of the extension that is present
+        if (GLEW_KHR_parallel_shader_compile)
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        else
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        for (PendingProgram& pending : batch.programs)
+            UBeginShaderProgram(pending);
+        return;
+    }
+
+    // No driver threads: compile the whole batch on a thread of our own
+    if (UCreateWorkerContext())
+    {
+        batch.worker = std::thread([&batch]()
+        {
+            UMakeWorkerContextCurrent(true);
+            for (PendingProgram& pending : batch.programs)
+            {
+                UBeginShaderProgram(pending);
+                batch.workerOk = UEndShaderProgram(pending) && batch.workerOk;
+            }
+
+            // Programs must be complete before the main context uses them
+            glFinish();
+            UMakeWorkerContextCurrent(false);
+            batch.workerDone = true;
+        });
         return;
     }
 
-    mesh.nVertices = static_cast<GLuint>(verts.size() / (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    // Serial fallback: submit now, the results are checked in UFinishShaderBatch
+    for (PendingProgram& pending : batch.programs)
+        UBeginShaderProgram(pending);
+}
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(GLfloat), verts.data(), GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Non-blocking: true once UFinishShaderBatch would return without waiting
+bool UIsShaderBatchReady(ShaderBatch& batch)
+{
+    if (batch.worker.joinable())
+        return batch.workerDone; // The worker only finishes as a whole
 
-    // Stride = position(3) + normal(3) + uv(2) = 8 floats per vertex. A tightly packed stride is 0.
-    GLint stride =  sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    for (const PendingProgram& pending : batch.programs)
+        if (!UIsShaderProgramReady(pending))
+            return false;
+    return true;
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Waits for the batch and reports every failed program; true when all of them linked
+bool UFinishShaderBatch(ShaderBatch& batch)
+{
+    if (batch.worker.joinable())
+    {
+        batch.worker.join();
+        UDestroyWorkerContext();
+        return batch.workerOk;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    bool ok = true;
+    for (PendingProgram& pending : batch.programs)
+        ok = UEndShaderProgram(pending) && ok;
+    return ok;
 }
 
 
-void UDestroyMesh(GLMesh &mesh)
+// Creates a context in the main context's share group, for use on one other thread
+bool UCreateWorkerContext()
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+#ifdef __linux__
+    if (gHeadless)
+    {
+        gEglWorkerContext = eglCreateContext(gEglDisplay, gEglConfig, gEglContext, EGL_CONTEXT_ATTRIBS);
+        return gEglWorkerContext != EGL_NO_CONTEXT;
+    }
+#endif
+
+    // Window hints from UInitialize still apply, so the versions match
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    gWorkerWindow = glfwCreateWindow(1, 1, "", NULL, gWindow);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    return gWorkerWindow != nullptr;
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Binds or releases the worker context on the calling thread
+void UMakeWorkerContextCurrent(bool current)
 {
-    // Check if the file exists before trying to load it
-    if (!fs::exists(filename)) {
-        std::cerr << "Texture file not found: " << filename << std::endl;
-        return false;
+#ifdef __linux__
+    if (gHeadless)
+    {
+        eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? gEglWorkerContext : EGL_NO_CONTEXT);
+        return;
     }
+#endif
+    glfwMakeContextCurrent(current ? gWorkerWindow : NULL);
+}
 
-    // Flip image vertically (optional, depending on your UV orientation)
-    stbi_set_flip_vertically_on_load(1);
 
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
+void UDestroyWorkerContext()
+{
+#ifdef __linux__
+    if (gEglWorkerContext != EGL_NO_CONTEXT)
+        eglDestroyContext(gEglDisplay, gEglWorkerContext);
+    gEglWorkerContext = EGL_NO_CONTEXT;
+#endif
+    if (gWorkerWindow)
+        glfwDestroyWindow(gWorkerWindow);
+    gWorkerWindow = nullptr;
+}
+
 
-    if (!image) {
-        std::cerr << "stbi_load failed to load texture: " << filename << std::endl;
-        std::cerr << "Reason: " << stbi_failure_reason() << std::endl;
+// Cache file for a program: FNV-1a of both sources plus the driver strings, since binaries are
+// only valid for the exact driver that produced them
+std::string UShaderCachePath(const std::string& vertexSource, const std::string& fragmentSource)
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const char* text)
+    {
+        for (const char* c = text; *c; ++c)
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+        hash = (hash ^ 0xFF) * 1099511628211ull; // Separator, so ("ab", "c") and ("a", "bc") differ
+    };
+    mix(vertexSource.c_str());
+    mix(fragmentSource.c_str());
+    mix((const char*)glGetString(GL_VENDOR));
+    mix((const char*)glGetString(GL_RENDERER));
+    mix((const char*)glGetString(GL_VERSION));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    return (fs::path(gShaderCacheDir) / name).string();
+}
+
+
+// Loads a cached binary into programId. A missing, corrupt or driver-rejected entry counts as a miss
+bool ULoadProgramBinary(GLuint programId, const std::string& path)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        ++gShaderCacheStats.misses;
         return false;
     }
 
-    glGenTextures(1, &textureId);
-    glBindTexture(GL_TEXTURE_2D, textureId);
-
-    // Texture wrapping and filtering
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    ShaderCacheHeader header;
+    std::vector<unsigned char> binary;
+    bool readOk = fread(&header, sizeof(header), 1, file) == 1 && header.magic == SHADER_CACHE_MAGIC;
 
-    // Handle formats
-    if (channels == 3) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+    // The stored length must be exactly what follows the header, before anything is allocated from it
+    if (readOk)
+    {
+        long remaining = fseek(file, 0, SEEK_END) == 0 ? ftell(file) - (long)sizeof(header) : -1;
+        readOk = remaining >= 0 && (uint64_t)remaining == header.length && fseek(file, (long)sizeof(header), SEEK_SET) == 0;
     }
-    else if (channels == 4) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    if (readOk)
+    {
+        binary.resize(header.length);
+        readOk = fread(binary.data(), 1, binary.size(), file) == binary.size();
     }
-    else {
-        std::cerr << "Unsupported image format: " << channels << " channels in " << filename << std::endl;
-        stbi_image_free(image);
-        return false;
+    fclose(file);
+
+    GLint success = GL_FALSE;
+    if (readOk)
+    {
+        glProgramBinary(programId, header.format, binary.data(), (GLsizei)binary.size());
+        glGetProgramiv(programId, GL_LINK_STATUS, &success);
     }
 
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(image);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!success)
+    {
+        // Stale (e.g. written by another driver build); rebuild from source and overwrite it
+        cout << "INFO: Shader cache entry " << path << " was rejected, recompiling" << endl;
+        ++gShaderCacheStats.misses;
+        return false;
+    }
 
+    float loadMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ++gShaderCacheStats.hits;
+    gShaderCacheStats.savedMs += header.compileMs - loadMs;
     return true;
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Writes the linked program's binary next to the other cache entries
+void USaveProgramBinary(GLuint programId, const std::string& path, float compileMs)
 {
-    glDeleteTextures(1, &textureId);  // Deletes the texture from GPU memory
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return; // The driver offers no binary formats
+
+    ShaderCacheHeader header;
+    header.magic = SHADER_CACHE_MAGIC;
+    header.compileMs = compileMs;
+    std::vector<unsigned char> binary(length);
+    glGetProgramBinary(programId, length, NULL, &header.format, binary.data());
+    header.length = (uint32_t)length;
+
+    std::error_code error;
+    fs::create_directories(gShaderCacheDir, error);
+
+    // Write to a temporary name first, so a crash never leaves a truncated entry behind
+    std::string temporaryPath = path + ".tmp";
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Could not write shader cache entry " << path << std::endl;
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+    ok = fclose(file) == 0 && ok;
+
+    if (ok)
+        fs::rename(temporaryPath, path, error);
+    if (!ok || error)
+        fs::remove(temporaryPath, error);
 }
 
-GLuint CompileShader(GLenum shaderType, const char* shaderSource, const char* shaderName)
+
+void UReportShaderCache()
 {
-    GLuint shaderId = glCreateShader(shaderType);
-    glShaderSource(shaderId, 1, &shaderSource, NULL);
-    glCompileShader(shaderId);
+    if (!gShaderCacheDir)
+        return;
 
-    GLint success;
-    char infoLog[512];
-    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+    cout << "INFO: Shader cache: " << gShaderCacheStats.hits << " hits, " << gShaderCacheStats.misses << " misses, "
+         << gShaderCacheStats.savedMs << " ms saved" << endl;
+}
 
-    if (!success)
+
+// Records every active uniform and attribute of a linked program, so draw code never queries by name
+void UReflectShaderProgram(ShaderProgram &program)
+{
+    program.uniforms.clear();
+    program.attributes.clear();
+
+    GLint count = 0;
+    GLint maxLength = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<char> name(maxLength > 0 ? maxLength : 1);
+
+    for (GLint i = 0; i < count; ++i)
     {
-        glGetShaderInfoLog(shaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::" << shaderName << "::COMPILATION_FAILED\n" << infoLog << std::endl;
-        return 0; // Invalid shader ID signals failure
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program.id, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+
+        // Members of uniform blocks have no location and are set through their buffer instead
+        GLint location = glGetUniformLocation(program.id, name.data());
+        if (location < 0)
+            continue;
+
+        std::string uniformName = name.data();
+        program.uniforms[uniformName] = location;
+
+        // Arrays are reported as "name[0]"; also accept the bare name
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            program.uniforms[uniformName.substr(0, bracket)] = location;
     }
 
-    return shaderId;
+    // Uniform blocks and the binding point each one reads from
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+    name.resize(maxLength > 0 ? maxLength : 1);
 
-// Implements the UCreateShaders function
-    bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint & programId)
+    for (GLint i = 0; i < count; ++i)
+    {
+        GLint binding;
+        glGetActiveUniformBlockName(program.id, i, (GLsizei)name.size(), NULL, name.data());
+        glGetActiveUniformBlockiv(program.id, i, GL_UNIFORM_BLOCK_BINDING, &binding);
+        program.uniformBlocks[name.data()] = binding;
+    }
+
+    glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    name.resize(maxLength > 0 ? maxLength : 1);
+
+    for (GLint i = 0; i < count; ++i)
     {
-        programId = glCreateProgram();
+        GLint size;
+        GLenum type;
+        glGetActiveAttrib(program.id, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+        program.attributes[name.data()] = glGetAttribLocation(program.id, name.data());
+    }
+}
+
+
+// Returns the cached location of a uniform. Debug builds flag names the program does not have
+// (misspelled, or optimized away because the shader never reads them)
+GLint UGetUniformHandle(const ShaderProgram &program, const char* name)
+{
+    auto it = program.uniforms.find(name);
+    if (it != program.uniforms.end())
+        return it->second;
+
+#ifndef NDEBUG
+    std::cout << "WARNING::SHADER::PROGRAM " << program.id << "::UNKNOWN_UNIFORM::" << name << std::endl;
+#endif
+    return -1; // glUniform* silently ignores location -1
+}
 
-        // Compile shaders
-        GLuint vertexShaderId = CompileShader(GL_VERTEX_SHADER, vtxShaderSource, "VERTEX");
-        if (!vertexShaderId) return false;
 
-        GLuint fragmentShaderId = CompileShader(GL_FRAGMENT_SHADER, fragShaderSource, "FRAGMENT");
-        if (!fragmentShaderId)
+// Resolves the uniform handles of every linked variant that has not been resolved yet
+void UResolveUniformHandles()
+{
+    for (auto& entry : gShaderVariants)
+    {
+        uint32_t key = entry.first;
+        ShaderVariant& variant = entry.second;
+        const ShaderProgram& program = variant.program;
+        MaterialUniforms& uniforms = variant.uniforms;
+        if (!program.id || variant.resolved)
+            continue;
+        variant.resolved = true;
+
+        // Only ask for what the variant uses, so debug builds warn about real mistakes only
+        bool lit = (key >> SHADER_LIGHT_SHIFT) > 0;
+        uniforms.uTexture = (key & SHADER_TEXTURED) ? UGetUniformHandle(program, "uTexture") : -1;
+        uniforms.uvScale = (key & SHADER_TEXTURED) ? UGetUniformHandle(program, "uvScale") : -1;
+        uniforms.positionScale = UGetUniformHandle(program, "positionScale");
+        uniforms.positionOffset = UGetUniformHandle(program, "positionOffset");
+        uniforms.model = (key & SHADER_INSTANCED) ? -1 : UGetUniformHandle(program, "model");
+        uniforms.instanceBase = (key & SHADER_INSTANCED) ? UGetUniformHandle(program, "instanceBase") : -1;
+        uniforms.normalMatrix = (key & SHADER_INSTANCED) || !lit ? -1 : UGetUniformHandle(program, "normalMatrix");
+        uniforms.materialColor = UGetUniformHandle(program, "materialColor");
+        uniforms.ambientStrength = lit ? UGetUniformHandle(program, "ambientStrength") : -1;
+        uniforms.specularIntensity = (key & SHADER_SPECULAR) ? UGetUniformHandle(program, "specularIntensity") : -1;
+        uniforms.highlightSize = (key & SHADER_SPECULAR) ? UGetUniformHandle(program, "highlightSize") : -1;
+
+        // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
+        if (uniforms.uTexture >= 0)
         {
-            glDeleteShader(vertexShaderId);
-            return false;
+            UUseProgram(program.id);
+            glUniform1i(uniforms.uTexture, 0); // We set the texture as texture unit 0
+            UUseProgram(0);
         }
+    }
+}
 
-        // Attach and link shaders
-        glAttachShader(programId, vertexShaderId);
-        glAttachShader(programId, fragmentShaderId);
-        glLinkProgram(programId);
 
-        GLint success;
-        char infoLog[512];
-        glGetProgramiv(programId, GL_LINK_STATUS, &success);
-        if (!success)
-        {
-            glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+// The scene's materials; the cube texture is attached once it has been requested
+void UInitializeMaterials()
+{
+    gCubeMaterial.features = SHADER_TEXTURED | SHADER_SPECULAR;
+    if (gPointLightCount > 0)
+        gCubeMaterial.features |= SHADER_CLUSTERED;     // So the startup batch compiles the clustered variant
+    gCubeMaterial.uvScale = glm::vec2(5.0f, 5.0f);
 
-            glDeleteShader(vertexShaderId);
-            glDeleteShader(fragmentShaderId);
-            return false;
+    // The lamp is a plain white shape: no texture, no lighting
+    gLampMaterial.lightCount = 0;
+}
+
+
+// The cheapest variant that draws a material: features whose result would not show are left out
+uint32_t UMaterialVariantKey(const Material& material, bool instanced)
+{
+    int lightCount = std::min(std::max(material.lightCount, 0), MAX_SHADER_LIGHTS);
+    uint32_t key = material.features & (SHADER_TEXTURED | SHADER_SPECULAR | SHADER_CLUSTERED);
+    if (lightCount == 0 || material.specularIntensity <= 0.0f)
+        key &= ~SHADER_SPECULAR;
+    if (lightCount == 0)
+        key &= ~SHADER_CLUSTERED;
+
+    // Deferred frames light every surface in the lighting pass, point lights included
+    if (gDeferredShading && lightCount > 0)
+        key = (key & ~SHADER_CLUSTERED) | SHADER_GBUFFER;
+    if (instanced)
+        key |= SHADER_INSTANCED;
+    return key | (uint32_t)lightCount << SHADER_LIGHT_SHIFT;
+}
+
+
+// The #define block that specializes the material shaders for a variant key
+std::string UShaderVariantDefines(uint32_t key)
+{
+    std::string defines;
+    defines += "#define SHADER_TEXTURED " + std::string((key & SHADER_TEXTURED) ? "1" : "0") + "\n";
+    defines += "#define SHADER_SPECULAR " + std::string((key & SHADER_SPECULAR) ? "1" : "0") + "\n";
+    defines += "#define SHADER_INSTANCED " + std::string((key & SHADER_INSTANCED) ? "1" : "0") + "\n";
+    defines += "#define SHADER_CLUSTERED " + std::string((key & SHADER_CLUSTERED) ? "1" : "0") + "\n";
+    defines += "#define SHADER_GBUFFER " + std::string((key & SHADER_GBUFFER) ? "1" : "0") + "\n";
+    defines += "#define SHADER_LIGHT_COUNT " + std::to_string(key >> SHADER_LIGHT_SHIFT) + "\n";
+    return defines;
+}
+
+
+// Readable variant name for log messages, e.g. "textured+specular+instanced, 1 light(s)"
+std::string UShaderVariantName(uint32_t key)
+{
+    std::string name;
+    if (key & SHADER_TEXTURED)
+        name += "textured+";
+    if (key & SHADER_SPECULAR)
+        name += "specular+";
+    if (key & SHADER_INSTANCED)
+        name += "instanced+";
+    if (key & SHADER_CLUSTERED)
+        name += "clustered+";
+    if (key & SHADER_GBUFFER)
+        name += "gbuffer+";
+    name = name.empty() ? "plain" : name.substr(0, name.size() - 1);
+    return name + ", " + std::to_string(key >> SHADER_LIGHT_SHIFT) + " light(s)";
+}
+
+
+// Adds a variant to a startup batch, unless it is already known
+void UQueueShaderVariant(ShaderBatch& batch, uint32_t key)
+{
+    if (gShaderVariants.count(key))
+        return;
+
+    // Map nodes never move, so the batch can keep a pointer to the program
+    ShaderVariant& variant = gShaderVariants[key];
+
+    PendingProgram pending;
+    pending.vertexSource = materialVertexShaderSource;
+    pending.fragmentSource = materialFragmentShaderSource;
+    pending.defines = UShaderVariantDefines(key);
+    pending.program = &variant.program;
+    batch.programs.push_back(pending);
+}
+
+
+// Returns a linked variant, compiling it now if this is its first use; nullptr if it failed to build
+const ShaderVariant* UGetShaderVariant(uint32_t key)
+{
+    auto it = gShaderVariants.find(key);
+    if (it == gShaderVariants.end())
+    {
+        ShaderBatch batch;
+        UQueueShaderVariant(batch, key);
+        UBeginShaderProgram(batch.programs[0]);
+        if (!UEndShaderProgram(batch.programs[0]))
+        {
+            std::cerr << "Failed to build shader variant " << UShaderVariantName(key) << std::endl;
+            UDestroyShaderProgram(gShaderVariants[key].program); // Remembered as failed, so it is not retried
+        }
+        else
+        {
+            cout << "INFO: Compiled shader variant " << UShaderVariantName(key) << " on first use" << endl;
+            UResolveUniformHandles();
         }
+        it = gShaderVariants.find(key);
+    }
+
+    return it->second.program.id ? &it->second : nullptr;
+}
 
-        // Cleanup shaders after successful link
-        glDeleteShader(vertexShaderId);
-        glDeleteShader(fragmentShaderId);
 
-        glUseProgram(programId);
-        return true;
+// Makes the material's variant current and sets its uniforms and texture for a draw of the mesh.
+// Returns nullptr when there is nothing to draw with; non-instanced callers still set the model matrix
+const ShaderVariant* UUseMaterial(const Material& material, bool instanced, const GLMesh& mesh)
+{
+    uint32_t key = UMaterialVariantKey(material, instanced);
+    const ShaderVariant* variant = UGetShaderVariant(key);
+    if (!variant)
+        return nullptr;
+
+    const MaterialUniforms& uniforms = variant->uniforms;
+    UUseProgram(variant->program.id);
+    glUniform3fv(uniforms.positionScale, 1, glm::value_ptr(mesh.positionScale));
+    glUniform3fv(uniforms.positionOffset, 1, glm::value_ptr(mesh.positionOffset));
+    glUniform3fv(uniforms.materialColor, 1, glm::value_ptr(material.color));
+    glUniform1f(uniforms.ambientStrength, material.ambientStrength);
+
+    if (key & SHADER_SPECULAR)
+    {
+        glUniform1f(uniforms.specularIntensity, material.specularIntensity);
+        glUniform1f(uniforms.highlightSize, material.highlightSize);
+    }
+
+    if (key & SHADER_TEXTURED)
+    {
+        glUniform2fv(uniforms.uvScale, 1, glm::value_ptr(material.uvScale));
+        UBindTexture(0, UResidentTexture(material.textureId));
+    }
+
+    return variant;
+}
+
+
+void UDestroyShaderVariants()
+{
+    for (auto& entry : gShaderVariants)
+        UDestroyShaderProgram(entry.second.program);
+    gShaderVariants.clear();
+}
 
 
-void UDestroyShaderProgram(GLuint programId)
+void UDestroyShaderProgram(ShaderProgram &program)
 {
-    glDeleteProgram(programId);
+    UDeleteProgram(program.id);
+    program.id = 0;
+    program.uniforms.clear();
+    program.attributes.clear();
 }